@@ -108,7 +108,8 @@ run $CC -fPIC -o sqlite3.o -c jimtcl/sqlite3/sqlite3.c \
     -DSQLITE_ENABLE_LOCKING_STYLE=0 -DSQLITE_OMIT_INCRBLOB
 
 # Build TMk
-C_SRC="tmake.c tm_crypto.c tm_target.c tm_update.c tm_core_cmds.c tm_ext_cmds.c"
+LIBS="-lpthread"
+C_SRC="tmake.c tm_crypto.c tm_arena.c tm_target.c tm_update.c tm_cache.c tm_snapshot.c tm_artifact.c tm_depfile.c tm_server.c tm_trace.c tm_jobs.c tm_exec.c tm_core_cmds.c tm_ext_cmds.c"
 
 MAKE_C_EXT="jimtcl/jimsh0 jimtcl/make-c-ext.tcl tm_ext_cmds.tcl"
 echo "$MAKE_C_EXT > tm_ext_cmds.c"
@@ -120,5 +121,5 @@ TM_MACHINE_ARCH=$(uname -m)
 
 run $CC -o tmk $CFLAGS -Ijimtcl -Ijimtcl/sqlite3 -Ljimtcl \
         -DTM_OPSYS="\"$TM_OPSYS\"" -DTM_MACHINE_ARCH="\"$TM_MACHINE_ARCH\"" \
-        $C_SRC sqlite3.o -ljim -lm
+        $C_SRC sqlite3.o -ljim -lm $LIBS
 
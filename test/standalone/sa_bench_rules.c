@@ -0,0 +1,109 @@
+/*
+
+Copyright (c) 2016, Andre Schalkwyk and Cory Burgett
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../../tm_target.h"
+
+#define DEFAULT_RULES 100000
+#define NUM_SOURCES   1000
+
+/* Builds a synthetic graph the way ruleCmd would: rule i depends on rules
+ * 2i+1 and 2i+2 (when they exist) and on one of NUM_SOURCES source files.
+ * Then sorts the graph, timing each step.
+ * Finally sorts a single chain of as many rules, which is as deep as a
+ * graph can get.
+ */
+
+static double seconds(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv)
+{
+    int nrules = DEFAULT_RULES;
+    tm_rule **sorted = NULL;
+    clock_t start;
+    char name[64];
+    int nsorted = 0;
+    int i;
+
+    if (argc > 1) {
+        nrules = atoi(argv[1]);
+    }
+
+    start = clock();
+    for (i = 0; i < nrules; i++) {
+        target_list *deps = NULL;
+
+        sprintf(name, "src%d.c", i % NUM_SOURCES);
+        deps = target_cons(name, deps);
+        if (2*i + 1 < nrules) {
+            sprintf(name, "t%d", 2*i + 1);
+            deps = target_cons(name, deps);
+        }
+        if (2*i + 2 < nrules) {
+            sprintf(name, "t%d", 2*i + 2);
+            deps = target_cons(name, deps);
+        }
+
+        sprintf(name, "t%d", i);
+        new_rule(name, deps, "exec true");
+        free_target_list(deps);
+    }
+    printf("define %d rules:  %.3f s\n", nrules, seconds(start));
+
+    start = clock();
+    sorted = topsort("t0", &tm_rule_index, &nsorted);
+    printf("topsort (%d rules): %.3f s\n", nsorted, seconds(start));
+    free(sorted);
+
+    for (i = 0; i < nrules; i++) {
+        target_list *deps = NULL;
+
+        if (i + 1 < nrules) {
+            sprintf(name, "c%d", i + 1);
+            deps = target_cons(name, deps);
+        }
+        sprintf(name, "c%d", i);
+        new_rule(name, deps, "exec true");
+        free_target_list(deps);
+    }
+
+    start = clock();
+    sorted = topsort("c0", &tm_rule_index, &nsorted);
+    printf("topsort (chain of %d): %.3f s\n", nsorted, seconds(start));
+    free(sorted);
+
+    free_graph();
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+/*
+
+Copyright (c) 2016, Andre Schalkwyk and Cory Burgett
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../../tm_target.h"
+
+#define DEFAULT_RULES 100000
+#define NUM_SOURCES   1000
+
+/* Builds the same synthetic graph as sa_bench_rules, then times the part
+ * of the out-of-date scan that asks whether each dependency of each rule
+ * was updated, with more and more of the rules marked as updated.  The
+ * time for a scan shouldn't depend on how many rules were updated.
+ */
+
+static double seconds(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv)
+{
+    int nrules = DEFAULT_RULES;
+    tm_rule **sorted = NULL;
+    clock_t start;
+    char name[64];
+    int nsorted = 0;
+    int step;
+    int i, j;
+
+    if (argc > 1) {
+        nrules = atoi(argv[1]);
+    }
+
+    for (i = 0; i < nrules; i++) {
+        target_list *deps = NULL;
+
+        sprintf(name, "src%d.c", i % NUM_SOURCES);
+        deps = target_cons(name, deps);
+        if (2*i + 1 < nrules) {
+            sprintf(name, "t%d", 2*i + 1);
+            deps = target_cons(name, deps);
+        }
+        if (2*i + 2 < nrules) {
+            sprintf(name, "t%d", 2*i + 2);
+            deps = target_cons(name, deps);
+        }
+
+        sprintf(name, "t%d", i);
+        new_rule(name, deps, "exec true");
+        free_target_list(deps);
+    }
+
+    sorted = topsort("t0", &tm_rule_index, &nsorted);
+
+    for (step = 0; step <= 4; step++) {
+        int nupdated = nsorted / 4 * step;
+        int found = 0;
+
+        for (i = 0; i < nsorted; i++) {
+            sorted[i]->updated = 0;
+        }
+        for (i = 0; i < nupdated; i++) {
+            mark_updated(sorted[i]);
+        }
+
+        start = clock();
+        for (i = 0; i < nsorted; i++) {
+            for (j = 0; j < sorted[i]->ndeps; j++) {
+                found += was_updated(sorted[i]->deps[j]->target);
+            }
+        }
+        printf("scan with %7d of %d updated: %.3f s (%d hits)\n",
+               nupdated, nsorted, seconds(start), found);
+    }
+
+    free(sorted);
+    free_graph();
+
+    return 0;
+}
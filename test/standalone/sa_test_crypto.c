@@ -38,19 +38,32 @@ void usage(int argc, char **arg);
 
 void usage(int argc, char **arg)
 {
-    printf("Usage : %s FILENAME\n\n", arg[0]);
+    printf("Usage : %s [sha1|xxh64] FILENAME\n\n", arg[0]);
     exit(USAGE_ERROR);
 }
 
 int main(int argc, char **argv)
 {
-    unsigned char digest[20];
-    unsigned char hash[41];
+    unsigned char digest[CRYPTO_HASH_SIZE];
+    char hash[CRYPTO_HASH_STRING_LENGTH];
+    int algorithm = tm_crypto_hash;
+    const char *file = argv[1];
 
-    tm_CryptoHashFile(argv[1], digest);
-    tm_CryptoHashToString(digest, hash);
+    if (argc == 3) {
+        algorithm = tm_CryptoFindHash(argv[1]);
+        file = argv[2];
+    } else if (argc != 2) {
+        usage(argc, argv);
+    }
 
-    printf("%s  %s\n", hash, argv[1]);
+    if (algorithm < 0) {
+        usage(argc, argv);
+    }
+
+    tm_CryptoHashFileWith(algorithm, file, digest);
+    tm_CryptoHashToStringWith(algorithm, digest, hash);
+
+    printf("%s  %s\n", hash, file);
 
     return 0;
 }
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tm_arena.h"
+
+/* Most allocations are small, so they're carved out of blocks this big */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+/* Every allocation is aligned suitably for any of these */
+typedef union arena_align {
+	long l;
+	double d;
+	void *p;
+} arena_align;
+
+#define ARENA_ALIGN(n) (((n) + sizeof(arena_align) - 1) & ~(sizeof(arena_align) - 1))
+
+/* The usable memory of a block starts right after its header */
+#define ARENA_HEADER ARENA_ALIGN(sizeof(tm_arena_block))
+
+
+/* Allocate size bytes from an arena.  Exits if memory runs out.
+ */
+void *arena_alloc(tm_arena *arena, size_t size)
+{
+	tm_arena_block *block = arena->blocks;
+	void *p;
+
+	size = ARENA_ALIGN(size ? size : 1);
+
+	if (!block || block->used + size > block->size) {
+		size_t blocksize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+
+		block = malloc(ARENA_HEADER + blocksize);
+		if (!block) {
+			fprintf(stderr, "ERROR: Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		block->used = 0;
+		block->size = blocksize;
+
+		/* An oversized block is used up right away, so put it behind the
+		 * current block, which might still have room */
+		if (arena->blocks && blocksize > ARENA_BLOCK_SIZE) {
+			block->next = arena->blocks->next;
+			arena->blocks->next = block;
+		} else {
+			block->next = arena->blocks;
+			arena->blocks = block;
+		}
+	}
+
+	p = (char *)block + ARENA_HEADER + block->used;
+	block->used += size;
+
+	return p;
+}
+
+/* Make a copy of a string in an arena.
+ */
+char *arena_strdup(tm_arena *arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *copy = arena_alloc(arena, len);
+
+	memcpy(copy, str, len);
+
+	return copy;
+}
+
+/* Free everything allocated from an arena.  The arena can be used again.
+ */
+void free_arena(tm_arena *arena)
+{
+	tm_arena_block *block = arena->blocks;
+
+	while (block) {
+		tm_arena_block *next = block->next;
+		free(block);
+		block = next;
+	}
+
+	arena->blocks = NULL;
+}
@@ -0,0 +1,24 @@
+#ifndef TM_ARENA_H
+#define TM_ARENA_H
+
+#include <stddef.h>
+
+/* A block of memory handed out by an arena */
+typedef struct tm_arena_block {
+	struct tm_arena_block *next;
+	size_t used;
+	size_t size;
+} tm_arena_block;
+
+/* An arena hands out memory in small pieces that are never freed one at
+ * a time: everything allocated from it is freed at once by free_arena().
+ */
+typedef struct tm_arena {
+	tm_arena_block *blocks;    /* the newest block first */
+} tm_arena;
+
+void *arena_alloc(tm_arena *arena, size_t size);
+char *arena_strdup(tm_arena *arena, const char *str);
+void free_arena(tm_arena *arena);
+
+#endif
@@ -0,0 +1,488 @@
+
+#define _DEFAULT_SOURCE   /* needed for link, lstat and fchmod */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <utime.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define JIM_EMBEDDED
+#include <jim.h>
+
+#include "tmake.h"
+#include "tm_crypto.h"
+#include "tm_artifact.h"
+
+/* The size of the artifact cache when TM_ARTIFACT_CACHE_SIZE isn't set */
+#define DEFAULT_BUDGET (1024ULL * 1024 * 1024)
+
+/* An artifact found while looking for ones to evict */
+typedef struct artifact_file {
+	char *path;
+	unsigned long long size;
+	time_t atime;    /* when it was last stored or restored */
+} artifact_file;
+
+
+/* Return the value of a setting from the command line (e.g., NAME=VALUE),
+ * a Tcl global, or the environment, in that order, or NULL.
+ */
+static const char *setting(Jim_Interp *interp, const char *name)
+{
+	char *param = malloc(strlen(name) + 11);
+	Jim_Obj *obj = NULL;
+
+	sprintf(param, "TM_PARAM(%s)", name);
+	obj = Jim_GetGlobalVariableStr(interp, param, JIM_NONE);
+	free(param);
+
+	if (!obj) {
+		obj = Jim_GetGlobalVariableStr(interp, name, JIM_NONE);
+	}
+	if (obj) {
+		return Jim_String(obj);
+	}
+
+	return getenv(name);
+}
+
+/* Parse a size like 500M or 20G into bytes, or return 0 if it's bad */
+static unsigned long long parse_size(const char *str)
+{
+	char *end = NULL;
+	unsigned long long size = strtoull(str, &end, 10);
+
+	switch (*end) {
+		case 'k': case 'K': size *= 1024ULL; end++; break;
+		case 'm': case 'M': size *= 1024ULL * 1024; end++; break;
+		case 'g': case 'G': size *= 1024ULL * 1024 * 1024; end++; break;
+		default: break;
+	}
+
+	return *end ? 0 : size;
+}
+
+/* Create a directory unless it's already there.  Returns 0 on success. */
+static int make_dir(const char *path)
+{
+	if (mkdir(path, 0777) == 0 || errno == EEXIST) {
+		return 0;
+	}
+	return -1;
+}
+
+/* Return the path of the artifact with a given key, to be freed by the
+ * caller.  Artifacts are spread over 256 subdirectories.
+ */
+static char *artifact_path(tm_artifacts *arts, const char *key)
+{
+	char *path = malloc(strlen(arts->dir) + strlen(key) + 5);
+
+	sprintf(path, "%s/%.2s/%s", arts->dir, key, key);
+
+	return path;
+}
+
+/* Copy the file src to dst, giving it the permissions in mode, by way of
+ * a temporary file so that dst is never seen half written.  Returns 0 on
+ * success.
+ */
+static int copy_file(const char *src, const char *dst, mode_t mode)
+{
+	char buff[64 * 1024];
+	char *tmp = malloc(strlen(dst) + 32);
+	FILE *in = NULL;
+	FILE *out = NULL;
+	size_t n;
+	int ret = -1;
+
+	sprintf(tmp, "%s.tmp%ld", dst, (long)getpid());
+
+	if (!(in = fopen(src, "rb")) || !(out = fopen(tmp, "wb"))) {
+		goto done;
+	}
+
+	while ((n = fread(buff, 1, sizeof(buff), in)) > 0) {
+		if (fwrite(buff, 1, n, out) != n) {
+			goto done;
+		}
+	}
+	if (ferror(in)) {
+		goto done;
+	}
+
+	if (fchmod(fileno(out), mode & 0777) == 0) {
+		ret = 0;
+	}
+	if (fclose(out) != 0 || (ret == 0 && rename(tmp, dst) != 0)) {
+		ret = -1;
+	}
+	out = NULL;
+
+	done:
+	if (in) fclose(in);
+	if (out) fclose(out);
+	if (ret != 0) remove(tmp);
+	free(tmp);
+
+	return ret;
+}
+
+
+/* Return the path of the file holding the digest of an artifact's
+ * contents, to be freed by the caller */
+static char *sum_path(const char *path)
+{
+	char *sum = malloc(strlen(path) + 5);
+
+	sprintf(sum, "%s.sum", path);
+
+	return sum;
+}
+
+/* Put the digest of file (always SHA-1, like the keys) in hash */
+static void file_sum(const char *file, char hash[CRYPTO_HASH_STRING_LENGTH])
+{
+	unsigned char digest[CRYPTO_HASH_SIZE];
+
+	tm_CryptoHashFileWith(TM_HASH_SHA1, file, digest);
+	tm_CryptoHashToStringWith(TM_HASH_SHA1, digest, hash);
+}
+
+/* Read the digest stored in the file sum into hash.  Returns 0 on success. */
+static int read_sum(const char *sum, char hash[CRYPTO_HASH_STRING_LENGTH])
+{
+	FILE *fp = fopen(sum, "r");
+	size_t n = 0;
+
+	if (fp) {
+		n = fread(hash, 1, CRYPTO_HASH_STRING_LENGTH - 1, fp);
+		fclose(fp);
+	}
+	hash[n] = '\0';
+
+	return n == CRYPTO_HASH_STRING_LENGTH - 1 ? 0 : -1;
+}
+
+/* Store hash in the file sum, by way of a temporary file like copy_file.
+ * Returns 0 on success.
+ */
+static int write_sum(const char *sum, const char hash[CRYPTO_HASH_STRING_LENGTH])
+{
+	char *tmp = malloc(strlen(sum) + 32);
+	FILE *fp = NULL;
+	int ret = -1;
+
+	sprintf(tmp, "%s.tmp%ld", sum, (long)getpid());
+
+	if ((fp = fopen(tmp, "w"))) {
+		ret = fputs(hash, fp) < 0 ? -1 : 0;
+		if (fclose(fp) != 0 || (ret == 0 && rename(tmp, sum) != 0)) {
+			ret = -1;
+		}
+	}
+	if (ret != 0) remove(tmp);
+	free(tmp);
+
+	return ret;
+}
+
+/* Set up the artifact cache, if TM_ARTIFACT_CACHE names a directory for
+ * it.  TM_ARTIFACT_CACHE_SIZE limits how big it gets (e.g., 20G).  The
+ * values of the parameters and the other globals (and procs) defined by
+ * the TMakefile go into every key, since any recipe might use them.
+ * Nothing is restored with -n.
+ */
+void artifacts_open(tm_artifacts *arts, Jim_Interp *interp)
+{
+	const char *dir = setting(interp, "TM_ARTIFACT_CACHE");
+	const char *size = setting(interp, "TM_ARTIFACT_CACHE_SIZE");
+	Jim_Obj *params = Jim_GetGlobalVariableStr(interp, "TM_PARAMS", JIM_NONE);
+	Jim_Obj *noexec = Jim_GetGlobalVariableStr(interp, "TM_NO_EXECUTE", JIM_NONE);
+	Jim_Obj *values = Jim_NewListObj(interp, NULL, 0);
+	const char *str = NULL;
+	int len = 0;
+	int i;
+
+	memset(arts, 0, sizeof(tm_artifacts));
+
+	if (!dir || !*dir || noexec) {
+		return;
+	}
+
+	if (make_dir(dir) != 0) {
+		fprintf(stderr, "WARNING: Unable to use %s as the artifact cache\n", dir);
+		return;
+	}
+
+	arts->dir = malloc(strlen(dir) + 1);
+	strcpy(arts->dir, dir);
+
+	arts->budget = size ? parse_size(size) : DEFAULT_BUDGET;
+	if (arts->budget == 0) {
+		fprintf(stderr, "WARNING: Bad TM_ARTIFACT_CACHE_SIZE %s\n", size);
+		arts->budget = DEFAULT_BUDGET;
+	}
+
+	/* The platform and each parameter's name and value */
+	Jim_IncrRefCount(values);
+	Jim_ListAppendElement(interp, values, Jim_NewStringObj(interp, TM_OPSYS "-" TM_MACHINE_ARCH, -1));
+	for (i = 0; params && i < Jim_ListLength(interp, params); i++) {
+		Jim_Obj *name = Jim_ListGetIndex(interp, params, i);
+		Jim_Obj *value = Jim_GetGlobalVariable(interp, name, JIM_NONE);
+
+		Jim_ListAppendElement(interp, values, name);
+		Jim_ListAppendElement(interp, values, value ? value : Jim_NewEmptyStringObj(interp));
+	}
+
+	/* and the globals and procs the TMakefile left for the recipes (like
+	 * $::CFLAGS), which they're as likely to use as the parameters */
+	if (Jim_Eval(interp, "tm_recipe_state") != JIM_OK) {
+		fprintf(stderr, "WARNING: Unable to use the artifact cache: %s\n",
+		        Jim_String(Jim_GetResult(interp)));
+		Jim_DecrRefCount(interp, values);
+		free(arts->dir);
+		arts->dir = NULL;
+		return;
+	}
+	Jim_ListAppendElement(interp, values, Jim_GetResult(interp));
+	str = Jim_GetString(values, &len);
+	tm_CryptoHashDataWith(TM_HASH_SHA1, (const unsigned char *)str, len, arts->params);
+	Jim_DecrRefCount(interp, values);
+}
+
+/* Make the key of an artifact from a description of everything that
+ * went into it (as built by the caller), the parameters, and the hash
+ * algorithm the description's digests were made with.
+ */
+void artifact_key(tm_artifacts *arts, const char *data, size_t len, char key[ARTIFACT_KEY_LENGTH])
+{
+	const char *alg = tm_CryptoHashName(tm_crypto_hash);
+	size_t alglen = strlen(alg) + 1;
+	unsigned char *buff = malloc(alglen + CRYPTO_HASH_SIZE + len);
+	unsigned char digest[CRYPTO_HASH_SIZE];
+
+	memcpy(buff, alg, alglen);
+	memcpy(buff + alglen, arts->params, CRYPTO_HASH_SIZE);
+	memcpy(buff + alglen + CRYPTO_HASH_SIZE, data, len);
+
+	tm_CryptoHashDataWith(TM_HASH_SHA1, buff, alglen + CRYPTO_HASH_SIZE + len, digest);
+	tm_CryptoHashToStringWith(TM_HASH_SHA1, digest, key);
+
+	free(buff);
+}
+
+/* Restore target from the artifact with the given key, if there is one.
+ * The target is hard linked to the artifact when possible, or else
+ * copied, and then checked against the digest stored with the artifact.
+ * One that doesn't match is thrown away.  Returns 1 if the target was
+ * restored, or else 0.
+ */
+int artifact_restore(tm_artifacts *arts, const char *key, const char *target)
+{
+	char *path = artifact_path(arts, key);
+	char *sum = sum_path(path);
+	char expected[CRYPTO_HASH_STRING_LENGTH];
+	char actual[CRYPTO_HASH_STRING_LENGTH];
+	struct stat sb;
+	int ret = 0;
+
+	if (stat(path, &sb) == 0 && S_ISREG(sb.st_mode) && read_sum(sum, expected) == 0) {
+		remove(target);
+		if (link(path, target) == 0 || copy_file(path, target, sb.st_mode | S_IWUSR) == 0) {
+			file_sum(target, actual);
+			if (strcmp(actual, expected) == 0) {
+				/* mark it as recently used */
+				utime(path, NULL);
+				ret = 1;
+			} else {
+				fprintf(stderr, "WARNING: Discarding the artifact for %s, which was changed since it was stored\n", target);
+				remove(target);
+				remove(path);
+				remove(sum);
+			}
+		}
+	}
+
+	if (ret) {
+		arts->hits++;
+	} else {
+		arts->misses++;
+	}
+
+	free(sum);
+	free(path);
+	return ret;
+}
+
+/* Store a copy of target as the artifact with the given key, along with
+ * the digest of its contents.  The copy isn't writable, so a target
+ * restored as a hard link to it can't be written through by mistake.
+ * Failures are only warned about: the target will just be made again.
+ */
+void artifact_store(tm_artifacts *arts, const char *key, const char *target)
+{
+	char *path = artifact_path(arts, key);
+	char *sum = sum_path(path);
+	char *subdir = malloc(strlen(arts->dir) + 4);
+	char hash[CRYPTO_HASH_STRING_LENGTH];
+	struct stat sb;
+
+	sprintf(subdir, "%s/%.2s", arts->dir, key);
+
+	if (stat(path, &sb) != 0 || access(sum, F_OK) != 0) {
+		if (stat(target, &sb) == 0 && make_dir(subdir) == 0
+		&&  copy_file(target, path, sb.st_mode & ~(mode_t)0222) == 0) {
+			file_sum(path, hash);
+			if (write_sum(sum, hash) == 0) {
+				arts->stored++;
+			} else {
+				remove(path);
+				fprintf(stderr, "WARNING: Unable to store %s in the artifact cache\n", target);
+			}
+		} else {
+			fprintf(stderr, "WARNING: Unable to store %s in the artifact cache\n", target);
+		}
+	}
+
+	free(subdir);
+	free(sum);
+	free(path);
+}
+
+/* If target is one of several hard links to a file (such as a target
+ * restored from the artifact cache), replace it with a copy of its own,
+ * so that writing to it can't change the others.  Done before every
+ * recipe, whether the artifact cache is in use or not.
+ */
+void artifact_unshare(const char *target)
+{
+	struct stat sb;
+
+	if (lstat(target, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_nlink > 1
+	&&  copy_file(target, target, sb.st_mode | S_IWUSR) != 0) {
+		/* the recipe will just have to make it from scratch */
+		remove(target);
+	}
+}
+
+/* Sort artifacts least recently used first */
+static int compare_atime(const void *a, const void *b)
+{
+	const artifact_file *fa = a;
+	const artifact_file *fb = b;
+
+	return (fa->atime > fb->atime) - (fa->atime < fb->atime);
+}
+
+/* Evict the least recently used artifacts until the cache fits in its
+ * budget.  Artifacts that are in use by another TMk could be evicted
+ * out from under it, but that only costs it a restore that fails.
+ */
+static void evict(tm_artifacts *arts)
+{
+	artifact_file *files = NULL;
+	unsigned long long total = 0;
+	int nfiles = 0;
+	int size = 0;
+	DIR *top = opendir(arts->dir);
+	struct dirent *sub;
+	int i;
+
+	if (!top) {
+		return;
+	}
+
+	while ((sub = readdir(top))) {
+		char *subdir;
+		DIR *dir;
+		struct dirent *ent;
+
+		if (strlen(sub->d_name) != 2) {
+			continue;
+		}
+
+		subdir = malloc(strlen(arts->dir) + 4);
+		sprintf(subdir, "%s/%s", arts->dir, sub->d_name);
+
+		if ((dir = opendir(subdir))) {
+			while ((ent = readdir(dir))) {
+				char *path;
+				struct stat sb;
+
+				/* Digests go with their artifacts */
+				if (ent->d_name[0] == '.' || strstr(ent->d_name, ".sum")) {
+					continue;
+				}
+
+				path = malloc(strlen(subdir) + strlen(ent->d_name) + 2);
+				sprintf(path, "%s/%s", subdir, ent->d_name);
+
+				if (lstat(path, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+					free(path);
+					continue;
+				}
+
+				if (nfiles == size) {
+					size = size ? size * 2 : 256;
+					files = realloc(files, size * sizeof(artifact_file));
+				}
+				files[nfiles].path = path;
+				files[nfiles].size = sb.st_size;
+				files[nfiles].atime = sb.st_mtime;
+				nfiles++;
+				total += sb.st_size;
+			}
+			closedir(dir);
+		}
+		free(subdir);
+	}
+	closedir(top);
+
+	if (total > arts->budget) {
+		qsort(files, nfiles, sizeof(artifact_file), compare_atime);
+
+		for (i = 0; i < nfiles && total > arts->budget; i++) {
+			if (remove(files[i].path) == 0) {
+				char *sum = sum_path(files[i].path);
+
+				remove(sum);
+				free(sum);
+				total -= files[i].size;
+				arts->evicted++;
+			}
+		}
+	}
+
+	for (i = 0; i < nfiles; i++) {
+		free(files[i].path);
+	}
+	free(files);
+}
+
+/* Bring the artifact cache within its budget and free its settings */
+void artifacts_close(tm_artifacts *arts)
+{
+	if (!arts->dir) {
+		return;
+	}
+
+	if (arts->stored > 0) {
+		evict(arts);
+	}
+
+	free(arts->dir);
+	arts->dir = NULL;
+}
+
+/* Print statistics about how the artifact cache was used */
+void artifacts_summary(tm_artifacts *arts)
+{
+	printf("Artifacts: %d restored, %d not found, %d stored, %d evicted\n",
+	       arts->hits, arts->misses, arts->stored, arts->evicted);
+}
@@ -0,0 +1,40 @@
+#ifndef TM_ARTIFACT_H
+#define TM_ARTIFACT_H
+
+#include <stddef.h>
+
+#define JIM_EMBEDDED
+#include <jim.h>
+
+#include "tm_crypto.h"
+
+/* The key of an artifact is always a SHA-1 (whatever .tmcache is using),
+ * since unlike a hash in .tmcache it's shared with other builds */
+#define ARTIFACT_KEY_LENGTH CRYPTO_HASH_STRING_LENGTH
+
+/* A directory of files made by recipes, shared between TMakefiles (and
+ * checkouts, and users), indexed by a key made from everything that
+ * went into making them.  When a rule's key is found, its target is
+ * restored from the directory instead of evaluating its recipe.
+ */
+typedef struct tm_artifacts {
+	char *dir;                      /* NULL if the artifact cache is off */
+	unsigned long long budget;      /* in bytes */
+	unsigned char params[CRYPTO_HASH_SIZE];
+
+	/* statistics for the summary */
+	int hits;
+	int misses;
+	int stored;
+	int evicted;
+} tm_artifacts;
+
+void artifacts_open(tm_artifacts *arts, Jim_Interp *interp);
+void artifact_key(tm_artifacts *arts, const char *data, size_t len, char key[ARTIFACT_KEY_LENGTH]);
+int artifact_restore(tm_artifacts *arts, const char *key, const char *target);
+void artifact_store(tm_artifacts *arts, const char *key, const char *target);
+void artifact_unshare(const char *target);
+void artifacts_close(tm_artifacts *arts);
+void artifacts_summary(tm_artifacts *arts);
+
+#endif
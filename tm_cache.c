@@ -0,0 +1,1258 @@
+
+#define _DEFAULT_SOURCE   /* needed for gettimeofday and getpid */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <sqlite3.h>
+
+#include "tmake.h"
+#include "tm_crypto.h"
+#include "tm_target.h"
+#include "tm_cache.h"
+#include "tm_trace.h"
+
+
+/* The schema version init_schema() brings the database up to */
+#define SCHEMA_VERSION 7
+
+/* The cache to commit if TMk exits early, and the process that opened it
+ * (recipes evaluated in child processes must never touch it).
+ */
+static tm_cache *exit_cache = NULL;
+static pid_t exit_cache_owner = 0;
+
+
+/* Current wall clock time in seconds */
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Commit whatever's pending if TMk exits without closing the cache (e.g.,
+ * because a recipe failed), so the targets that were made stay made.
+ */
+static void commit_at_exit(void)
+{
+	if (exit_cache && exit_cache_owner == getpid()) {
+		cache_flush(exit_cache);
+	}
+}
+
+
+/* The value of a hex digit */
+static int hex_value(char c)
+{
+	return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+/* Bind a hash (a string of hex digits) to column col of a statement as
+ * the digest it stands for, or NULL if hash is NULL.
+ */
+static void bind_digest(sqlite3_stmt *stm, int col, const char *hash)
+{
+	unsigned char digest[CRYPTO_HASH_SIZE];
+	size_t len = 0;
+
+	if (!hash) {
+		sqlite3_bind_null(stm, col);
+		return;
+	}
+
+	for (; len < CRYPTO_HASH_SIZE && hash[2 * len] && hash[2 * len + 1]; len++) {
+		digest[len] = hex_value(hash[2 * len]) << 4 | hex_value(hash[2 * len + 1]);
+	}
+	sqlite3_bind_blob(stm, col, digest, len, SQLITE_TRANSIENT);
+}
+
+/* Read the digest in column col of a row back into a hash string.
+ * Returns 0 if the column is NULL (or isn't a digest).
+ */
+static int column_digest(sqlite3_stmt *stm, int col, char hash[CRYPTO_HASH_STRING_LENGTH])
+{
+	const unsigned char *digest = sqlite3_column_blob(stm, col);
+	int len = sqlite3_column_bytes(stm, col);
+	int i;
+
+	if (!digest || len > CRYPTO_HASH_SIZE) {
+		return 0;
+	}
+
+	for (i = 0; i < len; i++) {
+		hash[2 * i]     = "0123456789abcdef"[digest[i] >> 4];
+		hash[2 * i + 1] = "0123456789abcdef"[digest[i] & 0xf];
+	}
+	hash[2 * len] = '\0';
+
+	return 1;
+}
+
+/* Return the Id of path in TMPath, adding it if it isn't there yet, or 0
+ * if it can't be added.
+ */
+static sqlite3_int64 path_id(tm_cache *cache, const char *path)
+{
+	sqlite3_int64 id = 0;
+	int tries;
+
+	/* If another TMk adds the path first, the insert fails, so look again */
+	for (tries = 0; id == 0 && tries < 2; tries++) {
+		sqlite3_bind_text(cache->find_path, 1, path, -1, SQLITE_STATIC);
+		if (sqlite3_step(cache->find_path) == SQLITE_ROW) {
+			id = sqlite3_column_int64(cache->find_path, 0);
+		}
+		sqlite3_reset(cache->find_path);
+
+		if (id == 0) {
+			sqlite3_bind_text(cache->add_path, 1, path, -1, SQLITE_STATIC);
+			if (sqlite3_step(cache->add_path) == SQLITE_DONE) {
+				id = sqlite3_last_insert_rowid(cache->db);
+			}
+			sqlite3_reset(cache->add_path);
+		}
+	}
+
+	return id;
+}
+
+/* Record that the target with the Id target in TMPath depends on dep */
+static int store_dep(tm_cache *cache, sqlite3_int64 target, int position, sqlite3_int64 dep)
+{
+	int sqlrc;
+
+	sqlite3_bind_int64(cache->add_dep, 1, cache->tmfile_path);
+	sqlite3_bind_int64(cache->add_dep, 2, target);
+	sqlite3_bind_int(cache->add_dep, 3, position);
+	sqlite3_bind_int64(cache->add_dep, 4, dep);
+	sqlrc = sqlite3_step(cache->add_dep);
+	sqlite3_reset(cache->add_dep);
+
+	return sqlrc == SQLITE_DONE ? 0 : -1;
+}
+
+/* Prepare the statements used to write to the cache */
+static int prepare_statements(tm_cache *cache)
+{
+	int sqlrc;
+
+	sqlrc = sqlite3_prepare_v2(cache->db,
+		"INSERT OR REPLACE INTO TMTarget "
+		"(TMakefile, Target, Hash, Size, MTime, Inode, Device, Output, Scanned, Duration) "
+		"VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)",
+		-1, &cache->upsert, NULL);
+	if (sqlrc == SQLITE_OK) {
+		sqlrc = sqlite3_prepare_v2(cache->db,
+			"UPDATE TMTarget SET Size = ?, MTime = ?, Inode = ?, Device = ? "
+			"WHERE TMakefile = ? AND Target = ?",
+			-1, &cache->refresh, NULL);
+	}
+	if (sqlrc == SQLITE_OK) {
+		sqlrc = sqlite3_prepare_v2(cache->db,
+			"SELECT Id FROM TMPath WHERE Path = ?",
+			-1, &cache->find_path, NULL);
+	}
+	if (sqlrc == SQLITE_OK) {
+		sqlrc = sqlite3_prepare_v2(cache->db,
+			"INSERT INTO TMPath (Path) VALUES (?)",
+			-1, &cache->add_path, NULL);
+	}
+	if (sqlrc == SQLITE_OK) {
+		sqlrc = sqlite3_prepare_v2(cache->db,
+			"DELETE FROM TMDep WHERE TMakefile = ? AND Target = ?",
+			-1, &cache->clear_deps, NULL);
+	}
+	if (sqlrc == SQLITE_OK) {
+		sqlrc = sqlite3_prepare_v2(cache->db,
+			"INSERT OR REPLACE INTO TMDep (TMakefile, Target, Position, Dep) "
+			"VALUES (?, ?, ?, ?)",
+			-1, &cache->add_dep, NULL);
+	}
+
+	return sqlrc;
+}
+
+static void finalize_statements(tm_cache *cache)
+{
+	sqlite3_finalize(cache->upsert);
+	sqlite3_finalize(cache->refresh);
+	sqlite3_finalize(cache->find_path);
+	sqlite3_finalize(cache->add_path);
+	sqlite3_finalize(cache->clear_deps);
+	sqlite3_finalize(cache->add_dep);
+}
+
+/* Copy the rows of the TMCache table schema version 6 had into TMTarget
+ * and TMDep, with their paths interned in TMPath and their hashes turned
+ * back into digests.  The number of rows copied is added to migrated.
+ */
+static int migrate_tmcache(sqlite3 *db, int *migrated, char **sqlerr)
+{
+	tm_cache cache;
+	sqlite3_stmt *stm = NULL;
+	int sqlrc;
+
+	memset(&cache, 0, sizeof(tm_cache));
+	cache.db = db;
+
+	sqlrc = prepare_statements(&cache);
+	if (sqlrc == SQLITE_OK) {
+		sqlrc = sqlite3_prepare_v2(db,
+			"SELECT TMakefile, Target, Hash, Size, MTime, Inode, Device, Output, Deps, Duration "
+			"FROM TMCache",
+			-1, &stm, NULL);
+	}
+
+	while (sqlrc == SQLITE_OK && sqlite3_step(stm) == SQLITE_ROW) {
+		const char *tmfile = (const char *)sqlite3_column_text(stm, 0);
+		const char *target = (const char *)sqlite3_column_text(stm, 1);
+		const char *hash = (const char *)sqlite3_column_text(stm, 2);
+		const char *deps = (const char *)sqlite3_column_text(stm, 8);
+		sqlite3_int64 path = 0;
+		int col;
+
+		if (!tmfile || !target || !hash) {
+			continue;
+		}
+
+		cache.tmfile_path = path_id(&cache, tmfile);
+		path = path_id(&cache, target);
+		if (!cache.tmfile_path || !path) {
+			sqlrc = SQLITE_ERROR;
+			break;
+		}
+
+		sqlite3_bind_int64(cache.upsert, 1, cache.tmfile_path);
+		sqlite3_bind_int64(cache.upsert, 2, path);
+		bind_digest(cache.upsert, 3, hash);
+		for (col = 3; col <= 6; col++) {
+			sqlite3_bind_value(cache.upsert, col + 1, sqlite3_column_value(stm, col));
+		}
+		bind_digest(cache.upsert, 8, (const char *)sqlite3_column_text(stm, 7));
+		sqlite3_bind_int(cache.upsert, 9, deps != NULL);
+		sqlite3_bind_value(cache.upsert, 10, sqlite3_column_value(stm, 9));
+		if (sqlite3_step(cache.upsert) != SQLITE_DONE) {
+			sqlrc = SQLITE_ERROR;
+		}
+		sqlite3_reset(cache.upsert);
+		(*migrated)++;
+
+		/* The names of the discovered dependencies are separated by newlines */
+		if (deps && *deps) {
+			const char *name = deps;
+			int position = 0;
+
+			while (sqlrc == SQLITE_OK) {
+				const char *end = strchr(name, '\n');
+				size_t len = end ? (size_t)(end - name) : strlen(name);
+				char *dep = malloc(len + 1);
+				sqlite3_int64 id;
+
+				memcpy(dep, name, len);
+				dep[len] = '\0';
+				if (len > 0) {
+					id = path_id(&cache, dep);
+					if (!id || store_dep(&cache, path, position++, id) != 0) {
+						sqlrc = SQLITE_ERROR;
+					}
+				}
+				free(dep);
+
+				if (!end) {
+					break;
+				}
+				name = end + 1;
+			}
+		}
+	}
+
+	if (sqlrc != SQLITE_OK) {
+		*sqlerr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+	}
+	sqlite3_finalize(stm);
+	finalize_statements(&cache);
+
+	return sqlrc;
+}
+
+
+/* The tables that have been the same since they were added */
+#define CREATE_TMCACHEINFO \
+	"CREATE TABLE TMCacheInfo (" \
+		"Key      TEXT PRIMARY KEY," \
+		"Value    TEXT" \
+	");"
+#define CREATE_TMSNAPSHOT \
+	"CREATE TABLE TMSnapshot (" \
+		"TMakefile    TEXT," \
+		"Key          TEXT," \
+		"Saved        REAL," \
+		"Data         BLOB," \
+	"PRIMARY KEY (TMakefile, Key)" \
+	");"
+
+/* Create the tables schema version 7 added */
+static int create_tables(sqlite3 *db, char **sqlerr)
+{
+	/* WITHOUT ROWID keeps each row in the primary key's B-tree, rather
+	 * than in a table with the key indexed separately, but needs
+	 * SQLite 3.8.2 */
+	const char *without_rowid = sqlite3_libversion_number() >= 3008002 ? " WITHOUT ROWID" : "";
+	char *sql = sqlite3_mprintf(
+		"CREATE TABLE TMPath ("
+			"Id           INTEGER PRIMARY KEY,"
+			"Path         TEXT UNIQUE"
+		");"
+		"CREATE TABLE TMTarget ("
+			"TMakefile    INTEGER,"
+			"Target       INTEGER,"
+			"Hash         BLOB,"
+			"Size         INTEGER,"
+			"MTime        INTEGER,"
+			"Inode        INTEGER,"
+			"Device       INTEGER,"
+			"Output       BLOB,"
+			"Scanned      INTEGER,"
+			"Duration     REAL,"
+		"PRIMARY KEY (TMakefile, Target)"
+		")%s;"
+		"CREATE TABLE TMDep ("
+			"TMakefile    INTEGER,"
+			"Target       INTEGER,"
+			"Position     INTEGER,"
+			"Dep          INTEGER,"
+		"PRIMARY KEY (TMakefile, Target, Position)"
+		")%s;",
+		without_rowid, without_rowid
+	);
+	int sqlrc = sqlite3_exec(db, sql, NULL, NULL, sqlerr);
+
+	sqlite3_free(sql);
+	return sqlrc;
+}
+
+/* Return 1 if the database has a table called name, or else 0 */
+static int has_table(sqlite3 *db, const char *name)
+{
+	sqlite3_stmt *stm = NULL;
+	int found = 0;
+
+	if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?",
+	                       -1, &stm, NULL) == SQLITE_OK) {
+		sqlite3_bind_text(stm, 1, name, -1, SQLITE_STATIC);
+		found = sqlite3_step(stm) == SQLITE_ROW;
+	}
+	sqlite3_finalize(stm);
+
+	return found;
+}
+
+/* Bring the tables from schema version up to date, or create the current
+ * ones if there are none yet.  The number of TMCache rows copied into the
+ * new tables is added to migrated.  Returns SQLITE_OK on success, or else
+ * an SQLite error code with an error message stored in sqlerr (to be freed
+ * with sqlite3_free).
+ *
+ * Schema versions (kept in PRAGMA user_version):
+ *   0 - TMakefile, Target, Hash
+ *   1 - adds Size, MTime, Inode and Device for the stat fast path
+ *   2 - adds TMCacheInfo, which records the hash algorithm in use
+ *   3 - adds Output, the hash of the file a recipe made
+ *   4 - adds Deps, the dependencies discovered from a rule's depfile
+ *   5 - adds Duration, how many seconds a rule's recipe last took
+ *   6 - adds TMSnapshot, the evaluated TMakefiles (see tm_snapshot.c)
+ *   7 - replaces TMCache with TMTarget, keyed by paths interned in
+ *       TMPath, with the hashes stored as digests, and TMDep, which
+ *       holds Deps as one row for each discovered dependency
+ */
+static int upgrade_schema(sqlite3 *db, int version, int *migrated, char **sqlerr)
+{
+	int sqlrc = SQLITE_OK;
+
+	/* A new database needn't go through the old versions */
+	if (version == 0 && !has_table(db, "TMCache")) {
+		sqlrc = sqlite3_exec(db, CREATE_TMCACHEINFO CREATE_TMSNAPSHOT, NULL, NULL, sqlerr);
+		if (sqlrc == SQLITE_OK) {
+			sqlrc = create_tables(db, sqlerr);
+		}
+		if (sqlrc == SQLITE_OK) {
+			sqlrc = sqlite3_exec(db, "PRAGMA user_version = 7;", NULL, NULL, sqlerr);
+		}
+		return sqlrc;
+	}
+
+	if (version < 1) {
+		sqlrc = sqlite3_exec(db,
+			"CREATE TABLE IF NOT EXISTS TMCache ("
+				"TMakefile    TEXT,"
+				"Target       TEXT,"
+				"Hash         TEXT,"
+			"CONSTRAINT OneFileTarget UNIQUE (TMakefile, Target) ON CONFLICT REPLACE"
+			");"
+			"ALTER TABLE TMCache ADD COLUMN Size   INTEGER;"
+			"ALTER TABLE TMCache ADD COLUMN MTime  INTEGER;"
+			"ALTER TABLE TMCache ADD COLUMN Inode  INTEGER;"
+			"ALTER TABLE TMCache ADD COLUMN Device INTEGER;"
+			"PRAGMA user_version = 1;",
+			NULL, NULL, sqlerr
+		);
+		if (sqlrc != SQLITE_OK) {
+			return sqlrc;
+		}
+	}
+
+	if (version < 2) {
+		sqlrc = sqlite3_exec(db,
+			CREATE_TMCACHEINFO
+			"PRAGMA user_version = 2;",
+			NULL, NULL, sqlerr
+		);
+		if (sqlrc != SQLITE_OK) {
+			return sqlrc;
+		}
+	}
+
+	if (version < 3) {
+		sqlrc = sqlite3_exec(db,
+			"ALTER TABLE TMCache ADD COLUMN Output TEXT;"
+			"PRAGMA user_version = 3;",
+			NULL, NULL, sqlerr
+		);
+		if (sqlrc != SQLITE_OK) {
+			return sqlrc;
+		}
+	}
+
+	if (version < 4) {
+		sqlrc = sqlite3_exec(db,
+			"ALTER TABLE TMCache ADD COLUMN Deps TEXT;"
+			"PRAGMA user_version = 4;",
+			NULL, NULL, sqlerr
+		);
+		if (sqlrc != SQLITE_OK) {
+			return sqlrc;
+		}
+	}
+
+	if (version < 5) {
+		sqlrc = sqlite3_exec(db,
+			"ALTER TABLE TMCache ADD COLUMN Duration REAL;"
+			"PRAGMA user_version = 5;",
+			NULL, NULL, sqlerr
+		);
+		if (sqlrc != SQLITE_OK) {
+			return sqlrc;
+		}
+	}
+
+	if (version < 6) {
+		sqlrc = sqlite3_exec(db,
+			CREATE_TMSNAPSHOT
+			"PRAGMA user_version = 6;",
+			NULL, NULL, sqlerr
+		);
+		if (sqlrc != SQLITE_OK) {
+			return sqlrc;
+		}
+	}
+
+	if (version < 7) {
+		sqlrc = create_tables(db, sqlerr);
+		if (sqlrc == SQLITE_OK) {
+			sqlrc = migrate_tmcache(db, migrated, sqlerr);
+		}
+		if (sqlrc == SQLITE_OK) {
+			sqlrc = sqlite3_exec(db,
+				"DROP TABLE TMCache;"
+				"PRAGMA user_version = 7;",
+				NULL, NULL, sqlerr
+			);
+		}
+		if (sqlrc != SQLITE_OK) {
+			return sqlrc;
+		}
+	}
+
+	return sqlrc;
+}
+
+/* The schema version of the database, or 0 if it has no tables yet */
+static int schema_version(sqlite3 *db)
+{
+	sqlite3_stmt *stm = NULL;
+	int version = 0;
+
+	if (sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &stm, NULL) == SQLITE_OK
+	&&  sqlite3_step(stm) == SQLITE_ROW) {
+		version = sqlite3_column_int(stm, 0);
+	}
+	sqlite3_finalize(stm);
+
+	return version;
+}
+
+/* Return 1 if the cached hashes were made with the algorithm TMk is using
+ * now, or else 0.
+ */
+static int same_hash(sqlite3 *db)
+{
+	sqlite3_stmt *stm = NULL;
+	const char *cached = NULL;
+	int same = 0;
+
+	if (sqlite3_prepare_v2(db, "SELECT Value FROM TMCacheInfo WHERE Key = 'Hash'",
+	                       -1, &stm, NULL) == SQLITE_OK
+	&&  sqlite3_step(stm) == SQLITE_ROW) {
+		cached = (const char *)sqlite3_column_text(stm, 0);
+		same = cached && strcmp(cached, tm_CryptoHashName(tm_crypto_hash)) == 0;
+	}
+	sqlite3_finalize(stm);
+
+	return same;
+}
+
+/* Create the tables if needed, and bring older ones up to date.  If the
+ * cached hashes were made with a different algorithm than the one TMk is
+ * using now, they're all thrown away.
+ * Returns SQLITE_OK on success, or else an SQLite error code with an
+ * error message stored in sqlerr (to be freed with sqlite3_free).
+ */
+static int init_schema(sqlite3 *db, char **sqlerr)
+{
+	int version = schema_version(db);
+	int migrated = 0;
+	int sqlrc;
+
+	/* Usually there's nothing to do, so nothing to lock the database for */
+	if (version == SCHEMA_VERSION && same_hash(db)) {
+		return SQLITE_OK;
+	}
+
+	/* Other TMks (say, started by the same -j) may be setting up the same
+	 * database, so take the write lock before looking again, and make all
+	 * the changes at once */
+	sqlrc = sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, sqlerr);
+	if (sqlrc != SQLITE_OK) {
+		return sqlrc;
+	}
+
+	version = schema_version(db);
+	sqlrc = upgrade_schema(db, version, &migrated, sqlerr);
+
+	if (sqlrc == SQLITE_OK && !same_hash(db)) {
+		char *sql = sqlite3_mprintf(
+			"DELETE FROM TMTarget;"
+			"DELETE FROM TMDep;"
+			"DELETE FROM TMSnapshot;"
+			"INSERT OR REPLACE INTO TMCacheInfo (Key, Value) VALUES ('Hash', %Q);",
+			tm_CryptoHashName(tm_crypto_hash)
+		);
+
+		sqlrc = sqlite3_exec(db, sql, NULL, NULL, sqlerr);
+		sqlite3_free(sql);
+	}
+	if (sqlrc == SQLITE_OK) {
+		sqlrc = sqlite3_exec(db, "COMMIT", NULL, NULL, sqlerr);
+	}
+	if (sqlrc != SQLITE_OK) {
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+		return sqlrc;
+	}
+
+	/* Give back the space TMCache took (not essential) */
+	if (migrated > 0) {
+		sqlite3_exec(db, "VACUUM", NULL, NULL, NULL);
+	}
+
+	return SQLITE_OK;
+}
+
+
+/* Open the TMk database in the current directory, creating its tables
+ * or bringing them up to date as needed.  Returns 0 on success, or
+ * prints an error and returns -1.
+ */
+int cache_connect(sqlite3 **db)
+{
+	char *sqlerr = NULL;
+	int sqlrc;
+
+	sqlrc = sqlite3_open(TM_CACHE, db);
+	if (sqlrc != SQLITE_OK) {
+		fprintf(stderr, "ERROR: Unable to open " TM_CACHE " database\n");
+		return -1;
+	}
+
+	/* WAL with synchronous=NORMAL means commits don't wait for an fsync.
+	 * Neither is essential, so failures are ignored.
+	 */
+	sqlite3_exec(*db, "PRAGMA journal_mode = WAL", NULL, NULL, NULL);
+	sqlite3_exec(*db, "PRAGMA synchronous = NORMAL", NULL, NULL, NULL);
+
+	/* Another TMk working in this directory (e.g., a recursive one) may
+	 * be in the middle of a write.
+	 */
+	sqlite3_busy_timeout(*db, 10000);
+
+	sqlrc = init_schema(*db, &sqlerr);
+	if (sqlrc != SQLITE_OK) {
+		fprintf(stderr, "ERROR: Unable to create database schema: %s\n", sqlerr);
+		sqlite3_free(sqlerr);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Open the cache for the TMakefile tmfile.
+ * Sets up the schema and prepares the statements used to write to the
+ * cache.  Returns 0 on success, or prints an error and returns -1.
+ */
+int cache_open(tm_cache *cache, const char *tmfile)
+{
+	double start = now();
+	int sqlrc;
+
+	memset(cache, 0, sizeof(tm_cache));
+	cache->tmfile = tmfile;
+
+	if (cache_connect(&cache->db) != 0) {
+		return -1;
+	}
+
+	sqlrc = prepare_statements(cache);
+	if (sqlrc == SQLITE_OK) {
+		cache->tmfile_path = path_id(cache, tmfile);
+	}
+	if (sqlrc != SQLITE_OK || cache->tmfile_path == 0) {
+		fprintf(stderr, "ERROR: Unable to prepare database statements: %s\n",
+		        sqlite3_errmsg(cache->db));
+		return -1;
+	}
+
+	if (!exit_cache) {
+		atexit(commit_at_exit);
+	}
+	exit_cache = cache;
+	exit_cache_owner = getpid();
+
+	cache->io_time += now() - start;
+	return 0;
+}
+
+/* Begin the write transaction if one isn't open already.  It takes the
+ * write lock straight away: path_id reads TMPath before adding to it, and
+ * a deferred transaction can't upgrade its read lock once another TMk has
+ * written, not even after waiting.
+ */
+static void begin_writes(tm_cache *cache)
+{
+	if (!cache->in_transaction) {
+		if (sqlite3_exec(cache->db, "BEGIN IMMEDIATE", NULL, NULL, NULL) == SQLITE_OK) {
+			cache->in_transaction = 1;
+		}
+	}
+}
+
+/* Add the dependencies discovered from depfiles on earlier runs to the
+ * rules that still have a depfile.  Done before loading the rows, so the
+ * discovered files get theirs.
+ */
+static void load_discovered(tm_cache *cache)
+{
+	sqlite3_stmt *stm = NULL;
+	sqlite3_int64 last = 0;
+	tm_rule *rule = NULL;
+
+	/* Start over with the rules whose dependencies are known, including
+	 * the ones with none */
+	if (sqlite3_prepare_v2(cache->db,
+	        "SELECT p.Path FROM TMTarget t JOIN TMPath p ON p.Id = t.Target "
+	        "WHERE t.TMakefile = ? AND t.Scanned",
+	        -1, &stm, NULL) != SQLITE_OK) {
+		return;
+	}
+	sqlite3_bind_int64(stm, 1, cache->tmfile_path);
+
+	while (sqlite3_step(stm) == SQLITE_ROW) {
+		const char *target = (const char *)sqlite3_column_text(stm, 0);
+
+		if (target && (rule = find_rule(target, &tm_rule_index)) && rule->depfile) {
+			clear_discovered_deps(rule);
+			rule->scanned = 1;
+		}
+	}
+	sqlite3_finalize(stm);
+	stm = NULL;
+
+	/* The rows for each target come together, in order */
+	if (sqlite3_prepare_v2(cache->db,
+	        "SELECT d.Target, t.Path, p.Path FROM TMDep d "
+	        "JOIN TMPath t ON t.Id = d.Target JOIN TMPath p ON p.Id = d.Dep "
+	        "WHERE d.TMakefile = ? ORDER BY d.Target, d.Position",
+	        -1, &stm, NULL) != SQLITE_OK) {
+		return;
+	}
+	sqlite3_bind_int64(stm, 1, cache->tmfile_path);
+
+	rule = NULL;
+	while (sqlite3_step(stm) == SQLITE_ROW) {
+		sqlite3_int64 id = sqlite3_column_int64(stm, 0);
+		const char *dep = (const char *)sqlite3_column_text(stm, 2);
+
+		if (id != last) {
+			const char *target = (const char *)sqlite3_column_text(stm, 1);
+
+			rule = target ? find_rule(target, &tm_rule_index) : NULL;
+			last = id;
+		}
+
+		if (rule && rule->depfile && rule->scanned && dep) {
+			add_discovered_dep(rule, dep);
+		}
+	}
+
+	sqlite3_finalize(stm);
+}
+
+/* Forget the rows for targets that no longer exist: ones that no rule
+ * makes (not even one made from a pattern for another goal, since those
+ * leave files behind) and that aren't files either.
+ */
+static void prune(tm_cache *cache, const sqlite3_int64 *paths, int npaths)
+{
+	sqlite3_stmt *stm = NULL;
+	int i;
+
+	if (npaths == 0 || sqlite3_prepare_v2(cache->db,
+	        "DELETE FROM TMTarget WHERE TMakefile = ? AND Target = ?",
+	        -1, &stm, NULL) != SQLITE_OK) {
+		return;
+	}
+
+	begin_writes(cache);
+	for (i = 0; i < npaths; i++) {
+		sqlite3_bind_int64(stm, 1, cache->tmfile_path);
+		sqlite3_bind_int64(stm, 2, paths[i]);
+		sqlite3_step(stm);
+		sqlite3_reset(stm);
+
+		sqlite3_bind_int64(cache->clear_deps, 1, cache->tmfile_path);
+		sqlite3_bind_int64(cache->clear_deps, 2, paths[i]);
+		sqlite3_step(cache->clear_deps);
+		sqlite3_reset(cache->clear_deps);
+	}
+	sqlite3_finalize(stm);
+
+	cache->pruned += npaths;
+}
+
+/* Load all the rows for this TMakefile and attach each one to the rule
+ * for its target.  Rows for targets without a rule are ignored, or
+ * pruned if the target isn't a file either.
+ */
+void cache_load(tm_cache *cache)
+{
+	sqlite3_stmt *stm = NULL;
+	sqlite3_int64 *gone = NULL;
+	int ngone = 0;
+	double start = now();
+	int n = 0;
+
+	load_discovered(cache);
+
+	if (sqlite3_prepare_v2(cache->db,
+	        "SELECT COUNT(*) FROM TMTarget WHERE TMakefile = ?",
+	        -1, &stm, NULL) != SQLITE_OK) {
+		goto done;
+	}
+	sqlite3_bind_int64(stm, 1, cache->tmfile_path);
+	if (sqlite3_step(stm) == SQLITE_ROW) {
+		n = sqlite3_column_int(stm, 0);
+	}
+	sqlite3_finalize(stm);
+	stm = NULL;
+
+	cache->entries = calloc(n > 0 ? n : 1, sizeof(tm_cache_entry));
+	gone = malloc((n > 0 ? n : 1) * sizeof(sqlite3_int64));
+
+	if (sqlite3_prepare_v2(cache->db,
+	        "SELECT p.Path, t.Target, t.Hash, t.Size, t.MTime, t.Inode, t.Device, t.Output, t.Duration "
+	        "FROM TMTarget t JOIN TMPath p ON p.Id = t.Target WHERE t.TMakefile = ?",
+	        -1, &stm, NULL) != SQLITE_OK) {
+		goto done;
+	}
+	sqlite3_bind_int64(stm, 1, cache->tmfile_path);
+
+	while (cache->nentries + ngone < n && sqlite3_step(stm) == SQLITE_ROW) {
+		const char *target = (const char *)sqlite3_column_text(stm, 0);
+		tm_rule *rule = NULL;
+		tm_cache_entry *entry = &cache->entries[cache->nentries];
+
+		if (!target || !(rule = find_rule(target, &tm_rule_index))) {
+			if (target && access(target, F_OK) != 0) {
+				gone[ngone++] = sqlite3_column_int64(stm, 1);
+			}
+			continue;
+		}
+
+		if (!column_digest(stm, 2, entry->hash)) {
+			continue;
+		}
+		cache->nentries++;
+
+		entry->path = sqlite3_column_int64(stm, 1);
+		if (sqlite3_column_type(stm, 3) != SQLITE_NULL) {
+			entry->have_stat = 1;
+			entry->st.size   = sqlite3_column_int64(stm, 3);
+			entry->st.mtime  = sqlite3_column_int64(stm, 4);
+			entry->st.inode  = sqlite3_column_int64(stm, 5);
+			entry->st.device = sqlite3_column_int64(stm, 6);
+		}
+		entry->have_output = column_digest(stm, 7, entry->output);
+		rule->duration = sqlite3_column_double(stm, 8);
+		rule->cache = entry;
+	}
+
+	sqlite3_finalize(stm);
+	stm = NULL;
+	prune(cache, gone, ngone);
+
+	done:
+	sqlite3_finalize(stm);
+	free(gone);
+	cache->loaded = cache->nentries;
+	cache->io_time += now() - start;
+}
+
+/* Return the cached state of a rule's target, or NULL if there isn't any.
+ */
+tm_cache_entry *cache_entry(tm_rule *rule)
+{
+	return rule->cache;
+}
+
+/* Bind the stat columns of a TMTarget statement, starting at column col.
+ * If st is NULL (not a file, or a racy one), the columns are set to NULL
+ * so that the file will be hashed the next time it's checked.
+ */
+static void bind_stat(sqlite3_stmt *stm, int col, const tm_file_stat *st)
+{
+	if (st && !st->racy) {
+		sqlite3_bind_int64(stm, col,     st->size);
+		sqlite3_bind_int64(stm, col + 1, st->mtime);
+		sqlite3_bind_int64(stm, col + 2, st->inode);
+		sqlite3_bind_int64(stm, col + 3, st->device);
+	} else {
+		sqlite3_bind_null(stm, col);
+		sqlite3_bind_null(stm, col + 1);
+		sqlite3_bind_null(stm, col + 2);
+		sqlite3_bind_null(stm, col + 3);
+	}
+}
+
+/* Remember the stat information in an entry, unless it's racy */
+static void entry_set_stat(tm_cache_entry *entry, const tm_file_stat *st)
+{
+	if (st && !st->racy) {
+		entry->st = *st;
+		entry->have_stat = 1;
+	} else {
+		entry->have_stat = 0;
+	}
+}
+
+/* Replace the rows in TMDep for a rule's target with its discovered
+ * dependencies, if they're known.
+ * Returns 0 on success, or -1 if the cache couldn't be written.
+ */
+static int store_deps(tm_cache *cache, tm_rule *rule)
+{
+	int i;
+
+	sqlite3_bind_int64(cache->clear_deps, 1, cache->tmfile_path);
+	sqlite3_bind_int64(cache->clear_deps, 2, rule->cache->path);
+	sqlite3_step(cache->clear_deps);
+	sqlite3_reset(cache->clear_deps);
+
+	if (!rule->scanned) {
+		return 0;
+	}
+
+	for (i = rule->ninputs; i < rule->ndeps; i++) {
+		tm_rule *dep = rule->deps[i];
+		sqlite3_int64 id = dep->cache && dep->cache->path ? dep->cache->path
+		                                                  : path_id(cache, dep->target);
+
+		if (!id || store_dep(cache, rule->cache->path, i - rule->ninputs, id) != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Store the hash (and, for files, stat information) of a target, along
+ * with the hash of the file its recipe made, if output isn't NULL, the
+ * dependencies discovered from its depfile, and how long its recipe took.
+ * Returns 0 on success, or -1 if the cache couldn't be written.
+ */
+int cache_store(tm_cache *cache, tm_rule *rule, const char *hash,
+                const tm_file_stat *st, const char *output)
+{
+	double start = now();
+	int sqlrc = SQLITE_ERROR;
+
+	if (!rule->cache) {
+		rule->cache = calloc(1, sizeof(tm_cache_entry));
+		cache->extra = realloc(cache->extra, (cache->nextra + 1) * sizeof(tm_cache_entry *));
+		cache->extra[cache->nextra++] = rule->cache;
+	}
+	strncpy(rule->cache->hash, hash, CRYPTO_HASH_STRING_LENGTH - 1);
+	entry_set_stat(rule->cache, st);
+	rule->cache->have_output = (output != NULL);
+	if (output) {
+		strncpy(rule->cache->output, output, CRYPTO_HASH_STRING_LENGTH - 1);
+	}
+
+	begin_writes(cache);
+
+	if (!rule->cache->path) {
+		rule->cache->path = path_id(cache, rule->target);
+	}
+
+	if (rule->cache->path) {
+		sqlite3_bind_int64(cache->upsert, 1, cache->tmfile_path);
+		sqlite3_bind_int64(cache->upsert, 2, rule->cache->path);
+		bind_digest(cache->upsert, 3, hash);
+		bind_stat(cache->upsert, 4, st);
+		bind_digest(cache->upsert, 8, output);
+		sqlite3_bind_int(cache->upsert, 9, rule->scanned);
+		if (rule->duration > 0) {
+			sqlite3_bind_double(cache->upsert, 10, rule->duration);
+		} else {
+			sqlite3_bind_null(cache->upsert, 10);
+		}
+		sqlrc = sqlite3_step(cache->upsert);
+		sqlite3_reset(cache->upsert);
+
+		if (sqlrc == SQLITE_DONE && store_deps(cache, rule) != 0) {
+			sqlrc = SQLITE_ERROR;
+		}
+	}
+
+	cache->stored++;
+	cache->io_time += now() - start;
+
+	return sqlrc == SQLITE_DONE ? 0 : -1;
+}
+
+/* Record new stat information for a target whose contents are unchanged.
+ * Failures aren't reported: the file will just get hashed again.
+ */
+void cache_store_stat(tm_cache *cache, tm_rule *rule, const tm_file_stat *st)
+{
+	double start = now();
+
+	if (!rule->cache || !rule->cache->path) {
+		return;
+	}
+	entry_set_stat(rule->cache, st);
+
+	begin_writes(cache);
+
+	bind_stat(cache->refresh, 1, st);
+	sqlite3_bind_int64(cache->refresh, 5, cache->tmfile_path);
+	sqlite3_bind_int64(cache->refresh, 6, rule->cache->path);
+	sqlite3_step(cache->refresh);
+	sqlite3_reset(cache->refresh);
+
+	cache->stored++;
+	cache->io_time += now() - start;
+}
+
+/* Commit any pending writes.
+ * TMk flushes before it waits on a recipe, so a TMk run by that recipe
+ * (sharing this cache) isn't locked out.
+ */
+void cache_flush(tm_cache *cache)
+{
+	tm_trace_mark mark;
+	double start = now();
+
+	if (cache->in_transaction) {
+		trace_begin(&mark);
+		if (sqlite3_exec(cache->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+			fprintf(stderr, "WARNING: Unable to write to " TM_CACHE ": %s\n",
+			        sqlite3_errmsg(cache->db));
+		}
+		cache->in_transaction = 0;
+		cache->flushes++;
+		trace_end(&mark, "cache", "commit cache", 0, "");
+	}
+
+	cache->io_time += now() - start;
+}
+
+/* Flush and close the cache, and free all its entries (detaching them
+ * from their rules).
+ * Returns 0 on success, or -1 if the database was still busy.
+ */
+int cache_close(tm_cache *cache)
+{
+	tm_rule_list *node;
+	int sqlrc;
+	int i;
+
+	cache_flush(cache);
+
+	finalize_statements(cache);
+	sqlrc = sqlite3_close(cache->db);
+
+	for (node = tm_rules; node; node = node->next) {
+		node->rule->cache = NULL;
+	}
+
+	free(cache->entries);
+	cache->entries = NULL;
+	cache->nentries = 0;
+
+	for (i = 0; i < cache->nextra; i++) {
+		free(cache->extra[i]);
+	}
+	free(cache->extra);
+	cache->extra = NULL;
+	cache->nextra = 0;
+
+	if (exit_cache == cache) {
+		exit_cache = NULL;
+	}
+
+	return sqlrc == SQLITE_OK ? 0 : -1;
+}
+
+/* Print statistics about how the cache was used */
+void cache_summary(tm_cache *cache)
+{
+	printf("Cache: %d entries loaded, %d written in %d transaction%s, ",
+	       cache->loaded, cache->stored, cache->flushes,
+	       cache->flushes == 1 ? "" : "s");
+	if (cache->pruned) {
+		printf("%d pruned, ", cache->pruned);
+	}
+	printf("%.3f s of I/O\n", cache->io_time);
+}
+
+/* The first column of the first row of a query, or 0 */
+static sqlite3_int64 query_int(sqlite3 *db, const char *sql)
+{
+	sqlite3_stmt *stm = NULL;
+	sqlite3_int64 n = 0;
+
+	if (sqlite3_prepare_v2(db, sql, -1, &stm, NULL) == SQLITE_OK
+	&&  sqlite3_step(stm) == SQLITE_ROW) {
+		n = sqlite3_column_int64(stm, 0);
+	}
+	sqlite3_finalize(stm);
+
+	return n;
+}
+
+/* How big the database is, in bytes, or how much of it is unused */
+static double database_size(sqlite3 *db, int unused)
+{
+	return (double)query_int(db, "PRAGMA page_size")
+	     * query_int(db, unused ? "PRAGMA freelist_count" : "PRAGMA page_count");
+}
+
+/* Format a number of bytes for people to read */
+static const char *show_size(double bytes, char buf[32])
+{
+	if (bytes >= 1024.0 * 1024.0) {
+		sprintf(buf, "%.1fM", bytes / (1024.0 * 1024.0));
+	} else if (bytes >= 1024.0) {
+		sprintf(buf, "%.1fK", bytes / 1024.0);
+	} else {
+		sprintf(buf, "%.0f", bytes);
+	}
+	return buf;
+}
+
+/* The TMakefiles with anything in the cache, in a NULL terminated array to
+ * be freed (along with each name) by the caller.
+ */
+static char **cached_tmfiles(sqlite3 *db)
+{
+	sqlite3_stmt *stm = NULL;
+	char **names = calloc(1, sizeof(char *));
+	int n = 0;
+
+	if (sqlite3_prepare_v2(db,
+	        "SELECT Path FROM TMPath WHERE Id IN (SELECT DISTINCT TMakefile FROM TMTarget) "
+	        "UNION SELECT TMakefile FROM TMSnapshot ORDER BY 1",
+	        -1, &stm, NULL) != SQLITE_OK) {
+		return names;
+	}
+
+	while (sqlite3_step(stm) == SQLITE_ROW) {
+		const char *name = (const char *)sqlite3_column_text(stm, 0);
+
+		if (name) {
+			names = realloc(names, (n + 2) * sizeof(char *));
+			names[n] = malloc(strlen(name) + 1);
+			strcpy(names[n++], name);
+			names[n] = NULL;
+		}
+	}
+	sqlite3_finalize(stm);
+
+	return names;
+}
+
+static void free_names(char **names)
+{
+	int i;
+
+	for (i = 0; names[i]; i++) {
+		free(names[i]);
+	}
+	free(names);
+}
+
+/* Display how big the cache in the current directory is, and what's in
+ * it for each TMakefile.  Returns 0 on success, or -1 on failure.
+ */
+int cache_stats(void)
+{
+	sqlite3 *db = NULL;
+	sqlite3_stmt *stm = NULL;
+	char **tmfiles = NULL;
+	char size[32], unused[32];
+	int i;
+
+	if (access(TM_CACHE, F_OK) != 0) {
+		printf("There's no " TM_CACHE " here\n");
+		return 0;
+	}
+	if (cache_connect(&db) != 0) {
+		sqlite3_close(db);
+		return -1;
+	}
+
+	printf(TM_CACHE ": %s, of which %s is unused\n",
+	       show_size(database_size(db, 0), size), show_size(database_size(db, 1), unused));
+	printf("Paths: %ld\n", (long)query_int(db, "SELECT COUNT(*) FROM TMPath"));
+
+	if (sqlite3_prepare_v2(db,
+	        "SELECT (SELECT COUNT(*) FROM TMTarget WHERE TMakefile = p.Id),"
+	        "       (SELECT COUNT(*) FROM TMDep WHERE TMakefile = p.Id),"
+	        "       (SELECT COUNT(*) FROM TMSnapshot WHERE TMakefile = ?1) "
+	        "FROM (SELECT ?1 AS Path) LEFT JOIN TMPath p USING (Path)",
+	        -1, &stm, NULL) != SQLITE_OK) {
+		fprintf(stderr, "ERROR: Unable to read " TM_CACHE ": %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return -1;
+	}
+
+	tmfiles = cached_tmfiles(db);
+	for (i = 0; tmfiles[i]; i++) {
+		sqlite3_bind_text(stm, 1, tmfiles[i], -1, SQLITE_STATIC);
+		if (sqlite3_step(stm) == SQLITE_ROW) {
+			int targets = sqlite3_column_int(stm, 0);
+			int deps = sqlite3_column_int(stm, 1);
+			int snapshots = sqlite3_column_int(stm, 2);
+
+			printf("%s: %d target%s, %d discovered dependenc%s, %d snapshot%s\n", tmfiles[i],
+			       targets, targets == 1 ? "" : "s", deps, deps == 1 ? "y" : "ies",
+			       snapshots, snapshots == 1 ? "" : "s");
+		}
+		sqlite3_reset(stm);
+	}
+	free_names(tmfiles);
+
+	sqlite3_finalize(stm);
+	sqlite3_close(db);
+	return 0;
+}
+
+/* Remove everything cached for TMakefiles that are gone, and the paths
+ * nothing refers to any more, then rebuild the cache in the current
+ * directory to give the space they took back.  (The rows for targets
+ * that are gone are pruned whenever their TMakefile is made.)
+ * Returns 0 on success, or -1 on failure.
+ */
+int cache_vacuum(void)
+{
+	sqlite3 *db = NULL;
+	char **tmfiles = NULL;
+	char before[32], after[32];
+	double size;
+	int removed = 0;
+	int paths;
+	int i;
+
+	if (access(TM_CACHE, F_OK) != 0) {
+		printf("There's no " TM_CACHE " here\n");
+		return 0;
+	}
+	if (cache_connect(&db) != 0) {
+		sqlite3_close(db);
+		return -1;
+	}
+
+	size = database_size(db, 0);
+	tmfiles = cached_tmfiles(db);
+
+	sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+	for (i = 0; tmfiles[i]; i++) {
+		char *sql = NULL;
+
+		if (access(tmfiles[i], F_OK) == 0) {
+			continue;
+		}
+
+		sql = sqlite3_mprintf(
+			"DELETE FROM TMTarget WHERE TMakefile = (SELECT Id FROM TMPath WHERE Path = %Q);"
+			"DELETE FROM TMDep WHERE TMakefile = (SELECT Id FROM TMPath WHERE Path = %Q);"
+			"DELETE FROM TMSnapshot WHERE TMakefile = %Q;",
+			tmfiles[i], tmfiles[i], tmfiles[i]
+		);
+		if (sqlite3_exec(db, sql, NULL, NULL, NULL) == SQLITE_OK) {
+			removed++;
+		}
+		sqlite3_free(sql);
+	}
+	free_names(tmfiles);
+
+	paths = query_int(db, "SELECT COUNT(*) FROM TMPath");
+	sqlite3_exec(db,
+		"DELETE FROM TMPath WHERE Id NOT IN (SELECT TMakefile FROM TMTarget) "
+		"AND Id NOT IN (SELECT Target FROM TMTarget) "
+		"AND Id NOT IN (SELECT Dep FROM TMDep)",
+		NULL, NULL, NULL);
+	paths -= query_int(db, "SELECT COUNT(*) FROM TMPath");
+
+	if (sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK
+	||  sqlite3_exec(db, "VACUUM", NULL, NULL, NULL) != SQLITE_OK) {
+		fprintf(stderr, "ERROR: Unable to vacuum " TM_CACHE ": %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return -1;
+	}
+
+	/* Fold the write-ahead log back in, so the file shrinks now */
+	sqlite3_exec(db, "PRAGMA wal_checkpoint(TRUNCATE)", NULL, NULL, NULL);
+
+	printf("Removed the cache for %d TMakefile%s that %s gone, and %d unused path%s\n",
+	       removed, removed == 1 ? "" : "s", removed == 1 ? "is" : "are",
+	       paths, paths == 1 ? "" : "s");
+	printf(TM_CACHE ": %s before, %s after\n",
+	       show_size(size, before), show_size(database_size(db, 0), after));
+
+	sqlite3_close(db);
+	return 0;
+}
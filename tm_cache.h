@@ -0,0 +1,77 @@
+#ifndef TM_CACHE_H
+#define TM_CACHE_H
+
+#include <sqlite3.h>
+
+#include "tmake.h"
+#include "tm_crypto.h"
+#include "tm_target.h"
+
+/* What TMk remembers about a file so it can tell whether it changed
+ * without reading it.
+ */
+typedef struct tm_file_stat {
+	sqlite3_int64 size;
+	sqlite3_int64 mtime;    /* in nanoseconds */
+	sqlite3_int64 inode;
+	sqlite3_int64 device;
+	int racy;               /* modified too recently to be trusted */
+} tm_file_stat;
+
+/* The cached state of one target, as loaded from (or written to) TMTarget */
+typedef struct tm_cache_entry {
+	sqlite3_int64 path;     /* the target's Id in TMPath, once it's known */
+	char hash[CRYPTO_HASH_STRING_LENGTH];
+	int have_stat;
+	tm_file_stat st;
+	int unchanged;          /* the file's stat matched st this run */
+	int have_output;
+	char output[CRYPTO_HASH_STRING_LENGTH];    /* what the recipe made */
+} tm_cache_entry;
+
+/* The cache for one evaluation of a TMakefile.
+ * Rows are loaded once, up front, and attached to their rules.  Writes go
+ * through statements prepared once per run and are batched into a single
+ * transaction until the cache is flushed.
+ */
+typedef struct tm_cache {
+	sqlite3 *db;
+	const char *tmfile;
+	sqlite3_int64 tmfile_path;    /* tmfile's Id in TMPath */
+	sqlite3_stmt *upsert;
+	sqlite3_stmt *refresh;
+	sqlite3_stmt *find_path;
+	sqlite3_stmt *add_path;
+	sqlite3_stmt *clear_deps;
+	sqlite3_stmt *add_dep;
+	int in_transaction;
+
+	tm_cache_entry *entries;    /* loaded rows, pointed to by the rules */
+	int nentries;
+	tm_cache_entry **extra;     /* entries for targets new to the cache */
+	int nextra;
+
+	struct tm_artifacts *artifacts;    /* NULL unless sharing artifacts */
+
+	/* statistics for the summary */
+	double io_time;
+	int loaded;
+	int stored;
+	int flushes;
+	int pruned;
+} tm_cache;
+
+int cache_connect(sqlite3 **db);
+int cache_open(tm_cache *cache, const char *tmfile);
+void cache_load(tm_cache *cache);
+tm_cache_entry *cache_entry(tm_rule *rule);
+int cache_store(tm_cache *cache, tm_rule *rule, const char *hash,
+                const tm_file_stat *st, const char *output);
+void cache_store_stat(tm_cache *cache, tm_rule *rule, const tm_file_stat *st);
+void cache_flush(tm_cache *cache);
+int cache_close(tm_cache *cache);
+void cache_summary(tm_cache *cache);
+int cache_stats(void);
+int cache_vacuum(void);
+
+#endif
@@ -1,6 +1,7 @@
-#define _DEFAULT_SOURCE   /* needed for strdup */
+#define _DEFAULT_SOURCE   /* needed for strdup and strndup */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>   /* TODO: I doubt this works on Windows... */
 
@@ -10,30 +11,123 @@
 #include "tm_target.h"
 #include "tm_core_cmds.h"
 #include "tm_crypto.h"
+#include "tm_snapshot.h"
 
+/* Create the proc recipe::name to evaluate a recipe, like
+ *     proc recipe::name arglist recipe
+ * but without building that as a string to be parsed.  Every target
+ * given the same recipe object (and every rule defined by the same rule
+ * command in a loop has one) shares it, so it's only compiled once.
+ */
+int create_recipe_proc(Jim_Interp *interp, const char *name, Jim_Obj *arglist, Jim_Obj *recipe)
+{
+	Jim_Obj *objv[4];
+
+	objv[0] = Jim_NewStringObj(interp, "proc", -1);
+	objv[1] = Jim_NewStringObj(interp, "recipe::", -1);
+	Jim_AppendString(interp, objv[1], name, -1);
+	objv[2] = arglist;
+	objv[3] = recipe;
+
+	return Jim_EvalObjVector(interp, 4, objv);
+}
+
+/* Parse an amount like 2, 500M or 8G (in bytes).  Returns 0 if it's bad. */
+static int parse_amount(const char *str, unsigned long long *amount)
+{
+	char *end = NULL;
+
+	if (*str < '0' || *str > '9') {
+		return 0;
+	}
+	*amount = strtoull(str, &end, 10);
+
+	switch (*end) {
+		case 'k': case 'K': *amount *= 1024ULL; end++; break;
+		case 'm': case 'M': *amount *= 1024ULL * 1024; end++; break;
+		case 'g': case 'G': *amount *= 1024ULL * 1024 * 1024; end++; break;
+		default: break;
+	}
+
+	return *end == '\0';
+}
+
+/* Parse the list given to rule -resources, like {mem=8G link}, into the
+ * uses of each pool (a pool given without an amount uses 1 of it).
+ */
+static int parse_uses(Jim_Interp *interp, Jim_Obj *list, tm_use **uses)
+{
+	int i, n = Jim_ListLength(interp, list);
+
+	*uses = NULL;
+	for (i = 0; i < n; i++) {
+		const char *item = Jim_String(Jim_ListGetIndex(interp, list, i));
+		const char *eq = strchr(item, '=');
+		unsigned long long amount = 1;
+		char *name = NULL;
+
+		if (eq == item || (eq && !parse_amount(eq + 1, &amount))) {
+			Jim_SetResultFormatted(interp, "Bad resource \"%s\" (should be pool or pool=amount)", item);
+			return (JIM_ERR);
+		}
+
+		name = eq ? strndup(item, eq - item) : strdup(item);
+		*uses = use_cons(intern_pool(name), amount, *uses);
+		free(name);
+	}
+
+	return (JIM_OK);
+}
+
+/* Define rules with rule, rule! or rule&.
+ * With rule&, the targets are a group made by one evaluation of the
+ * recipe: the first one has the recipe and the dependencies, and the
+ * others depend on it, so whatever depends on any of them waits for it.
+ * A target containing a % defines a pattern rule instead, which only
+ * becomes a rule for the targets that turn out to be needed.
+ * Given -resources, the recipe is only run while the pools it names
+ * have room for it (see pool).
+ */
 static int ruleCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 {
 	tm_rule *rule = NULL;
-	target_list *deps = NULL;
+	tm_rule *primary = NULL;
+	tm_rule *last = NULL;
+	tm_rule *first = NULL;    /* the first target given the recipe */
 	Jim_Obj *target_subst, *deps_subst;
-	char *recipe = NULL;
-	int i, numtargs, numdeps;
-	const char *fmt = "proc recipe::%s {TARGET INPUTS OODATE} { \
-	%s\
-	}";
+	const char *recipe = NULL;
+	int recipe_len = 0;
+	unsigned char recipe_digest[CRYPTO_HASH_SIZE];
+	int i, j, numtargs, numdeps;
+	Jim_Obj *arglist = NULL;
+	tm_use *uses = NULL;
+	const char *name = Jim_String(argv[0]);
+	int grouped = strcmp(name, "rule&") == 0;
+	int always = strcmp(name, "rule!") == 0;
 	int len = 0;
 	char *cmd = NULL;
 	int ret = JIM_ERR;
 
+	/* Take the options off the front */
+	if (argc > 2 && strcmp(Jim_String(argv[1]), "-resources") == 0) {
+		if (parse_uses(interp, argv[2], &uses) != JIM_OK) {
+			return (JIM_ERR);
+		}
+		argc -= 2;
+		argv += 2;
+	}
+
 	/* check to make sure we got the information we need */
-	if (argc < 3 || argc > 4) {
-		Jim_WrongNumArgs(interp, 2, argv, "rule target-list dep-list ?script?");
+	if (argc < 3 || argc > 4 || (grouped && argc != 4)) {
+		Jim_SetResultFormatted(interp, "wrong # args: should be \"%s ?-resources list? target-list dep-list %s\"",
+		                       name, grouped ? "script" : "?script?");
 		return (JIM_ERR);
 	}
 
-	/* If we've got a recipe, store it */
+	/* If we've got a recipe, hash it once for all the targets */
 	if (argc == 4) {
-		recipe = strdup(Jim_String(argv[3]));
+		recipe = Jim_GetString(argv[3], &recipe_len);
+		TM_CRYPTO_HASH_DATA(recipe, recipe_len, recipe_digest);
 	}
 
 	/* Perform variable substitution in the dependency lists */
@@ -41,14 +135,7 @@ static int ruleCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 		return (JIM_ERR);
 	}
 
-	/* Get all the dependencies and store them in a dep list */
 	numdeps = Jim_ListLength(interp, deps_subst);
-	for (i = 0; i < numdeps; i++) {
-		Jim_Obj *dep = Jim_ListGetIndex(interp, deps_subst, i);
-		const char *sdep = Jim_String(dep);
-
-		deps = target_cons(sdep, deps);
-	}
 
 	/* Perform variable substitution in the target list */
 	if (Jim_SubstObj(interp, argv[1], &target_subst, 0) != JIM_OK) {
@@ -59,38 +146,107 @@ static int ruleCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 
 	if (numtargs == 0) {
 		Jim_SetResultString(interp, "No targets specified for rule", -1);
-		free(deps);
 		return (JIM_ERR);
 	}
 
+	/* The arguments of the recipe procs, shared by all of them.  The
+	 * recipe of a group gets TARGETS as well, defaulting to the group. */
+	arglist = Jim_NewStringObj(interp, "TARGET INPUTS OODATE", -1);
+	if (grouped) {
+		Jim_Obj *targets = Jim_NewListObj(interp, NULL, 0);
+
+		Jim_ListAppendElement(interp, targets, Jim_NewStringObj(interp, "TARGETS", -1));
+		Jim_ListAppendElement(interp, targets, target_subst);
+		Jim_ListAppendElement(interp, arglist, targets);
+	}
+	Jim_IncrRefCount(arglist);
+
 	/* For each target in the list, create a rule and a proc */
 	for (i = 0; i < numtargs; i++) {
 		Jim_Obj *target_obj = Jim_ListGetIndex(interp, target_subst, i);
 		const char *target = Jim_String(target_obj);
 
-		/* check if there's already a rule for this target */
-		rule = find_rule(target, tm_rules);
-		if (rule) {
-			target_list *node;
+		if (strchr(target, '%')) {
+			tm_pattern *pattern = NULL;
+			const char **dep_names = NULL;
+
+			if (grouped || !recipe) {
+				Jim_SetResultFormatted(interp, "Pattern rule %s needs a recipe of its own", target);
+				ret = JIM_ERR;
+				goto error;
+			}
+			/* Patterns for the same target are told apart by their deps */
+			dep_names = malloc((numdeps + 1) * sizeof(const char *));
+			for (j = 0; j < numdeps; j++) {
+				dep_names[j] = Jim_String(Jim_ListGetIndex(interp, deps_subst, j));
+			}
+			if (find_pattern(target, dep_names, numdeps)) {
+				Jim_SetResultFormatted(interp, "Multiple recipes defined for target %s from %#s",
+				                       target, deps_subst);
+				free(dep_names);
+				ret = JIM_ERR;
+				goto error;
+			}
+
+			pattern = define_pattern(target, recipe, recipe_digest);
+			pattern->uses = uses;
+			if (always) {
+				pattern->always_oodate = 1;
+			}
+			for (j = 0; j < numdeps; j++) {
+				add_pattern_dep(pattern, dep_names[j]);
+			}
+			free(dep_names);
+
+			/* Shared by every rule made from the pattern */
+			ret = create_recipe_proc(interp, pattern->name, arglist, argv[3]);
+			if (ret != (JIM_OK)) {
+				goto error;
+			}
+			continue;
+		}
+
+		/* check if there's already a rule for this target (and not just
+		 * a filename rule from being named as a dependency) */
+		rule = find_rule(target, &tm_rule_index);
+		if (rule && rule->type != TM_FILENAME) {
 			/* if so, add new dependencies */
-			if (recipe && rule->recipe) {
+			if (recipe && (rule->recipe || rule->primary)) {
 				Jim_SetResultFormatted(interp, "Multiple recipes defined for target %s", rule->target);
-				return (JIM_ERR);
-			} else if (recipe) {
-				rule->recipe = recipe;
-			}
-			for (node = deps; node; node = node->next) {
-				rule->deps = target_cons(node->name, rule->deps);
+				ret = JIM_ERR;
+				goto error;
 			}
-			rule->type = TM_EXPLICIT;
 		} else {
 			/* or else create a new rule */
-			rule = new_rule(target, deps, recipe);
-			if (strcmp(Jim_String(argv[0]), "rule!") == 0) {
+			rule = define_rule(target);
+			if (always) {
 				rule->always_oodate = 1;
 			}
-			tm_rules = rule_cons(rule, tm_rules);
-			free_rule(rule);
+		}
+		if (grouped && primary) {
+			/* made by the first target's recipe */
+			add_dep(rule, primary);
+			rule->primary = primary;
+			last->next_output = rule;
+			last = rule;
+			continue;
+		}
+		if (grouped) {
+			primary = last = rule;
+			rule->grouped = 1;
+		}
+		if (uses) {
+			rule->uses = uses;
+		}
+
+		if (recipe && first) {
+			share_recipe(rule, first);
+		} else if (recipe) {
+			set_recipe(rule, recipe, recipe_digest);
+			first = rule;
+		}
+		for (j = 0; j < numdeps; j++) {
+			add_dep(rule, intern_rule(Jim_String(Jim_ListGetIndex(interp, deps_subst, j))));
 		}
 
 		/* Do we need to set the default goal? */
@@ -111,33 +267,32 @@ static int ruleCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 		}
 		
 		if (recipe) {
-			/* Create a proc representing this rule */
-			len = strlen(fmt) + strlen(target) + strlen(recipe) + 1;
-			cmd = malloc(len);
-			sprintf(cmd, fmt, target, recipe);
-			ret = Jim_Eval(interp, cmd);
-			free(cmd);
+			/* Create a proc representing this rule (or group) */
+			ret = create_recipe_proc(interp, target, arglist, argv[3]);
 			if (ret != (JIM_OK)) {
 				goto error;
 			}
 		}
 	}
 
-	free_target_list(deps);
+	Jim_DecrRefCount(interp, arglist);
 	return (JIM_OK);
 
 	error:
-	free_target_list(deps);
+	Jim_DecrRefCount(interp, arglist);
 	return ret;
 }
 
-/* Provide tm_crypto functionality to Jim Tcl */
+/* Provide tm_crypto functionality to Jim Tcl.
+ * Always SHA-1, whatever algorithm the cache is using.
+ */
 static int sha1sumCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 {
 	char hash[CRYPTO_HASH_STRING_LENGTH];
 	unsigned char digest[CRYPTO_HASH_SIZE];
 	const char *subcmd = NULL;
 	const char *string = NULL;
+	int len = 0;
 
 	if (argc != 3) {
 		Jim_WrongNumArgs(interp, 2, argv, "sha1sum \"file\"|\"string\" <filename>|<string>");
@@ -145,18 +300,19 @@ static int sha1sumCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 	}
 
 	subcmd = Jim_String(argv[1]);
-	string = Jim_String(argv[2]);
+	string = Jim_GetString(argv[2], &len);
 
 	if (strcmp(subcmd, "file") == 0) {
-		TM_CRYPTO_HASH_FILE(string, digest);
+		snapshot_note_file(string);
+		tm_CryptoHashFileWith(TM_HASH_SHA1, string, digest);
 	} else if (strcmp(subcmd, "string") == 0) {
-		TM_CRYPTO_HASH_DATA(string, digest);
+		tm_CryptoHashDataWith(TM_HASH_SHA1, (const unsigned char *)string, len, digest);
 	} else {
 		Jim_WrongNumArgs(interp, 2, argv, "Invalid subcommand for sha1sum (should be \"file\" or \"string\")");
 		return (JIM_ERR);
 	}
 
-	TM_CRYPTO_HASH_TO_STRING(digest, hash);
+	tm_CryptoHashToStringWith(TM_HASH_SHA1, digest, hash);
 
 	Jim_SetResultString(interp, hash, CRYPTO_HASH_STRING_LENGTH);
 
@@ -167,6 +323,7 @@ static int sha1sumCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 static int targetCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 {
 	const char *target = NULL;
+	tm_rule *rule = NULL;
 
 	if (argc != 2) {
 		Jim_WrongNumArgs(interp, 1, argv, "target name");
@@ -174,8 +331,10 @@ static int targetCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 	}
 
 	target = Jim_String(argv[1]);
+	rule = find_rule(target, &tm_rule_index);
 
-	if (find_rule(target, tm_rules)) {
+	/* Names only seen as dependencies so far don't count */
+	if (rule && rule->type != TM_FILENAME) {
 		Jim_SetResultInt(interp, 1);
 	} else {
 		Jim_SetResultInt(interp, 0);
@@ -195,7 +354,7 @@ static int commandsCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 	}
 	
 	target = Jim_String(argv[1]);
-	rule = find_rule(target, tm_rules);
+	rule = find_rule(target, &tm_rule_index);
 
 	if (rule && rule->recipe) {
 		Jim_SetResultInt(interp, 1);
@@ -206,6 +365,89 @@ static int commandsCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 	return (JIM_OK);
 }
 
+static int depfileCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
+{
+	Jim_Obj *target_subst;
+	int i, numtargs;
+
+	if (argc != 3) {
+		Jim_WrongNumArgs(interp, 1, argv, "depfile target-list file");
+		return (JIM_ERR);
+	}
+
+	/* Perform variable substitution in the target list */
+	if (Jim_SubstObj(interp, argv[1], &target_subst, 0) != JIM_OK) {
+		return (JIM_ERR);
+	}
+
+	numtargs = Jim_ListLength(interp, target_subst);
+
+	for (i = 0; i < numtargs; i++) {
+		const char *target = Jim_String(Jim_ListGetIndex(interp, target_subst, i));
+
+		if (strchr(target, '%')) {
+			tm_pattern *pattern = NULL;
+			int found = 0;
+
+			/* Every pattern rule for the target, whatever it's made from */
+			for (pattern = tm_patterns; pattern; pattern = pattern->next) {
+				if (strcmp(pattern->target, target) == 0) {
+					set_pattern_depfile(pattern, Jim_String(argv[2]));
+					found = 1;
+				}
+			}
+			if (!found) {
+				Jim_SetResultFormatted(interp, "No pattern rule for %s", target);
+				return (JIM_ERR);
+			}
+		} else {
+			set_depfile(intern_rule(target), Jim_String(argv[2]));
+		}
+	}
+
+	return (JIM_OK);
+}
+
+/* Set the size of a pool with pool name size, or get it with pool name.
+ * A size of 0 means there's no limit.
+ */
+static int poolCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
+{
+	tm_pool *pool = NULL;
+	unsigned long long size = 0;
+
+	if (argc != 2 && argc != 3) {
+		Jim_WrongNumArgs(interp, 1, argv, "name ?size?");
+		return (JIM_ERR);
+	}
+
+	if (argc == 3 && !parse_amount(Jim_String(argv[2]), &size)) {
+		Jim_SetResultFormatted(interp, "Bad size \"%#s\" for pool %#s", argv[2], argv[1]);
+		return (JIM_ERR);
+	}
+
+	pool = intern_pool(Jim_String(argv[1]));
+	if (argc == 3) {
+		pool->size = size;
+	}
+
+	Jim_SetResultInt(interp, (jim_wide)pool->size);
+
+	return (JIM_OK);
+}
+
+static int updatedCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
+{
+	if (argc != 2) {
+		Jim_WrongNumArgs(interp, 1, argv, "updated target");
+		return (JIM_ERR);
+	}
+
+	Jim_SetResultInt(interp, was_updated(Jim_String(argv[1])));
+
+	return (JIM_OK);
+}
+
 /**
  * Searches along a of paths for the given package.
  *
@@ -255,6 +497,7 @@ static int includeCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
 		char *path = NULL;
 		path = tm_FindPackage(interp, incpath, filename);
 		if (path) {
+			snapshot_note_file(path);
 			Jim_IncrRefCount(incpath);
 			ret = Jim_EvalFileGlobal(interp, path);
 			Jim_DecrRefCount(interp, incpath);
@@ -272,8 +515,12 @@ void tm_RegisterCoreCommands(Jim_Interp *interp)
 {
 	Jim_CreateCommand(interp, "rule", ruleCmd, NULL, NULL);
 	Jim_CreateCommand(interp, "rule!", ruleCmd, NULL, NULL);
+	Jim_CreateCommand(interp, "rule&", ruleCmd, NULL, NULL);
 	Jim_CreateCommand(interp, "include", includeCmd, NULL, NULL);
 	Jim_CreateCommand(interp, "target", targetCmd, NULL, NULL);
 	Jim_CreateCommand(interp, "commands", commandsCmd, NULL, NULL);
+	Jim_CreateCommand(interp, "updated", updatedCmd, NULL, NULL);
+	Jim_CreateCommand(interp, "depfile", depfileCmd, NULL, NULL);
+	Jim_CreateCommand(interp, "pool", poolCmd, NULL, NULL);
 	Jim_CreateCommand(interp, "sha1sum", sha1sumCmd, NULL, NULL);
 }
@@ -6,6 +6,7 @@
 
 #include "tmake.h"
 
+int create_recipe_proc(Jim_Interp *interp, const char *name, Jim_Obj *arglist, Jim_Obj *recipe);
 void tm_RegisterCoreCommands(Jim_Interp *interp);
 
 #endif
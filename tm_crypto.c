@@ -4,7 +4,7 @@
 * Modified by:	Andre Schalkwyk (avs.aswyk AT gmail.com) 2016-01-05
 * Copyright:
 * Disclaimer: 	This code is presented "as is" without any guarantees.
-* Details:    	Implementation of the SHA1 hashing algorithm.
+* Details:    	Implementation of the SHA1 and XXH64 hashing algorithms.
               	Algorithm specification can be found here:
                	* http://csrc.nist.gov/publications/fips/fips180-2/fips180-2withchangenotice.pdf
               	This implementation uses little endian byte order.
@@ -24,8 +24,15 @@
 #define SHA1_BLOCK_LENGTH	64
 #define SHA1_DIGEST_LENGTH	20
 
+#define XXH64_STRIPE_LENGTH	32
+#define XXH64_DIGEST_LENGTH	8
+
+/* Files are read this much at a time */
+#define HASH_FILE_BUFFER_SIZE	(1024 * 1024)
+
 /**************************** DATA TYPES ****************************/
 typedef unsigned char BYTE;
+typedef unsigned long long U64;
 
 typedef struct {
 	BYTE data[64];
@@ -35,89 +42,161 @@ typedef struct {
 	WORD k[4];
 } SHA1_CTX;
 
+typedef struct {
+	U64 total_len;
+	U64 v[4];
+	BYTE mem[XXH64_STRIPE_LENGTH];
+	size_t memsize;
+} XXH64_CTX;
+
+typedef union {
+	SHA1_CTX sha1;
+	XXH64_CTX xxh64;
+} HASH_CTX;
+
+/* A hash algorithm that can be used to tell whether something changed */
+typedef struct {
+	const char *name;
+	int digest_length;
+	void (*init)(HASH_CTX *ctx);
+	void (*update)(HASH_CTX *ctx, const BYTE data[], size_t len);
+	void (*final)(HASH_CTX *ctx, BYTE hash[]);
+} HASH_ALGORITHM;
+
 /*********************** FUNCTION DECLARATIONS **********************/
 void sha1_init(SHA1_CTX *ctx);
+void sha1_transform(SHA1_CTX *ctx, const BYTE data[]);
 void sha1_update(SHA1_CTX *ctx, const BYTE data[], size_t len);
 void sha1_final(SHA1_CTX *ctx, BYTE hash[]);
 
+void xxh64_init(XXH64_CTX *ctx);
+void xxh64_update(XXH64_CTX *ctx, const BYTE data[], size_t len);
+void xxh64_final(XXH64_CTX *ctx, BYTE hash[]);
 
-/****************** HIGHER LEVEL CRYPTO FUNCTIONS *******************/
-void tm_CryptoHashData(const unsigned char* data, unsigned char digest[CRYPTO_HASH_SIZE])
-{
-    BYTE        buff[SHA1_BLOCK_LENGTH];
-	BYTE*		pBuff;
-	int			bytesLeft;
-	int			len;
+static void hash_sha1_init(HASH_CTX *ctx)                              { sha1_init(&ctx->sha1); }
+static void hash_sha1_update(HASH_CTX *ctx, const BYTE data[], size_t len) { sha1_update(&ctx->sha1, data, len); }
+static void hash_sha1_final(HASH_CTX *ctx, BYTE hash[])                { sha1_final(&ctx->sha1, hash); }
 
-    /* Context to hold SHA1 hash */
-    SHA1_CTX     sha_ctx;
+static void hash_xxh64_init(HASH_CTX *ctx)                              { xxh64_init(&ctx->xxh64); }
+static void hash_xxh64_update(HASH_CTX *ctx, const BYTE data[], size_t len) { xxh64_update(&ctx->xxh64, data, len); }
+static void hash_xxh64_final(HASH_CTX *ctx, BYTE hash[])                { xxh64_final(&ctx->xxh64, hash); }
 
-    if (!data) {
-		data = (BYTE *)"";
-	}
+/* Indexed by TM_HASH_* */
+static const HASH_ALGORITHM algorithms[] = {
+	{ "sha1",  SHA1_DIGEST_LENGTH,  hash_sha1_init,  hash_sha1_update,  hash_sha1_final  },
+	{ "xxh64", XXH64_DIGEST_LENGTH, hash_xxh64_init, hash_xxh64_update, hash_xxh64_final }
+};
 
-	pBuff = (unsigned char*)&data[0];
-	len = strlen((char*)data);
+#define NUM_ALGORITHMS (int)(sizeof(algorithms) / sizeof(algorithms[0]))
 
-    /* Initialize SHA1 Context */
-    sha1_init(&sha_ctx);
+/* The algorithm used by tm_CryptoHashData and friends */
+int tm_crypto_hash = TM_DEFAULT_HASH;
+
+
+/****************** HIGHER LEVEL CRYPTO FUNCTIONS *******************/
+const char *tm_CryptoHashName(int algorithm)
+{
+	if (algorithm < 0 || algorithm >= NUM_ALGORITHMS) {
+		return NULL;
+	}
+	return algorithms[algorithm].name;
+}
 
-	while(pBuff < data + len)
-    {
-		bytesLeft = strlen((const char*)pBuff);
+int tm_CryptoFindHash(const char *name)
+{
+	int i;
 
-		strncpy((char*)buff, (char*)pBuff, bytesLeft < SHA1_BLOCK_LENGTH ? bytesLeft : SHA1_BLOCK_LENGTH);
+	for (i = 0; i < NUM_ALGORITHMS; i++) {
+		if (strcmp(algorithms[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
 
-		sha1_update(&sha_ctx, buff, bytesLeft < SHA1_BLOCK_LENGTH ? bytesLeft : SHA1_BLOCK_LENGTH);
+void tm_CryptoHashDataWith(int algorithm, const unsigned char* data, size_t len, unsigned char digest[CRYPTO_HASH_SIZE])
+{
+	const HASH_ALGORITHM *alg = &algorithms[algorithm];
+	/* Context to hold the hash */
+	HASH_CTX	ctx;
 
-		pBuff += SHA1_BLOCK_LENGTH;
-    }
+	if (!data) {
+		data = (BYTE *)"";
+		len = 0;
+	}
 
-    /* Finalize SHA1 Context */
-    sha1_final(&sha_ctx, digest);
+	memset(digest, 0, CRYPTO_HASH_SIZE);
+	alg->init(&ctx);
+	alg->update(&ctx, data, len);
+	alg->final(&ctx, digest);
 }
 
-void tm_CryptoHashFile(const char* file, unsigned char digest[CRYPTO_HASH_SIZE])
+void tm_CryptoHashFileWith(int algorithm, const char* file, unsigned char digest[CRYPTO_HASH_SIZE])
 {
+	const HASH_ALGORITHM *alg = &algorithms[algorithm];
 	/* File Handle */
-    FILE*       fp = NULL;
-	/* buffer to store unhashed datya */
-    BYTE        buff[SHA1_BLOCK_LENGTH];
+	FILE*		fp = NULL;
+	/* buffer to store unhashed data */
+	BYTE*		buff;
 	/* How many bytes we have read from */
-    int         bytesRead;
-    /* Context to hold SHA1 hash */
-    SHA1_CTX     sha_ctx;
+	size_t		bytesRead;
+	/* Context to hold the hash */
+	HASH_CTX	ctx;
 
-    /* Initialize SHA1 Context */
-    sha1_init(&sha_ctx);
+	memset(digest, 0, CRYPTO_HASH_SIZE);
+	alg->init(&ctx);
 
-    if((fp = fopen(file, "r")) == NULL) {
-        printf("File %s could not be opened\n", file);
-        exit(TM_CRYPTO_FILE_ERROR);
-    }
+	if((fp = fopen(file, "rb")) == NULL) {
+		printf("File %s could not be opened\n", file);
+		exit(TM_CRYPTO_FILE_ERROR);
+	}
+
+	/* We read in big chunks ourselves, so stdio buffering just adds a copy */
+	setvbuf(fp, NULL, _IONBF, 0);
+
+	buff = malloc(HASH_FILE_BUFFER_SIZE);
+	if (!buff) {
+		printf("Out of memory hashing %s\n", file);
+		exit(TM_CRYPTO_FILE_ERROR);
+	}
 
-    while((bytesRead = fread(buff, 1, SHA1_BLOCK_LENGTH, fp)) != 0)
-    {
-        /* Update SHA1 Context with block of data that was read */
-        sha1_update(&sha_ctx, buff, bytesRead);
-    }
+	while((bytesRead = fread(buff, 1, HASH_FILE_BUFFER_SIZE, fp)) != 0)
+	{
+		/* Update the hash with the block of data that was read */
+		alg->update(&ctx, buff, bytesRead);
+	}
 
-    fclose(fp);
+	free(buff);
+	fclose(fp);
 
-    /* Finalize SHA1 Context */
-    sha1_final(&sha_ctx, digest);
+	alg->final(&ctx, digest);
 }
 
-void tm_CryptoHashToString(const unsigned char digest[CRYPTO_HASH_SIZE], char hash[CRYPTO_HASH_STRING_LENGTH])
+void tm_CryptoHashToStringWith(int algorithm, const unsigned char digest[CRYPTO_HASH_SIZE], char hash[CRYPTO_HASH_STRING_LENGTH])
 {
 	int i;
 	char *p = hash;
 
-	for (i = 0; i < 20; i++) {
+	for (i = 0; i < algorithms[algorithm].digest_length; i++) {
 		p += sprintf(p, "%02x", digest[i]);
 	}
 }
 
+void tm_CryptoHashData(const unsigned char* data, size_t len, unsigned char digest[CRYPTO_HASH_SIZE])
+{
+	tm_CryptoHashDataWith(tm_crypto_hash, data, len, digest);
+}
+
+void tm_CryptoHashFile(const char* file, unsigned char digest[CRYPTO_HASH_SIZE])
+{
+	tm_CryptoHashFileWith(tm_crypto_hash, file, digest);
+}
+
+void tm_CryptoHashToString(const unsigned char digest[CRYPTO_HASH_SIZE], char hash[CRYPTO_HASH_STRING_LENGTH])
+{
+	tm_CryptoHashToStringWith(tm_crypto_hash, digest, hash);
+}
+
 /****************************** MACROS ******************************/
 #define ROTLEFT(a, b) ((a << b) | (a >> (32 - b)))
 
@@ -196,16 +275,29 @@ void sha1_init(SHA1_CTX *ctx)
 
 void sha1_update(SHA1_CTX *ctx, const BYTE data[], size_t len)
 {
-	size_t i;
+	size_t i = 0;
 
-	for (i = 0; i < len; ++i) {
-		ctx->data[ctx->datalen] = data[i];
-		ctx->datalen++;
-		if (ctx->datalen == 64) {
-			sha1_transform(ctx, ctx->data);
-			ctx->bitlen += 512;
-			ctx->datalen = 0;
+	/* Top up a partial block left over from last time */
+	if (ctx->datalen > 0) {
+		while (i < len && ctx->datalen < 64) {
+			ctx->data[ctx->datalen++] = data[i++];
+		}
+		if (ctx->datalen < 64) {
+			return;
 		}
+		sha1_transform(ctx, ctx->data);
+		ctx->bitlen += 512;
+		ctx->datalen = 0;
+	}
+
+	/* Whole blocks can be transformed straight from the input */
+	for ( ; i + 64 <= len; i += 64) {
+		sha1_transform(ctx, &data[i]);
+		ctx->bitlen += 512;
+	}
+
+	for ( ; i < len; ++i) {
+		ctx->data[ctx->datalen++] = data[i];
 	}
 }
 
@@ -251,3 +343,147 @@ void sha1_final(SHA1_CTX *ctx, BYTE hash[])
 		hash[i + 16] = (ctx->state[4] >> (24 - i * 8)) & 0x000000ff;
 	}
 }
+
+
+/*********************************************************************
+* XXH64, a fast non-cryptographic hash by Yann Collet.
+* Algorithm specification can be found here:
+* https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+* The digest is stored big endian, matching the canonical form
+* printed by xxhsum.
+*********************************************************************/
+#define XXH_PRIME64_1	0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3	0x165667B19E3779F9ULL
+#define XXH_PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5	0x27D4EB2F165667C5ULL
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static U64 xxh_read64(const BYTE *p)
+{
+	return  (U64)p[0]        | ((U64)p[1] << 8)
+	     | ((U64)p[2] << 16) | ((U64)p[3] << 24)
+	     | ((U64)p[4] << 32) | ((U64)p[5] << 40)
+	     | ((U64)p[6] << 48) | ((U64)p[7] << 56);
+}
+
+static U64 xxh_read32(const BYTE *p)
+{
+	return  (U64)p[0]        | ((U64)p[1] << 8)
+	     | ((U64)p[2] << 16) | ((U64)p[3] << 24);
+}
+
+static U64 xxh64_round(U64 acc, U64 input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc  = ROTL64(acc, 31);
+	acc *= XXH_PRIME64_1;
+	return acc;
+}
+
+static U64 xxh64_merge_round(U64 acc, U64 val)
+{
+	acc ^= xxh64_round(0, val);
+	acc  = acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+	return acc;
+}
+
+/* Consume one 32-byte stripe */
+static void xxh64_stripe(XXH64_CTX *ctx, const BYTE *p)
+{
+	ctx->v[0] = xxh64_round(ctx->v[0], xxh_read64(p));
+	ctx->v[1] = xxh64_round(ctx->v[1], xxh_read64(p + 8));
+	ctx->v[2] = xxh64_round(ctx->v[2], xxh_read64(p + 16));
+	ctx->v[3] = xxh64_round(ctx->v[3], xxh_read64(p + 24));
+}
+
+void xxh64_init(XXH64_CTX *ctx)
+{
+	/* seed is always 0 */
+	ctx->total_len = 0;
+	ctx->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+	ctx->v[1] = XXH_PRIME64_2;
+	ctx->v[2] = 0;
+	ctx->v[3] = 0 - XXH_PRIME64_1;
+	ctx->memsize = 0;
+}
+
+void xxh64_update(XXH64_CTX *ctx, const BYTE data[], size_t len)
+{
+	const BYTE *p = data;
+	const BYTE *end = data + len;
+
+	ctx->total_len += len;
+
+	/* Not enough for a stripe yet; just remember it */
+	if (ctx->memsize + len < XXH64_STRIPE_LENGTH) {
+		memcpy(ctx->mem + ctx->memsize, data, len);
+		ctx->memsize += len;
+		return;
+	}
+
+	/* Finish the stripe left over from last time */
+	if (ctx->memsize > 0) {
+		size_t fill = XXH64_STRIPE_LENGTH - ctx->memsize;
+		memcpy(ctx->mem + ctx->memsize, p, fill);
+		xxh64_stripe(ctx, ctx->mem);
+		p += fill;
+		ctx->memsize = 0;
+	}
+
+	while (p + XXH64_STRIPE_LENGTH <= end) {
+		xxh64_stripe(ctx, p);
+		p += XXH64_STRIPE_LENGTH;
+	}
+
+	if (p < end) {
+		memcpy(ctx->mem, p, end - p);
+		ctx->memsize = end - p;
+	}
+}
+
+void xxh64_final(XXH64_CTX *ctx, BYTE hash[])
+{
+	const BYTE *p = ctx->mem;
+	const BYTE *end = ctx->mem + ctx->memsize;
+	U64 h;
+	int i;
+
+	if (ctx->total_len >= XXH64_STRIPE_LENGTH) {
+		h = ROTL64(ctx->v[0], 1)  + ROTL64(ctx->v[1], 7)
+		  + ROTL64(ctx->v[2], 12) + ROTL64(ctx->v[3], 18);
+		h = xxh64_merge_round(h, ctx->v[0]);
+		h = xxh64_merge_round(h, ctx->v[1]);
+		h = xxh64_merge_round(h, ctx->v[2]);
+		h = xxh64_merge_round(h, ctx->v[3]);
+	} else {
+		h = XXH_PRIME64_5;
+	}
+
+	h += ctx->total_len;
+
+	for ( ; p + 8 <= end; p += 8) {
+		h ^= xxh64_round(0, xxh_read64(p));
+		h  = ROTL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (p + 4 <= end) {
+		h ^= xxh_read32(p) * XXH_PRIME64_1;
+		h  = ROTL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	for ( ; p < end; p++) {
+		h ^= (*p) * XXH_PRIME64_5;
+		h  = ROTL64(h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+
+	for (i = 0; i < 8; i++) {
+		hash[i] = (BYTE)(h >> (56 - i * 8));
+	}
+}
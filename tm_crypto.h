@@ -30,17 +30,38 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef TM_CRYPTO_H
 #define TM_CRYPTO_H
 
+#include <stddef.h>     /* for size_t */
+
 #define TM_CRYPTO_USAGE_ERROR	0x1
 #define TM_CRYPTO_FILE_ERROR	0x2
 
+/* Big enough for the digest of any of the algorithms below */
 #define CRYPTO_HASH_SIZE 			20
 #define CRYPTO_HASH_STRING_LENGTH	41
 
-void tm_CryptoHashData(const unsigned char* data, unsigned char digest[CRYPTO_HASH_SIZE]);
+/* The hash algorithms TMk can use to tell whether something changed */
+#define TM_HASH_SHA1	0
+#define TM_HASH_XXH64	1
+
+#ifndef TM_DEFAULT_HASH
+	#define TM_DEFAULT_HASH TM_HASH_XXH64
+#endif
+
+/* The algorithm used by tm_CryptoHashData, tm_CryptoHashFile and tm_CryptoHashToString */
+extern int tm_crypto_hash;
+
+const char *tm_CryptoHashName(int algorithm);
+int tm_CryptoFindHash(const char *name);
+
+void tm_CryptoHashDataWith(int algorithm, const unsigned char* data, size_t len, unsigned char digest[CRYPTO_HASH_SIZE]);
+void tm_CryptoHashFileWith(int algorithm, const char* file, unsigned char digest[CRYPTO_HASH_SIZE]);
+void tm_CryptoHashToStringWith(int algorithm, const unsigned char digest[CRYPTO_HASH_SIZE], char hash[CRYPTO_HASH_STRING_LENGTH]);
+
+void tm_CryptoHashData(const unsigned char* data, size_t len, unsigned char digest[CRYPTO_HASH_SIZE]);
 void tm_CryptoHashFile(const char* file, unsigned char digest[CRYPTO_HASH_SIZE]);
 void tm_CryptoHashToString(const unsigned char digest[CRYPTO_HASH_SIZE], char hash[CRYPTO_HASH_STRING_LENGTH]);
 
-#define TM_CRYPTO_HASH_DATA(DATA, DIGEST)       tm_CryptoHashData((const unsigned char*)(DATA), (unsigned char*)(DIGEST))
+#define TM_CRYPTO_HASH_DATA(DATA, LEN, DIGEST)  tm_CryptoHashData((const unsigned char*)(DATA), (LEN), (unsigned char*)(DIGEST))
 #define TM_CRYPTO_HASH_FILE(FILE, DIGEST)       tm_CryptoHashFile((const char*)(FILE), (unsigned char*)(DIGEST))
 #define TM_CRYPTO_HASH_TO_STRING(DIGEST, HASH)  tm_CryptoHashToString((const unsigned char*)(DIGEST), (char*)(HASH))
 #endif
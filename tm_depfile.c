@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tm_target.h"
+#include "tm_depfile.h"
+
+
+/* Read a whole file into a NUL-terminated buffer, to be freed by the
+ * caller, or return NULL if it can't be read.
+ */
+static char *read_file(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	char *buff = NULL;
+	size_t len = 0;
+	size_t size = 0;
+	size_t n;
+
+	if (!fp) {
+		return NULL;
+	}
+
+	do {
+		if (len + 1 >= size) {
+			size = size ? size * 2 : 4096;
+			buff = realloc(buff, size);
+		}
+		n = fread(buff + len, 1, size - len - 1, fp);
+		len += n;
+	} while (n > 0);
+
+	if (ferror(fp)) {
+		free(buff);
+		buff = NULL;
+	} else {
+		buff[len] = '\0';
+	}
+
+	fclose(fp);
+	return buff;
+}
+
+/* Return the length of the line continuation at p, or 0 if there isn't one */
+static int continuation(const char *p)
+{
+	if (p[0] == '\\' && p[1] == '\n') {
+		return 2;
+	}
+	if (p[0] == '\\' && p[1] == '\r' && p[2] == '\n') {
+		return 3;
+	}
+	return 0;
+}
+
+/* Returns true if p is at the colon that separates a rule's targets from
+ * its prerequisites (and not, say, a drive letter's).
+ */
+static int rule_colon(const char *p)
+{
+	return p[0] == ':' && (p[1] == ' ' || p[1] == '\t' || p[1] == '\r'
+	                   ||  p[1] == '\n' || p[1] == '\0');
+}
+
+/* Read the dependencies from a depfile, as written by gcc or clang with
+ * -MD (or -MMD): makefile rules with no recipes.  The prerequisites of
+ * all the rules are put in deps, in the order they appear; the targets
+ * are ignored.  Handles line continuations, and spaces, '#' and '$'
+ * escaped the way the compilers escape them.
+ * Returns 0 on success, or -1 if the file couldn't be read.
+ */
+int read_depfile(const char *path, target_list **deps)
+{
+	char *text = read_file(path);
+	char *word = NULL;
+	char *p = NULL;
+	char *w = NULL;
+	target_list *found = NULL;
+	int prereqs = 0;    /* past the colon of the current rule */
+	int n;
+
+	*deps = NULL;
+
+	if (!text) {
+		return -1;
+	}
+
+	word = malloc(strlen(text) + 1);
+
+	p = text;
+	while (*p) {
+		if ((n = continuation(p))) {
+			p += n;
+			continue;
+		}
+		if (*p == ' ' || *p == '\t' || *p == '\r') {
+			p++;
+			continue;
+		}
+		if (*p == '\n') {
+			prereqs = 0;
+			p++;
+			continue;
+		}
+		if (!prereqs && rule_colon(p)) {
+			prereqs = 1;
+			p++;
+			continue;
+		}
+
+		w = word;
+		while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'
+		&&     !continuation(p) && !(!prereqs && rule_colon(p))) {
+			if (p[0] == '\\' && (p[1] == ' ' || p[1] == '#')) {
+				*w++ = p[1];
+				p += 2;
+			} else if (p[0] == '$' && p[1] == '$') {
+				*w++ = '$';
+				p += 2;
+			} else {
+				*w++ = *p++;
+			}
+		}
+		*w = '\0';
+
+		if (prereqs) {
+			found = target_cons(word, found);
+		}
+	}
+
+	*deps = target_list_reverse(found);
+	free_target_list(found);
+	free(word);
+	free(text);
+
+	return 0;
+}
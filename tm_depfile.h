@@ -0,0 +1,8 @@
+#ifndef TM_DEPFILE_H
+#define TM_DEPFILE_H
+
+#include "tm_target.h"
+
+int read_depfile(const char *path, target_list **deps);
+
+#endif
@@ -0,0 +1,405 @@
+
+#define _DEFAULT_SOURCE   /* needed for posix_spawnp, waitpid and environ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define JIM_EMBEDDED
+#include <jim.h>
+#include <jim-signal.h>
+
+#include "tm_exec.h"
+
+extern char **environ;
+
+
+/* The environment commands are run with, built from ::env (and the
+ * TM_MAKEFLAGS of a jobserver) and kept until either of them changes.
+ * A reference is held to each, so any change to them makes a new object
+ * rather than altering these ones.
+ */
+static Jim_Obj *env_obj = NULL;
+static Jim_Obj *makeflags_obj = NULL;
+static char **env_block = NULL;
+
+
+/* Forget the environment built by command_env() */
+static void forget_env(Jim_Interp *interp, void *data)
+{
+	int i;
+
+	(void)data;
+
+	if (env_block) {
+		for (i = 0; env_block[i]; i++) {
+			free(env_block[i]);
+		}
+		free(env_block);
+		env_block = NULL;
+	}
+	if (env_obj) {
+		Jim_DecrRefCount(interp, env_obj);
+		env_obj = NULL;
+	}
+	if (makeflags_obj) {
+		Jim_DecrRefCount(interp, makeflags_obj);
+		makeflags_obj = NULL;
+	}
+}
+
+/* Return a copy of "name=value" */
+static char *env_entry(const char *name, const char *value)
+{
+	char *entry = malloc(strlen(name) + strlen(value) + 2);
+
+	sprintf(entry, "%s=%s", name, value);
+	return entry;
+}
+
+/* Return the environment for a command run from interp, which is the
+ * contents of ::env (or TMk's own environment, without it), with MAKEFLAGS
+ * set to TM_MAKEFLAGS if that's set.
+ */
+static char **command_env(Jim_Interp *interp)
+{
+	Jim_Obj *env = Jim_GetGlobalVariableStr(interp, "env", JIM_NONE);
+	Jim_Obj *makeflags = Jim_GetGlobalVariableStr(interp, "TM_MAKEFLAGS", JIM_NONE);
+	int n = 0;
+	int len = 0;
+	int i;
+
+	if (!env && !makeflags) {
+		return environ;
+	}
+
+	if (env_block && env == env_obj && makeflags == makeflags_obj) {
+		return env_block;
+	}
+
+	forget_env(interp, NULL);
+
+	if (env) {
+		len = Jim_ListLength(interp, env) / 2;
+	} else {
+		while (environ[len]) {
+			len++;
+		}
+	}
+	env_block = malloc((len + 2) * sizeof(char *));
+
+	for (i = 0; i < len; i++) {
+		char *entry = NULL;
+
+		if (env) {
+			entry = env_entry(Jim_String(Jim_ListGetIndex(interp, env, i * 2)),
+			                  Jim_String(Jim_ListGetIndex(interp, env, i * 2 + 1)));
+		} else {
+			entry = malloc(strlen(environ[i]) + 1);
+			strcpy(entry, environ[i]);
+		}
+
+		if (makeflags && strncmp(entry, "MAKEFLAGS=", 10) == 0) {
+			free(entry);
+		} else {
+			env_block[n++] = entry;
+		}
+	}
+	if (makeflags) {
+		env_block[n++] = env_entry("MAKEFLAGS", Jim_String(makeflags));
+	}
+	env_block[n] = NULL;
+
+	env_obj = env;
+	makeflags_obj = makeflags;
+	if (env_obj)
+		Jim_IncrRefCount(env_obj);
+	if (makeflags_obj)
+		Jim_IncrRefCount(makeflags_obj);
+
+	return env_block;
+}
+
+/* True if any of the n arguments in argv makes them a pipeline, or
+ * redirects something, or runs them in the background.  Those are left
+ * to Tcl's exec.
+ */
+static int needs_tcl_exec(int n, Jim_Obj *const *argv)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		const char *arg = Jim_String(argv[i]);
+
+		if (strcmp(arg, "|") == 0 || strcmp(arg, "|&") == 0
+		||  arg[0] == '<' || arg[0] == '>' || (arg[0] == '2' && arg[1] == '>')) {
+			return 1;
+		}
+	}
+
+	return n > 0 && strcmp(Jim_String(argv[n - 1]), "&") == 0;
+}
+
+/* Set interp's result to an error for a command that failed, with output
+ * (if any) being what it wrote to standard error, and return JIM_ERR.
+ */
+static int command_failed(Jim_Interp *interp, Jim_Obj *output, const char *why)
+{
+	Jim_Obj *msg = Jim_NewEmptyStringObj(interp);
+	int len = 0;
+
+	if (output) {
+		const char *str = Jim_GetString(output, &len);
+
+		Jim_AppendString(interp, msg, str, len);
+		if (len > 0 && str[len - 1] != '\n') {
+			Jim_AppendString(interp, msg, "\n", 1);
+		}
+	}
+	Jim_AppendString(interp, msg, why, -1);
+
+	Jim_SetResult(interp, msg);
+	return (JIM_ERR);
+}
+
+/* Run the command in the n arguments in argv directly, with posix_spawnp.
+ * In silent mode its output is thrown away, and what it writes to
+ * standard error is only shown if it fails.
+ */
+static int spawn_command(Jim_Interp *interp, int n, Jim_Obj *const *argv,
+                         int silent, int errexit)
+{
+	posix_spawn_file_actions_t actions;
+	Jim_Obj *output = NULL;
+	char **args = NULL;
+	char **saved_environ = environ;
+	char why[128];
+	int errpipe[2] = {-1, -1};
+	int status = 0;
+	int err;
+	pid_t pid;
+	int i;
+
+	args = malloc((n + 1) * sizeof(char *));
+	for (i = 0; i < n; i++) {
+		args[i] = (char *)Jim_String(argv[i]);
+	}
+	args[n] = NULL;
+
+	posix_spawn_file_actions_init(&actions);
+	if (silent && pipe(errpipe) == 0) {
+		fcntl(errpipe[0], F_SETFD, FD_CLOEXEC);
+		fcntl(errpipe[1], F_SETFD, FD_CLOEXEC);
+		posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+		posix_spawn_file_actions_adddup2(&actions, errpipe[1], 2);
+	}
+
+	/* posix_spawnp looks for the program in the PATH in environ */
+	fflush(stdout);
+	fflush(stderr);
+	environ = command_env(interp);
+	err = posix_spawnp(&pid, args[0], &actions, NULL, args, environ);
+	environ = saved_environ;
+
+	posix_spawn_file_actions_destroy(&actions);
+	free(args);
+
+	if (errpipe[1] >= 0) {
+		char buff[4096];
+		ssize_t len;
+
+		close(errpipe[1]);
+		output = Jim_NewEmptyStringObj(interp);
+		Jim_IncrRefCount(output);
+
+		while (err == 0 && ((len = read(errpipe[0], buff, sizeof(buff))) > 0
+		                    || (len < 0 && errno == EINTR))) {
+			if (len > 0)
+				Jim_AppendString(interp, output, buff, len);
+		}
+		close(errpipe[0]);
+	}
+
+	if (err != 0) {
+		if (output)
+			Jim_DecrRefCount(interp, output);
+		Jim_SetResultFormatted(interp, "couldn't exec \"%#s\": %s", argv[0], strerror(err));
+		return (JIM_ERR);
+	}
+
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+
+	if (!errexit || (WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+		if (output)
+			Jim_DecrRefCount(interp, output);
+		return (JIM_OK);
+	}
+
+	if (WIFEXITED(status)) {
+		sprintf(why, "exec returned non-zero return code: %d", WEXITSTATUS(status));
+	} else {
+		sprintf(why, "exec terminated abnormally: child killed by signal %s",
+		        Jim_SignalId(WTERMSIG(status)));
+	}
+
+	command_failed(interp, output, why);
+	if (output)
+		Jim_DecrRefCount(interp, output);
+	return (JIM_ERR);
+}
+
+/* Run the n arguments in argv through Tcl's exec, as tcl::exec.  Unless
+ * in silent mode (or the command is to run in the background) its output
+ * goes straight to TMk's own.
+ */
+static int tcl_exec(Jim_Interp *interp, int n, Jim_Obj *const *argv,
+                    int silent, int errexit)
+{
+	Jim_Obj **objv = malloc((n + 3) * sizeof(Jim_Obj *));
+	Jim_Obj *code = NULL;
+	const char *type = NULL;
+	int background = strcmp(Jim_String(argv[n - 1]), "&") == 0;
+	int objc = 0;
+	int ret;
+	int i;
+
+	objv[objc++] = Jim_NewStringObj(interp, "tcl::exec", -1);
+	if (!silent && !background) {
+		objv[objc++] = Jim_NewStringObj(interp, ">@stdout", -1);
+		objv[objc++] = Jim_NewStringObj(interp, "2>@stderr", -1);
+	}
+	for (i = 0; i < n; i++) {
+		objv[objc++] = argv[i];
+	}
+
+	Jim_SetGlobalVariableStr(interp, "errorCode", Jim_NewStringObj(interp, "NONE", -1));
+	ret = Jim_EvalObjVector(interp, objc, objv);
+	free(objv);
+
+	if (background) {
+		return ret;
+	}
+
+	if (ret != JIM_ERR) {
+		Jim_SetEmptyResult(interp);
+		return (JIM_OK);
+	}
+
+	/* Only failures of the command itself are affected by errexit */
+	code = Jim_GetGlobalVariableStr(interp, "errorCode", JIM_NONE);
+	if (code && Jim_ListLength(interp, code) >= 3) {
+		type = Jim_String(Jim_ListGetIndex(interp, code, 0));
+	}
+	if (!type || strncmp(type, "CHILD", 5) != 0) {
+		return ret;
+	}
+
+	if (!errexit) {
+		Jim_SetEmptyResult(interp);
+		return (JIM_OK);
+	}
+
+	if (strcmp(type, "CHILDSTATUS") == 0) {
+		char why[64];
+		long status = 0;
+		Jim_Obj *output = Jim_GetResult(interp);
+
+		Jim_GetLong(interp, Jim_ListGetIndex(interp, code, 2), &status);
+		sprintf(why, "exec returned non-zero return code: %ld", status);
+
+		Jim_IncrRefCount(output);
+		command_failed(interp, output, why);
+		Jim_DecrRefCount(interp, output);
+		return (JIM_ERR);
+	}
+
+	Jim_SetResultFormatted(interp, "exec terminated abnormally: %#s", Jim_GetResult(interp));
+	return (JIM_ERR);
+}
+
+
+/* exec ?-flags flags? arg ...
+ * Display the arguments, then run them as a command (or pipeline), and
+ * fail if it does.  Plain commands are spawned right here, without going
+ * through Tcl's exec.
+ */
+static int execCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
+{
+	Jim_Obj *noexec = Jim_GetGlobalVariableStr(interp, "TM_NO_EXECUTE", JIM_NONE);
+	int silent = Jim_GetGlobalVariableStr(interp, "TM_SILENT_MODE", JIM_NONE) != NULL;
+	const char *flags = "";
+	char bad[2] = "";
+	int echo = 1;
+	int errexit = 1;
+	int always = 0;
+	int first = 1;
+	long value = 1;
+	int i;
+
+	if (argc > 1 && strcmp(Jim_String(argv[1]), "-flags") == 0) {
+		if (argc < 3) {
+			Jim_SetResultString(interp, "No flags provided to -flags", -1);
+			return (JIM_ERR);
+		}
+		flags = Jim_String(argv[2]);
+		first = 3;
+	}
+
+	for (; *flags; flags++) {
+		switch (*flags) {
+			case '@':
+				echo = 0;
+				break;
+			case '-':
+				errexit = 0;
+				break;
+			case '+':
+				always = 1;
+				break;
+			default:
+				bad[0] = *flags;
+				Jim_SetResultFormatted(interp, "Unknown flag given to exec: %s", bad);
+				return (JIM_ERR);
+		}
+	}
+
+	Jim_SetEmptyResult(interp);
+	if (first >= argc) {
+		return (JIM_OK);
+	}
+
+	if (echo && !silent) {
+		for (i = first; i < argc; i++) {
+			fputs(Jim_String(argv[i]), stdout);
+			putchar(i + 1 < argc ? ' ' : '\n');
+		}
+		fflush(stdout);
+	}
+
+	if (noexec && !always && (Jim_GetLong(interp, noexec, &value) != JIM_OK || value)) {
+		Jim_SetEmptyResult(interp);
+		return (JIM_OK);
+	}
+
+	if (needs_tcl_exec(argc - first, argv + first)) {
+		return tcl_exec(interp, argc - first, argv + first, silent, errexit);
+	}
+
+	return spawn_command(interp, argc - first, argv + first, silent, errexit);
+}
+
+
+/* Replace exec with the one for recipes.  Tcl's own exec should have been
+ * renamed to tcl::exec first.
+ */
+void tm_RegisterExecCommand(Jim_Interp *interp)
+{
+	Jim_CreateCommand(interp, "exec", execCmd, NULL, forget_env);
+}
@@ -0,0 +1,9 @@
+#ifndef TM_EXEC_H
+#define TM_EXEC_H
+
+#define JIM_EMBEDDED
+#include <jim.h>
+
+void tm_RegisterExecCommand(Jim_Interp *interp);
+
+#endif
@@ -42,6 +42,7 @@ proc array_has {a key} {
 # Set a global parameter var to val using mode mode
 proc param {var val} {
 	global TM_PARAM
+	global TM_PARAMS
 	global TM_ENV_LOOKUP
 	global env
 
@@ -52,6 +53,7 @@ proc param {var val} {
 	} else {
 		uplevel "set $var {$val}"
 	}
+	lappend TM_PARAMS $var
 }
 
 # Clean up a list of options to make it suitable for exec
@@ -69,84 +71,6 @@ proc options {str} {
 
 rename exec tcl::exec
 
-proc exec args {
-	global TM_NO_EXECUTE
-	global TM_SILENT_MODE
-	set flags ""
-	set echo 1
-	set errexit 1
-	set noexec 0
-	set start 0
-
-	if {[defined TM_NO_EXECUTE]} {
-		set noexec $TM_NO_EXECUTE
-	}
-
-	if {[llength args] == 0} {
-		return "";
-	}
-
-	if {"[lindex $args 0]" eq "-flags"} {
-		if {[llength $args] < 2} {
-			error "No flags provided to -flags"
-		}
-		set flags [lindex $args 1]
-		set start 2
-	}
-
-	for {set i 0} {$i < [string length $flags]} {incr i} {
-		switch [string index $flags $i] {
-			"@" {set echo 0}
-			"-" {set errexit 0}
-			"+" {set noexec 0}
-			default {error "Unknown flag given to exec: [string index $i]"}
-		}
-	}
-
-	set rest [lrange $args $start end]
-	
-	if {$echo && ![defined TM_SILENT_MODE]} {
-		# Do it this way to avoid having Tcl escape quotes and such
-		# in the output.
-		foreach arg [lrange $rest 0 end-1] {
-			puts -nonewline "$arg "
-		}
-		puts "[lrange $rest end end]"
-		flush stdout
-	}
-
-	if {$noexec} {
-		return ""
-	}
-
-	if {![defined TM_SILENT_MODE]} {
-		set childpid [tcl::exec {*}$rest &]
-		set status [os.wait $childpid]    ;# TODO: This might not work on Windows...
-
-		if {"[lindex $status 1]" eq "exit" && [lindex $status 2] != 0} {
-			if {$errexit} {
-				error "exec returned non-zero return code: $status"
-			}
-		} elseif {"[lindex $status 1]" ne "exit"} {
-			if {$errexit} {
-				error "exec terminated abnormally: $status"
-			}
-		}
-	} else {
-		try {
-			tcl::exec {*}$rest
-		} on CHILDSTATUS {pid code} {
-			error "exec returned non-zero return code: $code"
-		} on CHILDKILLED {pid sig msg} {
-			error "exec terminated abnormally: $msg"
-		} on CHILDSUSP   {pid sig msg} {
-			error "exec suspended: $msg"
-		}
-	}
-
-	return ""
-}
-
 
 # Take a list of filenames and replace the extensions that match x with y
 proc replace-ext {files x y} {
@@ -162,15 +86,15 @@ proc replace-ext {files x y} {
 }
 
 
-# Define a substitution rule.  Returns a list of all the targets created.
+# Define a substitution rule, as a pattern rule making *$to from *$from.
+# Returns a list of the targets it could make in the current directory.
 proc sub {from to recipe} {
 	set OUT {}
 
 	foreach in [glob *$from] {
-		set out [replace-ext $in $from $to]
-		rule $out $in $recipe
-		lappend OUT $out
+		lappend OUT [replace-ext $in $from $to]
 	}
+	rule %$to %$from $recipe
 
 	return $OUT
 }
@@ -184,3 +108,92 @@ proc in-dir {dir files} {
 	return $newfiles
 }
 
+
+
+# The global variables and procs that recipes could read, in a string
+# that's the same whenever they are.  It goes into the key of every
+# artifact (see tm_artifact.c).  The environment, Tcl's own variables
+# and the TM_ ones TMk sets (including the parameters, which the key
+# has already) are left out, so different goals, -j and users can
+# still share artifacts.
+proc tm_recipe_state {} {
+	set state {}
+	foreach var [lsort [info globals]] {
+		if {$var in {env auto_path tcl_interactive tcl_platform}
+		||  [string match TM_* $var] || [string match *::* $var]
+		||  ![info exists ::$var]} {
+			continue
+		}
+		lappend state $var [set ::$var]
+	}
+	foreach p [lsort [lsearch -all -inline -not -glob [info procs] recipe::*]] {
+		lappend state $p [info args $p] [info statics $p] [info body $p]
+	}
+	return $state
+}
+
+# What evaluating a TMakefile can change besides the rules: the global
+# variables, the procs (apart from the recipes, which go with the rules)
+# and the set of commands.  Used to snapshot the TMakefile (see
+# tm_snapshot.c).
+proc tm_interp_state {} {
+	set vars {}
+	foreach var [info globals] {
+		if {[info exists ::$var]} {
+			dict set vars $var [set ::$var]
+		}
+	}
+	set procs {}
+	foreach p [lsearch -all -inline -not -glob [info procs] recipe::*] {
+		set statics {}
+		dict for {name value} [info statics $p] {
+			lappend statics [list $name $value]
+		}
+		dict set procs $p [list [info args $p] $statics [info body $p]]
+	}
+	set commands {}
+	foreach c [lsearch -all -inline -not -glob [info commands] recipe::*] {
+		dict set commands $c 1
+	}
+	list $vars $procs $commands
+}
+
+# Return a script that makes the same changes as were made since
+# tm_interp_state returned before.  It's an error if a command was
+# removed, or one was added that isn't a plain proc.
+proc tm_interp_changes {before} {
+	lassign $before vars procs commands
+	lassign [tm_interp_state] nvars nprocs ncommands
+	set script {}
+
+	dict for {var value} $nvars {
+		if {![dict exists $vars $var] || [dict get $vars $var] ne $value} {
+			append script [list set ::$var $value] \n
+		}
+	}
+	foreach var [dict keys $vars] {
+		if {![dict exists $nvars $var]} {
+			append script [list unset ::$var] \n
+		}
+	}
+	dict for {p def} $nprocs {
+		if {[string match <reference* $p]} {
+			return -code error "made a lambda"
+		}
+		if {![dict exists $procs $p] || [dict get $procs $p] ne $def} {
+			append script [list proc $p {*}$def] \n
+		}
+	}
+	foreach c [dict keys $commands] {
+		if {![dict exists $ncommands $c]} {
+			return -code error "removed command $c"
+		}
+	}
+	foreach c [dict keys $ncommands] {
+		if {![dict exists $commands $c] && ![dict exists $nprocs $c]} {
+			return -code error "made command $c"
+		}
+	}
+
+	return $script
+}
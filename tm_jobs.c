@@ -0,0 +1,602 @@
+
+#define _DEFAULT_SOURCE   /* needed for fork, wait4, sigaction and setenv */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define JIM_EMBEDDED
+#include <jim.h>
+
+#include "tm_jobs.h"
+
+
+/* The lowest descriptor the jobserver's pipe is given.  Jim's exec closes
+ * every descriptor below the highest one it redirects a command's output
+ * to, so a pipe down there wouldn't make it to a make run by a recipe. */
+#define JOBSERVER_FD 100
+
+/* How much output from a recipe is held in memory, before it's all moved
+ * to a temporary file */
+#define OUTPUT_SPILL (256 * 1024)
+
+/* The GNU make jobserver this TMk is taking part in, if any.  Each token
+ * read from it allows one more recipe to run, on top of the one every
+ * process is allowed without a token.
+ */
+static int js_read = -1;
+static int js_write = -1;
+static int js_created = 0;        /* whether this TMk set it up */
+static char *js_saved_flags = NULL; /* MAKEFLAGS from before that */
+static char *js_held = NULL;      /* the tokens held, to give back as read */
+static int js_nheld = 0;
+static pid_t js_owner = 0;
+
+/* Written to whenever a child exits, so a wait for a token can be
+ * interrupted by a recipe finishing */
+static int child_pipe[2] = {-1, -1};
+static struct sigaction saved_sigchld;
+
+
+/* Make fd non-blocking (as GNU make has the read end of its jobserver) */
+static void set_nonblocking(int fd)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* Write all len bytes of data to fd */
+static void write_all(int fd, const char *data, size_t len)
+{
+	ssize_t written;
+
+	while (len > 0) {
+		written = write(fd, data, len);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		} else if (written <= 0) {
+			return;
+		}
+		data += written;
+		len -= written;
+	}
+}
+
+/* Add len bytes of data to the output held in out, moving it all to a
+ * temporary file once there's more than OUTPUT_SPILL of it */
+static void append_output(tm_output *out, const char *data, size_t len)
+{
+	if (!out->spill && out->len + len > OUTPUT_SPILL) {
+		out->spill = tmpfile();
+		if (out->spill) {
+			fwrite(out->buff, 1, out->len, out->spill);
+			out->len = 0;
+		}
+	}
+
+	if (out->spill) {
+		fwrite(data, 1, len, out->spill);
+		return;
+	}
+
+	if (out->len + len > out->size) {
+		out->size = (out->len + len) * 2;
+		out->buff = realloc(out->buff, out->size);
+	}
+	memcpy(out->buff + out->len, data, len);
+	out->len += len;
+}
+
+/* Read all the output that's come through out's pipe so far, and close
+ * the pipe once there's no more to come */
+static void collect_output(tm_output *out)
+{
+	char buff[65536];
+	ssize_t len;
+
+	for (;;) {
+		len = read(out->fd, buff, sizeof(buff));
+		if (len > 0) {
+			append_output(out, buff, len);
+		} else if (len < 0 && errno == EINTR) {
+			continue;
+		} else {
+			if (len == 0) {
+				close(out->fd);
+				out->fd = -1;
+			}
+			return;
+		}
+	}
+}
+
+/* Write out all the output held in out to fd, and let it go */
+static void write_output(tm_output *out, int fd)
+{
+	char buff[65536];
+	size_t len;
+
+	if (out->fd >= 0) {
+		collect_output(out);
+		if (out->fd >= 0) {
+			/* Whatever still has it open (in the background) is too late */
+			close(out->fd);
+			out->fd = -1;
+		}
+	}
+
+	if (out->spill) {
+		rewind(out->spill);
+		while ((len = fread(buff, 1, sizeof(buff), out->spill)) > 0) {
+			write_all(fd, buff, len);
+		}
+		fclose(out->spill);
+		out->spill = NULL;
+	} else {
+		write_all(fd, out->buff, out->len);
+	}
+
+	free(out->buff);
+	out->buff = NULL;
+	out->len = out->size = 0;
+}
+
+/* Start capturing output into out, and return the end of the pipe for it
+ * to be written to, or -1 if it couldn't be made */
+static int capture_output(tm_output *out)
+{
+	int fds[2];
+
+	if (pipe(fds) != 0) {
+		return -1;
+	}
+
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	set_nonblocking(fds[0]);
+	out->fd = fds[0];
+	return fds[1];
+}
+
+/* True if fd1 and fd2 are the same file (e.g., both the terminal) */
+static int same_file(int fd1, int fd2)
+{
+	struct stat st1, st2;
+
+	if (fstat(fd1, &st1) != 0 || fstat(fd2, &st2) != 0) {
+		return 0;
+	}
+
+	return st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+}
+
+
+/* Evaluate cmd (a call to the recipe proc for target) in a child process,
+ * which is recorded in job.
+ * The child gets a copy of the interpreter, so anything the recipe does
+ * to the Tcl state stays in the child.  With sync, everything the recipe
+ * writes is held (in job) until finish_output(), so it doesn't get mixed
+ * up with the output of the other recipes running at the same time.
+ * Returns the pid of the child, or -1 if it couldn't be created.
+ */
+pid_t spawn_recipe(Jim_Interp *interp, const char *target, const char *cmd,
+                   int silence, int sync, tm_job *job)
+{
+	int out = -1;
+	int err = -1;
+	pid_t pid;
+
+	memset(&job->out, 0, sizeof(tm_output));
+	memset(&job->err, 0, sizeof(tm_output));
+	job->out.fd = job->err.fd = -1;
+
+	/* Standard output and error stay together if they're going to the
+	 * same place, so they stay in order */
+	if (sync) {
+		out = capture_output(&job->out);
+		if (out >= 0 && !same_file(STDOUT_FILENO, STDERR_FILENO)) {
+			err = capture_output(&job->err);
+		}
+	}
+
+	/* Don't let the child inherit (and repeat) anything still buffered */
+	fflush(stdout);
+	fflush(stderr);
+
+	pid = fork();
+
+	if (pid == 0) {
+		int ret;
+
+		if (out >= 0) {
+			dup2(out, STDOUT_FILENO);
+			dup2(err >= 0 ? err : out, STDERR_FILENO);
+		}
+
+		/* The recipe's own children are none of the scheduler's business */
+		if (child_pipe[0] >= 0) {
+			sigaction(SIGCHLD, &saved_sigchld, NULL);
+		}
+
+		if (!silence)
+			printf("Making target %s:\n", target);
+
+		ret = Jim_Eval(interp, cmd);
+
+		if (ret == JIM_ERR) {
+			Jim_MakeErrorMessage(interp);
+			fprintf(stderr, "%s\n", Jim_String(Jim_GetResult(interp)));
+		} else if (!silence) {
+			printf("\n");
+		}
+
+		fflush(stdout);
+		fflush(stderr);
+		_exit(ret == JIM_ERR ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (out >= 0)
+		close(out);
+	if (err >= 0)
+		close(err);
+
+	return pid;
+}
+
+/* Write out everything held from job's recipe, all at once, now that
+ * it's finished */
+void finish_output(tm_job *job)
+{
+	fflush(stdout);
+	fflush(stderr);
+	write_output(&job->out, STDOUT_FILENO);
+	write_output(&job->err, STDERR_FILENO);
+}
+
+/* Wait for any recipe started by spawn_recipe to finish, or if block is
+ * 0, only check whether one has.
+ * Returns the pid of the child that finished, and sets status to its exit
+ * status (0 if the recipe succeeded, or 128 plus the signal that killed
+ * it) and cpu to the CPU time it and its children used, in seconds.
+ * Returns 0 if none has finished yet (without block), or -1 if there are
+ * no children left to wait for.
+ */
+pid_t wait_recipe(int *status, double *cpu, int block)
+{
+	struct rusage ru;
+	int wstatus = 0;
+	pid_t pid;
+
+	do {
+		pid = wait4(-1, &wstatus, block ? 0 : WNOHANG, &ru);
+	} while (pid < 0 && errno == EINTR);
+
+	if (pid <= 0) {
+		return pid;
+	}
+
+	if (WIFEXITED(wstatus)) {
+		*status = WEXITSTATUS(wstatus);
+	} else if (WIFSIGNALED(wstatus)) {
+		*status = 128 + WTERMSIG(wstatus);
+	} else {
+		*status = EXIT_FAILURE;
+	}
+
+	*cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+	     + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+	return pid;
+}
+
+
+/* Give back the tokens still held when TMk exits, since the jobserver
+ * might well outlive it */
+static void return_tokens(void)
+{
+	if (js_owner != getpid()) {
+		return;
+	}
+
+	while (js_nheld > 0) {
+		jobserver_release();
+	}
+}
+
+/* Note that a child has exited, for wait_jobs() */
+static void child_exited(int sig)
+{
+	int saved = errno;
+	ssize_t written = write(child_pipe[1], "", 1);
+
+	(void)sig;
+	(void)written;
+	errno = saved;
+}
+
+/* Move fd up to JOBSERVER_FD or above, and return where it is now */
+static int move_up(int fd)
+{
+	int high = fcntl(fd, F_DUPFD, JOBSERVER_FD);
+
+	if (high < 0) {
+		return fd;
+	}
+
+	close(fd);
+	return high;
+}
+
+/* Describe the jobserver's pipe, as being for jobs jobs, in MAKEFLAGS.
+ * Anything it already says about a jobserver is overridden, since the
+ * last of each option is the one make goes by.
+ */
+static void export_pipe(int jobs)
+{
+	const char *flags = getenv("MAKEFLAGS");
+	char *new_flags = malloc((flags ? strlen(flags) : 0) + 64);
+
+	sprintf(new_flags, "%s -j%d --jobserver-auth=%d,%d",
+	        flags ? flags : "", jobs, js_read, js_write);
+	setenv("MAKEFLAGS", new_flags, 1);
+	free(new_flags);
+}
+
+/* Join the GNU make jobserver described in MAKEFLAGS, if there is one.
+ * That's either --jobserver-auth=R,W (or --jobserver-fds=R,W, from older
+ * versions of make), with the two ends of a pipe handed down by the
+ * parent, or --jobserver-auth=fifo:PATH.
+ * Returns the number of jobs the jobserver was set up for (from -j in
+ * MAKEFLAGS, or the number of processors when that's missing), or -1 if
+ * there's no jobserver to join.
+ */
+int jobserver_join(void)
+{
+	const char *flags = getenv("MAKEFLAGS");
+	char *copy = NULL;
+	char *word = NULL;
+	char *auth = NULL;
+	int jobs = 0;
+
+	if (!flags) {
+		return -1;
+	}
+
+	copy = malloc(strlen(flags) + 1);
+	strcpy(copy, flags);
+
+	/* The last of each option is the one that counts */
+	for (word = strtok(copy, " "); word; word = strtok(NULL, " ")) {
+		if (strncmp(word, "--jobserver-auth=", 17) == 0) {
+			auth = word + 17;
+		} else if (strncmp(word, "--jobserver-fds=", 16) == 0) {
+			auth = word + 16;
+		} else if (word[0] == '-' && word[1] == 'j' && isdigit((unsigned char)word[2])) {
+			jobs = atoi(word + 2);
+		}
+	}
+
+	if (!auth) {
+		free(copy);
+		return -1;
+	}
+
+	if (strncmp(auth, "fifo:", 5) == 0) {
+		js_read = js_write = open(auth + 5, O_RDWR | O_NONBLOCK);
+		if (js_read >= 0) {
+			fcntl(js_read, F_SETFD, FD_CLOEXEC);
+		}
+	} else if (sscanf(auth, "%d,%d", &js_read, &js_write) != 2
+	       ||  fcntl(js_read, F_GETFD) < 0 || fcntl(js_write, F_GETFD) < 0) {
+		js_read = js_write = -1;
+	}
+	free(copy);
+
+	if (js_read < 0) {
+		fprintf(stderr, "WARNING: jobserver unavailable: making one target at a time.  "
+		        "Add '+' to the parent make rule.\n");
+		return -1;
+	}
+
+	js_owner = getpid();
+	atexit(return_tokens);
+
+	if (jobs < 1) {
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = jobs < 1 ? 1 : jobs;
+	}
+
+	if (js_read != js_write) {
+		js_read = move_up(js_read);
+		js_write = move_up(js_write);
+		set_nonblocking(js_read);
+		export_pipe(jobs);
+	}
+
+	return jobs;
+}
+
+/* Get ready to run up to jobs recipes at once with interp.
+ * If TMk isn't already part of a jobserver, and there's more than one job,
+ * one is set up with a token for each job after the first and described in
+ * MAKEFLAGS, so that any make or TMk the recipes run shares it.  Either
+ * way, MAKEFLAGS is put in TM_MAKEFLAGS for exec to pass on.
+ */
+void jobserver_start(Jim_Interp *interp, int jobs)
+{
+	struct sigaction sa;
+	const char *flags = NULL;
+	int fds[2];
+	int i;
+
+	if (js_read < 0 && jobs > 1 && pipe(fds) == 0) {
+		js_read = move_up(fds[0]);
+		js_write = move_up(fds[1]);
+		js_created = 1;
+
+		for (i = 1; i < jobs; i++) {
+			if (write(js_write, "+", 1) != 1) {
+				break;
+			}
+		}
+		set_nonblocking(js_read);
+
+		flags = getenv("MAKEFLAGS");
+		if (flags) {
+			js_saved_flags = malloc(strlen(flags) + 1);
+			strcpy(js_saved_flags, flags);
+		}
+		export_pipe(jobs);
+
+		if (!js_owner) {
+			js_owner = getpid();
+			atexit(return_tokens);
+		}
+	}
+
+	if (js_read >= 0) {
+		Jim_SetGlobalVariableStr(interp, "TM_MAKEFLAGS",
+		                         Jim_NewStringObj(interp, getenv("MAKEFLAGS"), -1));
+	}
+
+	/* Recipes in child processes are waited for with wait_jobs(), which a
+	 * child exiting has to interrupt */
+	if (jobs > 1 && pipe(child_pipe) == 0) {
+		for (i = 0; i < 2; i++) {
+			fcntl(child_pipe[i], F_SETFD, FD_CLOEXEC);
+			set_nonblocking(child_pipe[i]);
+		}
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = child_exited;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+		sigaction(SIGCHLD, &sa, &saved_sigchld);
+	}
+}
+
+/* Undo jobserver_start(), once all the recipes have finished */
+void jobserver_stop(Jim_Interp *interp)
+{
+	if (child_pipe[0] >= 0) {
+		sigaction(SIGCHLD, &saved_sigchld, NULL);
+		close(child_pipe[0]);
+		close(child_pipe[1]);
+		child_pipe[0] = child_pipe[1] = -1;
+	}
+
+	if (!js_created) {
+		return;
+	}
+
+	while (js_nheld > 0) {
+		jobserver_release();
+	}
+	close(js_read);
+	close(js_write);
+	js_read = js_write = -1;
+	js_created = 0;
+
+	if (js_saved_flags) {
+		setenv("MAKEFLAGS", js_saved_flags, 1);
+		free(js_saved_flags);
+		js_saved_flags = NULL;
+	} else {
+		unsetenv("MAKEFLAGS");
+	}
+	Jim_Eval(interp, "unset -nocomplain TM_MAKEFLAGS");
+}
+
+/* Take a token from the jobserver, without waiting for one.
+ * Returns 1 if there was one (or there's no jobserver, and so no need for
+ * one), or 0 if not.
+ */
+int jobserver_acquire(void)
+{
+	char token;
+
+	if (js_read < 0) {
+		return 1;
+	}
+
+	if (read(js_read, &token, 1) != 1) {
+		return 0;
+	}
+
+	js_held = realloc(js_held, js_nheld + 1);
+	js_held[js_nheld++] = token;
+	return 1;
+}
+
+/* Give back a token taken by jobserver_acquire() */
+void jobserver_release(void)
+{
+	if (js_nheld == 0) {
+		return;
+	}
+
+	js_nheld--;
+	if (write(js_write, &js_held[js_nheld], 1) != 1) {
+		fprintf(stderr, "WARNING: Unable to give a token back to the jobserver\n");
+	}
+}
+
+/* Wait until one of the nrunning jobs in running has finished, or has
+ * output to collect, or (if want_token) the jobserver might have a token.
+ */
+void wait_jobs(tm_job *running, int nrunning, int want_token)
+{
+	struct pollfd *fds = malloc((2 * nrunning + 2) * sizeof(struct pollfd));
+	char drain[64];
+	int nfds = 0;
+	int i, j;
+
+	for (i = 0; i < nrunning; i++) {
+		if (running[i].out.fd >= 0) {
+			fds[nfds].fd = running[i].out.fd;
+			fds[nfds++].events = POLLIN;
+		}
+		if (running[i].err.fd >= 0) {
+			fds[nfds].fd = running[i].err.fd;
+			fds[nfds++].events = POLLIN;
+		}
+	}
+	if (child_pipe[0] >= 0) {
+		fds[nfds].fd = child_pipe[0];
+		fds[nfds++].events = POLLIN;
+	}
+	if (want_token && js_read >= 0) {
+		fds[nfds].fd = js_read;
+		fds[nfds++].events = POLLIN;
+	}
+
+	/* Without a pipe to hear about children from, check back now and then */
+	if (poll(fds, nfds, child_pipe[0] >= 0 ? -1 : 10) <= 0) {
+		free(fds);
+		return;
+	}
+
+	for (i = 0, j = 0; i < nrunning; i++) {
+		if (running[i].out.fd >= 0 && fds[j++].revents) {
+			collect_output(&running[i].out);
+		}
+		if (running[i].err.fd >= 0 && fds[j++].revents) {
+			collect_output(&running[i].err);
+		}
+	}
+	if (child_pipe[0] >= 0 && fds[j].revents) {
+		while (read(child_pipe[0], drain, sizeof(drain)) > 0)
+			;
+	}
+
+	free(fds);
+}
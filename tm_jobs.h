@@ -0,0 +1,45 @@
+#ifndef TM_JOBS_H
+#define TM_JOBS_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define JIM_EMBEDDED
+#include <jim.h>
+
+#include "tmake.h"
+#include "tm_trace.h"
+
+/* Output from a recipe, held until it's finished */
+typedef struct tm_output {
+	int fd;         /* the pipe it comes through, or -1 */
+	char *buff;
+	size_t len;
+	size_t size;
+	FILE *spill;    /* where it's held once there's too much for buff */
+} tm_output;
+
+/* A recipe being evaluated in a child process */
+typedef struct tm_job {
+	pid_t pid;
+	int node;    /* the scheduler's index for the rule being made */
+	int lane;    /* where it's shown in a trace */
+	double started;
+	tm_trace_mark mark;
+	tm_output out;    /* its standard output, with --output-sync */
+	tm_output err;    /* and standard error, if that goes elsewhere */
+} tm_job;
+
+pid_t spawn_recipe(Jim_Interp *interp, const char *target, const char *cmd,
+                   int silence, int sync, tm_job *job);
+void finish_output(tm_job *job);
+pid_t wait_recipe(int *status, double *cpu, int block);
+
+int jobserver_join(void);
+void jobserver_start(Jim_Interp *interp, int jobs);
+void jobserver_stop(Jim_Interp *interp);
+int jobserver_acquire(void);
+void jobserver_release(void);
+void wait_jobs(tm_job *running, int nrunning, int want_token);
+
+#endif
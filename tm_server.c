@@ -0,0 +1,633 @@
+
+#define _GNU_SOURCE       /* needed for sigaction, the CMSG macros and struct ucred */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define JIM_EMBEDDED
+#include <jim.h>
+
+#include "tmake.h"
+#include "tm_target.h"
+#include "tm_cache.h"
+#include "tm_update.h"
+#include "tm_snapshot.h"
+#include "tm_server.h"
+
+/* The most a client can put in a request */
+#define REQUEST_SIZE 4096
+
+/* How long a client waits for a restarting server to come back */
+#define RESTART_WAIT_MS 10000
+
+/* What's watched for in the directories of the files in the graph */
+#define WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+                    | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* A directory watched with inotify */
+typedef struct watch_dir {
+	int wd;
+	char *path;
+} watch_dir;
+
+/* A TMakefile evaluated once and kept around to serve builds */
+typedef struct tm_server {
+	Jim_Interp *interp;
+	const char *tmfile;
+	char **argv;            /* to start over with if the TMakefile changes */
+	int sock;
+	int inotify;
+	watch_dir *dirs;
+	int ndirs;
+	int reload;             /* the TMakefile changed */
+	char env_key[CRYPTO_HASH_STRING_LENGTH];    /* see snapshot_env_key() */
+} tm_server;
+
+/* Set by SIGINT and SIGTERM */
+static volatile sig_atomic_t stopping = 0;
+
+
+static void stop(int sig)
+{
+	(void)sig;
+	stopping = 1;
+}
+
+/* Return the directory part of a path, to be freed by the caller */
+static char *dir_of(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char *dir = NULL;
+
+	if (!slash) {
+		dir = malloc(2);
+		strcpy(dir, ".");
+	} else if (slash == path) {
+		dir = malloc(2);
+		strcpy(dir, "/");
+	} else {
+		dir = malloc(slash - path + 1);
+		memcpy(dir, path, slash - path);
+		dir[slash - path] = '\0';
+	}
+
+	return dir;
+}
+
+/* Return the address of the socket in the current directory */
+static struct sockaddr_un socket_address(void)
+{
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, TM_SOCKET, sizeof(addr.sun_path) - 1);
+
+	return addr;
+}
+
+/* Connect to the server for the current directory.
+ * Returns the connected socket, or sets errno and returns -1 if there's
+ * no server.
+ */
+static int connect_server(void)
+{
+	struct sockaddr_un addr = socket_address();
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+	if (fd < 0) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		int err = errno;
+
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Create the socket to listen for clients on.
+ * Returns the socket, or prints an error and returns -1.
+ */
+static int listen_socket(void)
+{
+	struct sockaddr_un addr = socket_address();
+	int fd = connect_server();
+	mode_t mask;
+
+	if (fd >= 0) {
+		close(fd);
+		fprintf(stderr, "ERROR: A server is already running in this directory\n");
+		return -1;
+	}
+
+	/* A socket nobody's listening on is left from a server that's gone.
+	 * Anything else (say, one we may not connect to) is left alone, and
+	 * makes bind fail below.
+	 */
+	if (errno == ECONNREFUSED) {
+		unlink(TM_SOCKET);
+	}
+
+	/* The server runs recipes for whoever connects, so only let the user
+	 * running it connect */
+	mask = umask(S_IRWXG | S_IRWXO);
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+		fprintf(stderr, "ERROR: Unable to listen on %s: %s\n", TM_SOCKET, strerror(errno));
+		if (fd >= 0) close(fd);
+		fd = -1;
+	}
+	umask(mask);
+
+	return fd;
+}
+
+
+/* Watch a directory, if it isn't already.
+ * Returns 0 if it's being watched, or -1 if it can't be.
+ */
+static int watch(tm_server *srv, const char *dir)
+{
+	int wd;
+	int i;
+
+	for (i = 0; i < srv->ndirs; i++) {
+		if (strcmp(srv->dirs[i].path, dir) == 0) {
+			return 0;
+		}
+	}
+
+	wd = inotify_add_watch(srv->inotify, dir, WATCH_EVENTS);
+	if (wd < 0) {
+		return -1;
+	}
+
+	srv->dirs = realloc(srv->dirs, (srv->ndirs + 1) * sizeof(watch_dir));
+	srv->dirs[srv->ndirs].wd = wd;
+	srv->dirs[srv->ndirs].path = malloc(strlen(dir) + 1);
+	strcpy(srv->dirs[srv->ndirs].path, dir);
+	srv->ndirs++;
+
+	return 0;
+}
+
+/* Stop watching everything, so every file gets checked by the next build */
+static void forget_watches(tm_server *srv)
+{
+	tm_rule_list *node;
+	int i;
+
+	for (i = 0; i < srv->ndirs; i++) {
+		inotify_rm_watch(srv->inotify, srv->dirs[i].wd);
+		free(srv->dirs[i].path);
+	}
+	free(srv->dirs);
+	srv->dirs = NULL;
+	srv->ndirs = 0;
+
+	for (node = tm_rules; node; node = node->next) {
+		node->rule->watched = 0;
+	}
+}
+
+/* Watch the TMakefile and every file in the graph.  A file whose stat
+ * matches the cache is known to be unchanged until an event says
+ * otherwise, so builds don't need to check it.
+ */
+static void watch_rules(tm_server *srv)
+{
+	tm_rule_list *node;
+	tm_cache cache;
+	char *dir = dir_of(srv->tmfile);
+
+	watch(srv, dir);
+	free(dir);
+
+	/* Builds run in child processes, so reload what they stored */
+	if (cache_open(&cache, srv->tmfile) < 0) {
+		return;
+	}
+	cache_load(&cache);
+
+	for (node = tm_rules; node; node = node->next) {
+		tm_rule *rule = node->rule;
+
+		if (rule->type != TM_FILENAME || rule->watched) {
+			continue;
+		}
+
+		dir = dir_of(rule->target);
+		if (watch(srv, dir) == 0) {
+			rule->watched = file_unchanged(rule);
+		}
+		free(dir);
+	}
+
+	cache_close(&cache);
+}
+
+/* Read all the pending inotify events, and note which files changed */
+static void read_events(tm_server *srv)
+{
+	union {
+		struct inotify_event event;
+		char buff[64 * 1024];
+	} events;
+	ssize_t len;
+
+	while ((len = read(srv->inotify, &events, sizeof(events))) > 0) {
+		char *p = events.buff;
+
+		while (p < events.buff + len) {
+			struct inotify_event *event = (struct inotify_event *)p;
+			const char *dir = NULL;
+			int i;
+
+			p += sizeof(struct inotify_event) + event->len;
+
+			for (i = 0; i < srv->ndirs; i++) {
+				if (srv->dirs[i].wd == event->wd) {
+					dir = srv->dirs[i].path;
+					break;
+				}
+			}
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				/* events were lost */
+				forget_watches(srv);
+			} else if (!dir) {
+				/* a watch that was already forgotten */
+			} else if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+				/* the directory went away, so its paths mean nothing now */
+				forget_watches(srv);
+			} else if (event->len > 0) {
+				char *path = malloc(strlen(dir) + strlen(event->name) + 2);
+				tm_rule *rule = NULL;
+
+				if (strcmp(dir, ".") == 0) {
+					strcpy(path, event->name);
+				} else {
+					sprintf(path, "%s/%s", dir, event->name);
+				}
+
+				if (strcmp(path, srv->tmfile) == 0) {
+					srv->reload = 1;
+				} else if ((rule = find_rule(path, &tm_rule_index))) {
+					rule->watched = 0;
+				}
+				free(path);
+			}
+		}
+	}
+}
+
+/* Start over, evaluating the TMakefile again, by running the same
+ * command this server was started with.  Only returns if it can't.
+ */
+static void restart(tm_server *srv)
+{
+	printf("%s changed, restarting\n", srv->tmfile);
+	fflush(stdout);
+
+	close(srv->sock);
+	unlink(TM_SOCKET);
+	close(srv->inotify);
+
+	execvp(srv->argv[0], srv->argv);
+
+	fprintf(stderr, "ERROR: Unable to restart %s: %s\n", srv->argv[0], strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+/* Send a short reply to a client */
+static void reply(int client, const char *msg)
+{
+	send(client, msg, strlen(msg), 0);
+}
+
+/* Return 1 if the client connected as the user running the server, or
+ * else 0.  The socket's permissions should already see to that, but they
+ * aren't checked on every system.
+ */
+static int same_user(int client)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+		return 0;
+	}
+
+	return cred.uid == getuid();
+}
+
+/* Make goal in a child process with the client's stdout and stderr, so
+ * that whatever the build does to the interpreter (and however it exits)
+ * doesn't touch the server.  Returns the exit status of the build.
+ */
+static int build(tm_server *srv, const int fds[2], const char *goal,
+                 int force, int silence, int jobs, int verbose)
+{
+	int status = 0;
+	pid_t pid;
+
+	fflush(stdout);
+	fflush(stderr);
+
+	pid = fork();
+
+	if (pid == 0) {
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGPIPE, SIG_DFL);
+		close(srv->sock);
+		close(srv->inotify);
+
+		dup2(fds[0], STDOUT_FILENO);
+		dup2(fds[1], STDERR_FILENO);
+
+		Jim_SetGlobalVariableStr(srv->interp, "TM_JOBS", Jim_NewIntObj(srv->interp, jobs));
+		if (silence) {
+			Jim_SetGlobalVariableStr(srv->interp, "TM_SILENT_MODE", Jim_NewIntObj(srv->interp, 1));
+		}
+
+		exit(make_goal(srv->interp, srv->tmfile, goal, force, silence, jobs, 0, 0, verbose, 0));
+	}
+
+	if (pid < 0) {
+		dprintf(fds[1], "ERROR: Unable to start a build: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+/* Receive a request from a client and carry it out.
+ * A request is the TMakefile, the goal (or ""), the number of jobs, the
+ * flags ("u" to force, "s" for silence, "v" for verbose), and the digest
+ * of the client's directory and environment, each ending in a NUL, sent
+ * along with the client's stdout and stderr.  A client whose digest isn't
+ * the server's is refused, and builds on its own.
+ */
+static void serve_request(tm_server *srv, int client)
+{
+	char buff[REQUEST_SIZE + 1];
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	char status[32];
+	const char *fields[5];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	int fds[2] = { -1, -1 };
+	ssize_t len;
+	char *p;
+	int n = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buff;
+	iov.iov_len = REQUEST_SIZE;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	len = recvmsg(client, &msg, 0);
+	if (len <= 0) {
+		return;
+	}
+	buff[len] = '\0';
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+	&&  cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+		memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+	}
+
+	for (p = buff; n < 5 && p < buff + len; p += strlen(p) + 1) {
+		fields[n++] = p;
+	}
+
+	/* Catch up on changes made since the last event was read */
+	read_events(srv);
+
+	if (n < 5 || fds[0] < 0) {
+		reply(client, "refused");
+	} else if (srv->reload) {
+		reply(client, "restart");
+		restart(srv);
+	} else if (strcmp(fields[0], srv->tmfile) != 0 || strcmp(fields[4], srv->env_key) != 0) {
+		reply(client, "refused");
+	} else {
+		const char *goal = *fields[1] ? fields[1] : tm_goal;
+		int ret = build(srv, fds, goal,
+		                strchr(fields[3], 'u') != NULL,
+		                strchr(fields[3], 's') != NULL,
+		                atoi(fields[2]),
+		                strchr(fields[3], 'v') != NULL);
+
+		watch_rules(srv);
+
+		sprintf(status, "status %d", ret);
+		reply(client, status);
+	}
+
+	if (fds[0] >= 0) close(fds[0]);
+	if (fds[1] >= 0) close(fds[1]);
+}
+
+/* Serve builds of the TMakefile tmfile, which has been evaluated in
+ * interp, to clients in the current directory until interrupted.  A
+ * change to the TMakefile makes the server start over with argv.
+ * Returns the exit status for TMk.
+ */
+int serve(Jim_Interp *interp, const char *tmfile, char **argv)
+{
+	struct sigaction sa;
+	tm_server srv;
+
+	memset(&srv, 0, sizeof(srv));
+	srv.interp = interp;
+	srv.tmfile = tmfile;
+	srv.argv = argv;
+	snapshot_env_key(srv.env_key);
+
+	srv.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (srv.inotify < 0) {
+		fprintf(stderr, "ERROR: Unable to watch files: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	srv.sock = listen_socket();
+	if (srv.sock < 0) {
+		close(srv.inotify);
+		return EXIT_FAILURE;
+	}
+
+	/* Interrupt poll() to stop, and outlive clients that go away */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	watch_rules(&srv);
+
+	printf("Serving %s on %s\n", tmfile, TM_SOCKET);
+	fflush(stdout);
+
+	while (!stopping) {
+		struct pollfd pfd[2];
+
+		pfd[0].fd = srv.sock;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = srv.inotify;
+		pfd[1].events = POLLIN;
+
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "ERROR: poll failed: %s\n", strerror(errno));
+			break;
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			read_events(&srv);
+			if (srv.reload) {
+				restart(&srv);
+			}
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			int client = accept(srv.sock, NULL, NULL);
+
+			if (client >= 0) {
+				if (same_user(client)) {
+					serve_request(&srv, client);
+				} else {
+					reply(client, "refused");
+				}
+				close(client);
+			}
+		}
+	}
+
+	close(srv.sock);
+	unlink(TM_SOCKET);
+	forget_watches(&srv);
+	close(srv.inotify);
+
+	return EXIT_SUCCESS;
+}
+
+
+/* Have the server for the current directory (if there is one) make goal,
+ * with its output going to this process's stdout and stderr.  Returns the
+ * exit status of the build, or -1 if there's no server to do it (or it
+ * won't), in which case TMk should do the build itself.
+ */
+int request_build(const char *tmfile, const char *goal,
+                  int force, int silence, int jobs, int verbose)
+{
+	char buff[REQUEST_SIZE];
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	char answer[64];
+	char env_key[CRYPTO_HASH_STRING_LENGTH];
+	int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	ssize_t len;
+	int waited = 0;
+	int fd;
+	int n;
+
+	goal = goal ? goal : "";
+	if (strlen(tmfile) + strlen(goal) + CRYPTO_HASH_STRING_LENGTH + 32 > REQUEST_SIZE) {
+		return -1;
+	}
+	snapshot_env_key(env_key);
+
+	n = sprintf(buff, "%s", tmfile) + 1;
+	n += sprintf(buff + n, "%s", goal) + 1;
+	n += sprintf(buff + n, "%d", jobs) + 1;
+	n += sprintf(buff + n, "%s%s%s", force ? "u" : "", silence ? "s" : "", verbose ? "v" : "") + 1;
+	n += sprintf(buff + n, "%s", env_key) + 1;
+
+	for (;;) {
+		if ((fd = connect_server()) < 0) {
+			return -1;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		memset(control, 0, sizeof(control));
+		iov.iov_base = buff;
+		iov.iov_len = n;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, 2 * sizeof(int));
+
+		fflush(stdout);
+		fflush(stderr);
+
+		if (sendmsg(fd, &msg, 0) < 0) {
+			close(fd);
+			return -1;
+		}
+
+		len = recv(fd, answer, sizeof(answer) - 1, 0);
+		close(fd);
+
+		if (len <= 0) {
+			fprintf(stderr, "ERROR: Lost the connection to the server\n");
+			return EXIT_FAILURE;
+		}
+		answer[len] = '\0';
+
+		if (strncmp(answer, "status ", 7) == 0) {
+			return atoi(answer + 7);
+		}
+		if (strcmp(answer, "restart") != 0) {
+			return -1;
+		}
+
+		/* Wait for the server to evaluate the TMakefile again */
+		while ((fd = connect_server()) < 0 && waited < RESTART_WAIT_MS) {
+			poll(NULL, 0, 50);
+			waited += 50;
+		}
+		if (fd < 0) {
+			return -1;
+		}
+		close(fd);
+	}
+}
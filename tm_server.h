@@ -0,0 +1,11 @@
+#ifndef TM_SERVER_H
+#define TM_SERVER_H
+
+#define JIM_EMBEDDED
+#include <jim.h>
+
+int serve(Jim_Interp *interp, const char *tmfile, char **argv);
+int request_build(const char *tmfile, const char *goal,
+                  int force, int silence, int jobs, int verbose);
+
+#endif
@@ -0,0 +1,1168 @@
+#define _DEFAULT_SOURCE   /* needed for getcwd and environ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#define JIM_EMBEDDED
+#include <jim.h>
+
+#include "tmake.h"
+#include "tm_crypto.h"
+#include "tm_target.h"
+#include "tm_cache.h"
+#include "tm_core_cmds.h"
+#include "tm_update.h"
+#include "tm_snapshot.h"
+
+extern char **environ;
+
+/* Changed whenever what goes into a snapshot changes */
+#define SNAPSHOT_FORMAT 2
+
+/* How many snapshots are kept for each TMakefile, for the different
+ * parameters or environments it's evaluated with */
+#define SNAPSHOT_KEEP 4
+
+/* Environment variables that change from one shell (or make) to the
+ * next, and aren't part of what a snapshot is for */
+static const char *const unkeyed_env[] = {
+	"_", "OLDPWD", "SHLVL", "MAKEFLAGS", "MFLAGS", "MAKELEVEL", NULL
+};
+
+/* What a watched command does while the TMakefile is evaluated */
+#define WATCH_UNCACHEABLE 0    /* something a snapshot can't repeat */
+#define WATCH_PROBE       1    /* looks at the files, so is checked again */
+#define WATCH_FILE        2    /* file: a probe, pure, or uncacheable */
+#define WATCH_OPEN        3    /* reads a file, or else is uncacheable */
+#define WATCH_SOURCE      4    /* reads a file */
+#define WATCH_PACKAGE     5    /* package require reads a file */
+#define WATCH_OUTPUT      6    /* writes to stdout or stderr, replayed */
+#define WATCH_INPUT       7    /* reads stdin, so is uncacheable */
+
+/* A command that's replaced while the TMakefile is evaluated, to find
+ * out what the evaluation depended on */
+typedef struct watched_cmd {
+	const char *name;
+	int kind;
+	Jim_Obj *real;    /* the name the command is renamed to meanwhile */
+} watched_cmd;
+
+static watched_cmd watched[] = {
+	{ "exec", WATCH_UNCACHEABLE, NULL },
+	{ "tcl::exec", WATCH_UNCACHEABLE, NULL },
+	{ "popen", WATCH_UNCACHEABLE, NULL },
+	{ "cd", WATCH_UNCACHEABLE, NULL },
+	{ "clock", WATCH_UNCACHEABLE, NULL },
+	{ "rand", WATCH_UNCACHEABLE, NULL },
+	{ "socket", WATCH_UNCACHEABLE, NULL },
+	{ "glob", WATCH_PROBE, NULL },
+	{ "readdir", WATCH_PROBE, NULL },
+	{ "file", WATCH_FILE, NULL },
+	{ "open", WATCH_OPEN, NULL },
+	{ "source", WATCH_SOURCE, NULL },
+	{ "package", WATCH_PACKAGE, NULL },
+	{ "puts", WATCH_OUTPUT, NULL },
+	{ "gets", WATCH_INPUT, NULL },
+	{ "read", WATCH_INPUT, NULL },
+	{ NULL, 0, NULL }
+};
+
+/* file subcommands that only look at a file (with just the file given),
+ * and ones that don't look at the file system at all */
+static const char *const file_probes[] = {
+	"exists", "isfile", "isdirectory", "readable", "writable", "executable",
+	"owned", "size", "type", "mtime", "readlink", NULL
+};
+static const char *const file_pure[] = {
+	"dirname", "tail", "rootname", "extension", "join", "split", "normalize", NULL
+};
+
+/* A growing buffer that a snapshot is written to */
+typedef struct snap_buf {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+} snap_buf;
+
+/* A snapshot being read back.  Reading past the end sets bad. */
+typedef struct snap_reader {
+	const unsigned char *p;
+	const unsigned char *end;
+	int bad;
+} snap_reader;
+
+static char key[CRYPTO_HASH_STRING_LENGTH];    /* of what's set up before evaluating */
+static int have_key = 0;
+static int watching = 0;
+static int nested = 0;             /* watched commands running inside others */
+static Jim_Obj *before = NULL;     /* tm_interp_state before evaluating */
+static char **files = NULL;        /* the files the evaluation read */
+static int nfiles = 0;
+static Jim_Obj *probes = NULL;     /* {command code result} for each probe */
+static Jim_Obj *output = NULL;     /* the puts commands that wrote to stdout or stderr */
+static char *uncacheable = NULL;   /* why there's no snapshot, if there isn't */
+static const char *outcome = NULL;    /* for snapshot_summary() */
+
+
+static void put(snap_buf *buf, const void *data, size_t len)
+{
+	if (buf->len + len > buf->size) {
+		buf->size = (buf->len + len) * 2;
+		buf->data = realloc(buf->data, buf->size);
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static void put_int(snap_buf *buf, int n)
+{
+	put(buf, &n, sizeof(n));
+}
+
+static void put_size(snap_buf *buf, unsigned long long n)
+{
+	put(buf, &n, sizeof(n));
+}
+
+/* Put a string, which may be NULL, with its terminator */
+static void put_str(snap_buf *buf, const char *str)
+{
+	int len = str ? (int)strlen(str) + 1 : 0;
+
+	put_int(buf, len);
+	if (str) {
+		put(buf, str, len);
+	}
+}
+
+static const void *get(snap_reader *r, size_t len)
+{
+	const unsigned char *p = r->p;
+
+	if (r->bad || (size_t)(r->end - r->p) < len) {
+		r->bad = 1;
+		return NULL;
+	}
+	r->p += len;
+
+	return p;
+}
+
+static int get_int(snap_reader *r)
+{
+	const void *p = get(r, sizeof(int));
+	int n = 0;
+
+	if (p) {
+		memcpy(&n, p, sizeof(n));
+	}
+	return n;
+}
+
+static unsigned long long get_size(snap_reader *r)
+{
+	const void *p = get(r, sizeof(unsigned long long));
+	unsigned long long n = 0;
+
+	if (p) {
+		memcpy(&n, p, sizeof(n));
+	}
+	return n;
+}
+
+/* Get a string put by put_str(), pointing into the snapshot, or NULL */
+static const char *get_str(snap_reader *r)
+{
+	int len = get_int(r);
+	const char *str = NULL;
+
+	if (len < 0) {
+		r->bad = 1;
+	} else if (len > 0) {
+		str = get(r, len);
+		if (str && str[len - 1] != '\0') {
+			r->bad = 1;
+			str = NULL;
+		}
+	}
+
+	return str;
+}
+
+/* Get an index put with put_int(), checking it's -1 or below n */
+static int get_index(snap_reader *r, int n)
+{
+	int i = get_int(r);
+
+	if (i < -1 || i >= n) {
+		r->bad = 1;
+		return -1;
+	}
+	return i;
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+/* Put the environment variables, sorted, leaving out the ones that
+ * change from one shell to the next */
+static void put_environment(snap_buf *buf)
+{
+	char **env = NULL;
+	int i, n;
+
+	for (n = 0; environ[n]; n++)
+		;
+	env = malloc((n + 1) * sizeof(char *));
+	memcpy(env, environ, n * sizeof(char *));
+	qsort(env, n, sizeof(char *), compare_strings);
+	for (i = 0; i < n; i++) {
+		size_t len = strcspn(env[i], "=");
+		int j;
+
+		for (j = 0; unkeyed_env[j]; j++) {
+			if (strlen(unkeyed_env[j]) == len && strncmp(env[i], unkeyed_env[j], len) == 0)
+				break;
+		}
+		if (!unkeyed_env[j]) {
+			put_str(buf, env[i]);
+		}
+	}
+	free(env);
+}
+
+/* Work out the key for the snapshots that could be used now, from
+ * everything that's been set up for the TMakefile to be evaluated with:
+ * the global variables (which include the parameters from the command
+ * line and the goal), the environment and the current directory.
+ */
+static void make_key(Jim_Interp *interp, const char *tmfile)
+{
+	snap_buf buf = { NULL, 0, 0 };
+	unsigned char digest[CRYPTO_HASH_SIZE];
+	char cwd[4096];
+	Jim_Obj *globals = NULL;
+	int i, n;
+
+	put_int(&buf, SNAPSHOT_FORMAT);
+	put_str(&buf, tmfile);
+	put_str(&buf, getcwd(cwd, sizeof(cwd)));
+
+	/* The environment is taken from the real thing, so the variables
+	 * that don't matter can be left out */
+	if (Jim_Eval(interp, "lsort [info globals]") == JIM_OK) {
+		globals = Jim_GetResult(interp);
+		Jim_IncrRefCount(globals);
+		n = Jim_ListLength(interp, globals);
+		for (i = 0; i < n; i++) {
+			const char *name = Jim_String(Jim_ListGetIndex(interp, globals, i));
+			Jim_Obj *value = Jim_GetGlobalVariableStr(interp, name, JIM_NONE);
+
+			if (value && strcmp(name, "env") != 0) {
+				put_str(&buf, name);
+				put_str(&buf, Jim_String(value));
+			}
+		}
+		Jim_DecrRefCount(interp, globals);
+	}
+
+	put_environment(&buf);
+
+	TM_CRYPTO_HASH_DATA(buf.data, buf.len, digest);
+	TM_CRYPTO_HASH_TO_STRING(digest, key);
+	have_key = 1;
+	free(buf.data);
+	Jim_SetEmptyResult(interp);
+}
+
+/* The digest of a file as a string, or "" if it isn't there */
+static void file_digest(const char *path, char hash[CRYPTO_HASH_STRING_LENGTH])
+{
+	unsigned char digest[CRYPTO_HASH_SIZE];
+
+	if (file_exists(path)) {
+		TM_CRYPTO_HASH_FILE(path, digest);
+		TM_CRYPTO_HASH_TO_STRING(digest, hash);
+	} else {
+		hash[0] = '\0';
+	}
+}
+
+/* Note why the evaluation can't be repeated from a snapshot, like
+ * "ran exec" (the first reason is the one kept) */
+static void set_uncacheable(const char *why, const char *what)
+{
+	if (!uncacheable) {
+		uncacheable = malloc(strlen(why) + strlen(what) + 2);
+		sprintf(uncacheable, *what ? "%s %s" : "%s", why, what);
+	}
+}
+
+
+/* Return 1 if one of a null-terminated list of strings is str */
+static int one_of(const char *const *list, const char *str)
+{
+	for (; *list; list++) {
+		if (strcmp(*list, str) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Note the file package require just read, which is found the same way
+ * Jim finds it: as name.tcl in the first directory in auto_path that has
+ * one.
+ */
+static void note_package(Jim_Interp *interp, const char *name)
+{
+	Jim_Obj *path = Jim_GetGlobalVariableStr(interp, "auto_path", JIM_NONE);
+	int i, n = path ? Jim_ListLength(interp, path) : 0;
+
+	for (i = 0; i < n; i++) {
+		const char *dir = Jim_String(Jim_ListGetIndex(interp, path, i));
+		char *file = malloc(strlen(dir) + strlen(name) + 6);
+
+		sprintf(file, "%s/%s.tcl", dir, name);
+		if (file_exists(file)) {
+			snapshot_note_file(file);
+			free(file);
+			return;
+		}
+		free(file);
+	}
+	set_uncacheable("loaded package", name);
+}
+
+/* Stands in for a watched command while the TMakefile is evaluated:
+ * runs the real one, and notes what it depended on.  Commands run by
+ * another watched command (like glob looking at files) are its business,
+ * except for the scripts source and package require evaluate, which are
+ * as much a part of the TMakefile as the rest.
+ */
+static int watchCmd(Jim_Interp *interp, int argc, Jim_Obj *const *argv)
+{
+	watched_cmd *cmd = Jim_CmdPrivData(interp);
+	int kind = cmd->kind;
+	int inner = kind != WATCH_SOURCE && kind != WATCH_PACKAGE;
+	Jim_Obj **objv = Jim_Alloc(argc * sizeof(Jim_Obj *));
+	int ret;
+
+	objv[0] = cmd->real;
+	memcpy(objv + 1, argv + 1, (argc - 1) * sizeof(Jim_Obj *));
+	nested += inner;
+	ret = Jim_EvalObjVector(interp, argc, objv);
+	nested -= inner;
+	Jim_Free(objv);
+
+	if (!watching || nested) {
+		return ret;
+	}
+
+	if (kind == WATCH_FILE && argc > 1) {
+		const char *sub = Jim_String(argv[1]);
+
+		if (one_of(file_pure, sub)) {
+			return ret;
+		}
+		kind = argc == 3 && one_of(file_probes, sub) ? WATCH_PROBE : WATCH_UNCACHEABLE;
+	}
+
+	switch (kind) {
+		case WATCH_PROBE: {
+			Jim_Obj *probe = Jim_NewListObj(interp, NULL, 0);
+
+			Jim_ListAppendElement(interp, probe, Jim_NewListObj(interp, argv, argc));
+			Jim_ListAppendElement(interp, probe, Jim_NewIntObj(interp, ret));
+			Jim_ListAppendElement(interp, probe, Jim_GetResult(interp));
+			Jim_ListAppendElement(interp, probes, probe);
+			break;
+		}
+		case WATCH_OPEN:
+			if (argc == 2 || (argc == 3 && (strcmp(Jim_String(argv[2]), "r") == 0
+			                             || strcmp(Jim_String(argv[2]), "rb") == 0))) {
+				if (Jim_String(argv[1])[0] != '|') {
+					snapshot_note_file(Jim_String(argv[1]));
+					break;
+				}
+			}
+			set_uncacheable("ran", Jim_String(argv[0]));
+			break;
+		case WATCH_SOURCE:
+			if (argc == 2) {
+				snapshot_note_file(Jim_String(argv[1]));
+			}
+			break;
+		case WATCH_PACKAGE:
+			if (argc >= 3 && strcmp(Jim_String(argv[1]), "require") == 0 && ret == JIM_OK) {
+				note_package(interp, Jim_String(argv[2]));
+			}
+			break;
+		case WATCH_OUTPUT: {
+			/* puts ?-nonewline? ?channel? string */
+			int first = argc > 1 && strcmp(Jim_String(argv[1]), "-nonewline") == 0 ? 2 : 1;
+			const char *chan = argc - first == 2 ? Jim_String(argv[first]) : "stdout";
+
+			if (ret == JIM_OK && (strcmp(chan, "stdout") == 0 || strcmp(chan, "stderr") == 0)) {
+				Jim_ListAppendElement(interp, output, Jim_NewListObj(interp, argv, argc));
+			}
+			break;
+		}
+		case WATCH_INPUT: {
+			/* gets channel ?var?, or read ?-nonewline? channel ?count? */
+			int first = argc > 1 && strcmp(Jim_String(argv[1]), "-nonewline") == 0 ? 2 : 1;
+
+			if (argc > first && strcmp(Jim_String(argv[first]), "stdin") == 0) {
+				set_uncacheable("read", "stdin");
+			}
+			break;
+		}
+		default:
+			set_uncacheable("ran", Jim_String(argv[0]));
+			break;
+	}
+
+	return ret;
+}
+
+/* Put the watched commands in place of the real ones */
+static void watch_commands(Jim_Interp *interp)
+{
+	int i;
+
+	for (i = 0; watched[i].name; i++) {
+		Jim_Obj *real = Jim_NewStringObj(interp, "tm::watched::", -1);
+
+		Jim_AppendString(interp, real, watched[i].name, -1);
+		if (Jim_RenameCommand(interp, watched[i].name, Jim_String(real)) != JIM_OK) {
+			Jim_FreeNewObj(interp, real);
+			continue;    /* not in this build of Jim */
+		}
+		Jim_IncrRefCount(real);
+		watched[i].real = real;
+		Jim_CreateCommand(interp, watched[i].name, watchCmd, &watched[i], NULL);
+	}
+	Jim_SetEmptyResult(interp);
+}
+
+/* Put the real commands back.  If the TMakefile has replaced one of the
+ * watched commands, it's left as it is, and the watched command goes on
+ * standing in for the real one (without watching).
+ */
+static void unwatch_commands(Jim_Interp *interp)
+{
+	int i;
+
+	for (i = 0; watched[i].name; i++) {
+		Jim_Obj *name = NULL;
+		Jim_Cmd *cmd = NULL;
+
+		if (!watched[i].real) {
+			continue;
+		}
+
+		name = Jim_NewStringObj(interp, watched[i].name, -1);
+		cmd = Jim_GetCommand(interp, name, JIM_NONE);
+		Jim_FreeNewObj(interp, name);
+		if (!cmd || cmd->isproc || cmd->u.native.cmdProc != watchCmd) {
+			set_uncacheable("replaced command", watched[i].name);
+			continue;
+		}
+
+		Jim_DeleteCommand(interp, watched[i].name);
+		Jim_RenameCommand(interp, Jim_String(watched[i].real), watched[i].name);
+		Jim_DecrRefCount(interp, watched[i].real);
+		watched[i].real = NULL;
+	}
+	Jim_SetEmptyResult(interp);
+}
+
+
+/* Add a recipe to the table of distinct recipes (by digest) being
+ * written, and return its index.  slots has room for twice as many
+ * recipes as there could be.
+ */
+static int recipe_index(int *slots, int nslots, const char **recipes, int *nrecipes,
+                        const unsigned char **digests, const char *recipe, const unsigned char *digest)
+{
+	unsigned long h = 0;
+	int i;
+
+	memcpy(&h, digest, sizeof(h) < CRYPTO_HASH_SIZE ? sizeof(h) : CRYPTO_HASH_SIZE);
+	for (i = h & (nslots - 1); slots[i]; i = (i + 1) & (nslots - 1)) {
+		int r = slots[i] - 1;
+
+		if (memcmp(digests[r], digest, CRYPTO_HASH_SIZE) == 0 && strcmp(recipes[r], recipe) == 0) {
+			return r;
+		}
+	}
+
+	recipes[*nrecipes] = recipe;
+	digests[*nrecipes] = digest;
+	slots[i] = ++*nrecipes;
+
+	return *nrecipes - 1;
+}
+
+static void put_uses(snap_buf *buf, const tm_use *uses)
+{
+	const tm_use *use;
+	int n = 0;
+
+	for (use = uses; use; use = use->next) {
+		n++;
+	}
+	put_int(buf, n);
+	for (use = uses; use; use = use->next) {
+		const tm_pool *pool;
+		int p = 0;
+
+		for (pool = tm_pools; pool != use->pool; pool = pool->next) {
+			p++;
+		}
+		put_int(buf, p);
+		put_size(buf, use->amount);
+	}
+}
+
+/* Write the graph the TMakefile defined: the rules (in the order they
+ * were first named), the pattern rules and pools, and the default goal.
+ * Each distinct recipe is written once.
+ */
+static void put_graph(snap_buf *buf)
+{
+	tm_rule_list *node;
+	tm_rule **rules = NULL;
+	tm_pattern *pattern;
+	tm_pool *pool;
+	const char **recipes = NULL;
+	const unsigned char **digests = NULL;
+	int *rule_recipes = NULL;
+	int *pattern_recipes = NULL;
+	int *slots = NULL;
+	int nslots = 1;
+	int nrules = 0, npatterns = 0, nrecipes = 0, npools = 0;
+	int i, j;
+
+	for (node = tm_rules; node; node = node->next) {
+		nrules++;
+	}
+	for (pattern = tm_patterns; pattern; pattern = pattern->next) {
+		npatterns++;
+	}
+	for (pool = tm_pools; pool; pool = pool->next) {
+		npools++;
+	}
+
+	/* The rules are numbered oldest first, through their index */
+	rules = malloc((nrules + 1) * sizeof(tm_rule *));
+	for (node = tm_rules, i = nrules; node; node = node->next) {
+		rules[--i] = node->rule;
+		node->rule->index = i;
+	}
+
+	while (nslots < 2 * (nrules + npatterns)) {
+		nslots *= 2;
+	}
+	slots = calloc(nslots, sizeof(int));
+	recipes = malloc((nrules + npatterns + 1) * sizeof(char *));
+	digests = malloc((nrules + npatterns + 1) * sizeof(unsigned char *));
+	rule_recipes = malloc((nrules + 1) * sizeof(int));
+	pattern_recipes = malloc((npatterns + 1) * sizeof(int));
+	for (i = 0; i < nrules; i++) {
+		rule_recipes[i] = rules[i]->recipe && !rules[i]->pattern
+		                ? recipe_index(slots, nslots, recipes, &nrecipes, digests,
+		                               rules[i]->recipe, rules[i]->digest)
+		                : -1;
+	}
+	for (pattern = tm_patterns, i = 0; pattern; pattern = pattern->next, i++) {
+		pattern_recipes[i] = recipe_index(slots, nslots, recipes, &nrecipes, digests,
+		                                  pattern->recipe, pattern->digest);
+	}
+
+	put_int(buf, nrecipes);
+	for (i = 0; i < nrecipes; i++) {
+		put_str(buf, recipes[i]);
+		put(buf, digests[i], CRYPTO_HASH_SIZE);
+	}
+
+	put_int(buf, npools);
+	for (pool = tm_pools; pool; pool = pool->next) {
+		put_str(buf, pool->name);
+		put_size(buf, pool->size);
+	}
+
+	put_int(buf, nrules);
+	for (i = 0; i < nrules; i++) {
+		put_str(buf, rules[i]->target);
+	}
+	for (i = 0; i < nrules; i++) {
+		tm_rule *rule = rules[i];
+		unsigned char flags[3];
+
+		flags[0] = rule->type;
+		flags[1] = rule->always_oodate;
+		flags[2] = rule->grouped;
+		put(buf, flags, sizeof(flags));
+		put_int(buf, rule_recipes[i]);
+		put_str(buf, rule->depfile);
+		put_int(buf, rule->primary ? rule->primary->index : -1);
+		put_int(buf, rule->next_output ? rule->next_output->index : -1);
+		put_int(buf, rule->ninputs);
+		for (j = 0; j < rule->ninputs; j++) {
+			put_int(buf, rule->deps[j]->index);
+		}
+		put_uses(buf, rule->uses);
+	}
+
+	put_int(buf, npatterns);
+	for (pattern = tm_patterns, i = 0; pattern; pattern = pattern->next, i++) {
+		unsigned char always = pattern->always_oodate;
+
+		put_str(buf, pattern->target);
+		put(buf, &always, 1);
+		put_int(buf, pattern_recipes[i]);
+		put_str(buf, pattern->depfile);
+		put_int(buf, pattern->ndeps);
+		for (j = 0; j < pattern->ndeps; j++) {
+			put_str(buf, pattern->deps[j]);
+		}
+		put_uses(buf, pattern->uses);
+	}
+
+	put_str(buf, tm_goal);
+
+	for (i = 0; i < nrules; i++) {
+		rules[i]->index = -1;
+	}
+	free(rules);
+	free(slots);
+	free(recipes);
+	free(digests);
+	free(rule_recipes);
+	free(pattern_recipes);
+}
+
+static tm_use *get_uses(snap_reader *r, tm_pool **pools, int npools)
+{
+	tm_use *uses = NULL;
+	int n = get_int(r);
+
+	while (n-- > 0 && !r->bad) {
+		int p = get_index(r, npools);
+		unsigned long long amount = get_size(r);
+
+		if (p >= 0) {
+			uses = use_cons(pools[p], amount, uses);
+		}
+	}
+
+	return uses;
+}
+
+/* Read back the graph written by put_graph(), and make the recipe procs
+ * for it.  Each distinct recipe gets one Jim object, shared by its procs,
+ * so it's only compiled once.  Returns 0, or -1 if the snapshot is bad
+ * (leaving whatever was read in the graph).
+ */
+static int get_graph(snap_reader *r, Jim_Interp *interp)
+{
+	const char **recipes = NULL;
+	const unsigned char **digests = NULL;
+	Jim_Obj **recipe_objs = NULL;
+	tm_rule **shared = NULL;    /* the first rule given each recipe */
+	tm_rule **rules = NULL;
+	tm_pattern *pattern = NULL;
+	int *rule_recipes = NULL;
+	int *pattern_recipes = NULL;
+	tm_pool **pools = NULL;
+	Jim_Obj *arglist = NULL;
+	const char *goal = NULL;
+	int nrecipes, nrules, npools, npatterns;
+	int ret = -1;
+	int i, j;
+
+	nrecipes = get_int(r);
+	if (nrecipes < 0 || (size_t)nrecipes > (size_t)(r->end - r->p)) {
+		return -1;
+	}
+	recipes = calloc(nrecipes + 1, sizeof(char *));
+	digests = calloc(nrecipes + 1, sizeof(unsigned char *));
+	recipe_objs = calloc(nrecipes + 1, sizeof(Jim_Obj *));
+	shared = calloc(nrecipes + 1, sizeof(tm_rule *));
+	for (i = 0; i < nrecipes && !r->bad; i++) {
+		recipes[i] = get_str(r);
+		digests[i] = get(r, CRYPTO_HASH_SIZE);
+		if (!recipes[i]) {
+			r->bad = 1;
+		}
+	}
+
+	npools = get_int(r);
+	if (r->bad || npools < 0 || (size_t)npools > (size_t)(r->end - r->p)) {
+		goto done;
+	}
+	pools = calloc(npools + 1, sizeof(tm_pool *));
+	for (i = 0; i < npools && !r->bad; i++) {
+		const char *name = get_str(r);
+		unsigned long long size = get_size(r);
+
+		if (name) {
+			pools[i] = intern_pool(name);
+			pools[i]->size = size;
+		} else {
+			r->bad = 1;
+		}
+	}
+
+	nrules = get_int(r);
+	if (r->bad || nrules < 0 || (size_t)nrules > (size_t)(r->end - r->p)) {
+		goto done;
+	}
+	rules = calloc(nrules + 1, sizeof(tm_rule *));
+	rule_recipes = malloc((nrules + 1) * sizeof(int));
+	for (i = 0; i < nrules && !r->bad; i++) {
+		const char *target = get_str(r);
+
+		if (target) {
+			rules[i] = intern_rule(target);
+		} else {
+			r->bad = 1;
+		}
+	}
+	for (i = 0; i < nrules && !r->bad; i++) {
+		tm_rule *rule = rules[i];
+		const unsigned char *flags = get(r, 3);
+		int recipe = get_index(r, nrecipes);
+		const char *depfile = get_str(r);
+		int primary = get_index(r, nrules);
+		int next_output = get_index(r, nrules);
+		int ndeps = get_int(r);
+
+		if (!flags || ndeps < 0 || (size_t)ndeps > (size_t)(r->end - r->p)) {
+			r->bad = 1;
+			break;
+		}
+		rule->type = flags[0];
+		rule->always_oodate = flags[1];
+		rule->grouped = flags[2];
+		rule_recipes[i] = rule->type == TM_FILENAME ? -1 : recipe;
+		if (recipe >= 0 && shared[recipe]) {
+			share_recipe(rule, shared[recipe]);
+		} else if (recipe >= 0) {
+			set_recipe(rule, recipes[recipe], digests[recipe]);
+			shared[recipe] = rule;
+		}
+		if (depfile) {
+			set_depfile(rule, depfile);
+		}
+		rule->primary = primary >= 0 ? rules[primary] : NULL;
+		rule->next_output = next_output >= 0 ? rules[next_output] : NULL;
+
+		rule->deps = arena_alloc(&tm_graph_arena, (ndeps + 1) * sizeof(tm_rule *));
+		rule->depsize = ndeps + 1;
+		for (j = 0; j < ndeps; j++) {
+			int dep = get_index(r, nrules);
+
+			if (dep < 0) {
+				r->bad = 1;
+				break;
+			}
+			rule->deps[j] = rules[dep];
+		}
+		rule->ndeps = rule->ninputs = j;
+		rule->uses = get_uses(r, pools, npools);
+	}
+
+	npatterns = get_int(r);
+	if (r->bad || npatterns < 0 || (size_t)npatterns > (size_t)(r->end - r->p)) {
+		goto done;
+	}
+	pattern_recipes = malloc((npatterns + 1) * sizeof(int));
+	for (i = 0; i < npatterns && !r->bad; i++) {
+		const char *target = get_str(r);
+		const unsigned char *always = get(r, 1);
+		int recipe = get_index(r, nrecipes);
+		const char *depfile = get_str(r);
+		int ndeps = get_int(r);
+
+		if (!target || !always || recipe < 0 || r->bad) {
+			r->bad = 1;
+			break;
+		}
+		pattern_recipes[i] = recipe;
+		pattern = define_pattern(target, recipes[recipe], digests[recipe]);
+		pattern->always_oodate = *always;
+		if (depfile) {
+			set_pattern_depfile(pattern, depfile);
+		}
+		for (j = 0; j < ndeps && !r->bad; j++) {
+			const char *dep = get_str(r);
+
+			if (dep) {
+				add_pattern_dep(pattern, dep);
+			} else {
+				r->bad = 1;
+			}
+		}
+		pattern->uses = get_uses(r, pools, npools);
+	}
+
+	goal = get_str(r);
+	if (r->bad || r->p != r->end) {
+		goto done;
+	}
+	if (goal) {
+		tm_goal = malloc(strlen(goal) + 1);
+		strcpy(tm_goal, goal);
+	}
+
+	/* The recipe procs, made the way the rule command makes them */
+	arglist = Jim_NewStringObj(interp, "TARGET INPUTS OODATE", -1);
+	Jim_IncrRefCount(arglist);
+	for (i = 0; i < nrecipes; i++) {
+		recipe_objs[i] = Jim_NewStringObj(interp, recipes[i], -1);
+		Jim_IncrRefCount(recipe_objs[i]);
+	}
+	for (i = 0; i < nrules; i++) {
+		tm_rule *rule = rules[i];
+		Jim_Obj *args = arglist;
+
+		if (rule_recipes[i] < 0) {
+			continue;
+		}
+		if (rule->grouped) {
+			Jim_Obj *targets = Jim_NewListObj(interp, NULL, 0);
+			Jim_Obj *arg = Jim_NewListObj(interp, NULL, 0);
+			tm_rule *output;
+
+			for (output = rule; output; output = output->next_output) {
+				Jim_ListAppendElement(interp, targets, Jim_NewStringObj(interp, output->target, -1));
+			}
+			Jim_ListAppendElement(interp, arg, Jim_NewStringObj(interp, "TARGETS", -1));
+			Jim_ListAppendElement(interp, arg, targets);
+			args = Jim_DuplicateObj(interp, arglist);
+			Jim_ListAppendElement(interp, args, arg);
+		}
+		if (create_recipe_proc(interp, rule->target, args, recipe_objs[rule_recipes[i]]) != JIM_OK) {
+			goto done;
+		}
+	}
+	for (pattern = tm_patterns, i = 0; pattern; pattern = pattern->next, i++) {
+		if (create_recipe_proc(interp, pattern->name, arglist, recipe_objs[pattern_recipes[i]]) != JIM_OK) {
+			goto done;
+		}
+	}
+	ret = 0;
+
+	done:
+	if (arglist) {
+		Jim_DecrRefCount(interp, arglist);
+	}
+	for (i = 0; i < nrecipes; i++) {
+		if (recipe_objs[i]) {
+			Jim_DecrRefCount(interp, recipe_objs[i]);
+		}
+	}
+	free(recipes);
+	free(digests);
+	free(recipe_objs);
+	free(shared);
+	free(rules);
+	free(pools);
+	free(rule_recipes);
+	free(pattern_recipes);
+
+	return r->bad ? -1 : ret;
+}
+
+
+/* Return 1 if the files a snapshot lists are as they were */
+static int files_unchanged(snap_reader *r)
+{
+	char hash[CRYPTO_HASH_STRING_LENGTH];
+	int n = get_int(r);
+
+	while (n-- > 0) {
+		const char *path = get_str(r);
+		const char *was = get_str(r);
+
+		if (!path || !was) {
+			return 0;
+		}
+		file_digest(path, hash);
+		if (strcmp(hash, was) != 0) {
+			return 0;
+		}
+	}
+
+	return !r->bad;
+}
+
+/* Return 1 if the probes a snapshot lists give the same results again */
+static int probes_unchanged(snap_reader *r, Jim_Interp *interp)
+{
+	const char *str = get_str(r);
+	Jim_Obj *list = NULL;
+	int same = 1;
+	int i, n;
+
+	if (!str) {
+		return 0;
+	}
+
+	list = Jim_NewStringObj(interp, str, -1);
+	Jim_IncrRefCount(list);
+	n = Jim_ListLength(interp, list);
+	for (i = 0; i < n && same; i++) {
+		Jim_Obj *probe = Jim_ListGetIndex(interp, list, i);
+		long code = -1;
+		int ret;
+
+		if (Jim_ListLength(interp, probe) != 3
+		||  Jim_GetLong(interp, Jim_ListGetIndex(interp, probe, 1), &code) != JIM_OK) {
+			same = 0;
+			break;
+		}
+		ret = Jim_EvalObj(interp, Jim_ListGetIndex(interp, probe, 0));
+		same = ret == code
+		    && Jim_StringEqObj(Jim_GetResult(interp), Jim_ListGetIndex(interp, probe, 2));
+	}
+	Jim_DecrRefCount(interp, list);
+	Jim_SetEmptyResult(interp);
+
+	return same;
+}
+
+/* Write out again what the TMakefile wrote to stdout and stderr when it
+ * was evaluated, by running the same puts commands */
+static void replay_output(Jim_Interp *interp, const char *str)
+{
+	Jim_Obj *list = Jim_NewStringObj(interp, str, -1);
+	int i, n;
+
+	Jim_IncrRefCount(list);
+	n = Jim_ListLength(interp, list);
+	for (i = 0; i < n; i++) {
+		Jim_EvalObj(interp, Jim_ListGetIndex(interp, list, i));
+	}
+	Jim_DecrRefCount(interp, list);
+	Jim_SetEmptyResult(interp);
+}
+
+/* Load the graph and the rest of what evaluating the TMakefile tmfile
+ * did from the snapshot for the way it's about to be evaluated, if
+ * there is one, and the files it read and the probes it made are all
+ * the same.  What it wrote to stdout and stderr is written again.
+ * Returns 1 if it was loaded, in which case the TMakefile doesn't need
+ * to be evaluated, or else 0.
+ */
+int snapshot_load(Jim_Interp *interp, const char *tmfile)
+{
+	sqlite3 *db = NULL;
+	sqlite3_stmt *stm = NULL;
+	int loaded = 0;
+
+	make_key(interp, tmfile);
+
+	if (!file_exists(TM_CACHE) || cache_connect(&db) != 0) {
+		return 0;
+	}
+
+	if (sqlite3_prepare_v2(db,
+	        "SELECT Data FROM TMSnapshot WHERE TMakefile = ? AND Key = ?",
+	        -1, &stm, NULL) == SQLITE_OK) {
+		sqlite3_bind_text(stm, 1, tmfile, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stm, 2, key, -1, SQLITE_STATIC);
+
+		if (sqlite3_step(stm) == SQLITE_ROW) {
+			snap_reader r;
+			const char *state = NULL;
+			const char *written = NULL;
+
+			r.p = sqlite3_column_blob(stm, 0);
+			r.end = r.p + sqlite3_column_bytes(stm, 0);
+			r.bad = 0;
+
+			if (get_int(&r) == SNAPSHOT_FORMAT && files_unchanged(&r)
+			&&  probes_unchanged(&r, interp) && (state = get_str(&r))
+			&&  (written = get_str(&r))) {
+				if (get_graph(&r, interp) == 0) {
+					wrap(interp, Jim_EvalGlobal(interp, state));
+					replay_output(interp, written);
+					loaded = 1;
+				} else {
+					free_graph();
+					free(tm_goal);
+					tm_goal = NULL;
+				}
+			}
+		}
+	}
+	sqlite3_finalize(stm);
+	sqlite3_close(db);
+
+	outcome = loaded ? "loaded from a snapshot" : NULL;
+	return loaded;
+}
+
+/* Start watching what evaluating the TMakefile tmfile depends on, so
+ * snapshot_save() can tell whether it can be repeated from a snapshot.
+ */
+void snapshot_watch(Jim_Interp *interp, const char *tmfile)
+{
+	if (!have_key) {
+		make_key(interp, tmfile);
+	}
+
+	wrap(interp, Jim_Eval(interp, "tm_interp_state"));
+	before = Jim_GetResult(interp);
+	Jim_IncrRefCount(before);
+	Jim_SetEmptyResult(interp);
+	probes = Jim_NewListObj(interp, NULL, 0);
+	Jim_IncrRefCount(probes);
+	output = Jim_NewListObj(interp, NULL, 0);
+	Jim_IncrRefCount(output);
+
+	watching = 1;
+	snapshot_note_file(tmfile);
+	watch_commands(interp);
+}
+
+/* Work out a digest of the current directory and the environment, left
+ * out the same way as for a snapshot's key.  A server (see tm_server.c)
+ * only builds for clients whose digest matches its own, since otherwise
+ * it would evaluate the TMakefile differently than they would.
+ */
+void snapshot_env_key(char hash[CRYPTO_HASH_STRING_LENGTH])
+{
+	snap_buf buf = { NULL, 0, 0 };
+	unsigned char digest[CRYPTO_HASH_SIZE];
+	char cwd[4096];
+
+	put_str(&buf, getcwd(cwd, sizeof(cwd)));
+	put_environment(&buf);
+
+	tm_CryptoHashDataWith(TM_HASH_SHA1, buf.data, buf.len, digest);
+	tm_CryptoHashToStringWith(TM_HASH_SHA1, digest, hash);
+	free(buf.data);
+}
+
+/* Note that a file was read while evaluating the TMakefile */
+void snapshot_note_file(const char *path)
+{
+	if (!watching) {
+		return;
+	}
+
+	files = realloc(files, (nfiles + 1) * sizeof(char *));
+	files[nfiles] = malloc(strlen(path) + 1);
+	strcpy(files[nfiles++], path);
+}
+
+/* Stop watching the evaluation of the TMakefile tmfile, and save a
+ * snapshot of it if it can be repeated, or else forget any old one.
+ * Only the SNAPSHOT_KEEP newest snapshots of a TMakefile are kept.
+ */
+void snapshot_save(Jim_Interp *interp, const char *tmfile)
+{
+	snap_buf buf = { NULL, 0, 0 };
+	char hash[CRYPTO_HASH_STRING_LENGTH];
+	sqlite3 *db = NULL;
+	sqlite3_stmt *stm = NULL;
+	const char *state = NULL;
+	int i;
+
+	watching = 0;
+	unwatch_commands(interp);
+
+	if (!uncacheable) {
+		Jim_Obj *objv[2];
+
+		objv[0] = Jim_NewStringObj(interp, "tm_interp_changes", -1);
+		objv[1] = before;
+		if (Jim_EvalObjVector(interp, 2, objv) != JIM_OK) {
+			set_uncacheable(Jim_String(Jim_GetResult(interp)), "");
+		} else {
+			state = Jim_String(Jim_GetResult(interp));
+		}
+	}
+
+	if (!uncacheable) {
+		put_int(&buf, SNAPSHOT_FORMAT);
+		put_int(&buf, nfiles);
+		for (i = 0; i < nfiles; i++) {
+			file_digest(files[i], hash);
+			put_str(&buf, files[i]);
+			put_str(&buf, hash);
+		}
+		put_str(&buf, Jim_String(probes));
+		put_str(&buf, state);
+		put_str(&buf, Jim_String(output));
+		put_graph(&buf);
+	}
+	Jim_SetEmptyResult(interp);
+
+	if (cache_connect(&db) == 0) {
+		if (uncacheable) {
+			sqlite3_prepare_v2(db,
+				"DELETE FROM TMSnapshot WHERE TMakefile = ? AND Key = ?",
+				-1, &stm, NULL);
+		} else {
+			sqlite3_prepare_v2(db,
+				"INSERT OR REPLACE INTO TMSnapshot (TMakefile, Key, Saved, Data) "
+				"VALUES (?, ?, julianday('now'), ?)",
+				-1, &stm, NULL);
+			sqlite3_bind_blob(stm, 3, buf.data, buf.len, SQLITE_STATIC);
+		}
+		sqlite3_bind_text(stm, 1, tmfile, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stm, 2, key, -1, SQLITE_STATIC);
+		sqlite3_step(stm);
+		sqlite3_finalize(stm);
+		stm = NULL;
+
+		if (sqlite3_prepare_v2(db,
+		        "DELETE FROM TMSnapshot WHERE TMakefile = ?1 AND Key NOT IN "
+		        "(SELECT Key FROM TMSnapshot WHERE TMakefile = ?1 "
+		        "ORDER BY Saved DESC LIMIT ?2)",
+		        -1, &stm, NULL) == SQLITE_OK) {
+			sqlite3_bind_text(stm, 1, tmfile, -1, SQLITE_STATIC);
+			sqlite3_bind_int(stm, 2, SNAPSHOT_KEEP);
+			sqlite3_step(stm);
+		}
+		sqlite3_finalize(stm);
+		sqlite3_close(db);
+		outcome = uncacheable ? NULL : "evaluated, and a snapshot saved";
+	}
+
+	free(buf.data);
+	for (i = 0; i < nfiles; i++) {
+		free(files[i]);
+	}
+	free(files);
+	files = NULL;
+	nfiles = 0;
+	Jim_DecrRefCount(interp, probes);
+	Jim_DecrRefCount(interp, output);
+	Jim_DecrRefCount(interp, before);
+	probes = output = before = NULL;
+}
+
+/* Display whether the TMakefile was evaluated or loaded from a snapshot */
+void snapshot_summary(void)
+{
+	if (outcome) {
+		printf("TMakefile: %s\n", outcome);
+	} else if (uncacheable) {
+		printf("TMakefile: evaluated, but it %s, so it has no snapshot\n", uncacheable);
+	} else if (have_key) {
+		printf("TMakefile: evaluated\n");
+	}
+}
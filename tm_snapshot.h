@@ -0,0 +1,16 @@
+#ifndef TM_SNAPSHOT_H
+#define TM_SNAPSHOT_H
+
+#define JIM_EMBEDDED
+#include <jim.h>
+
+#include "tm_crypto.h"
+
+int snapshot_load(Jim_Interp *interp, const char *tmfile);
+void snapshot_watch(Jim_Interp *interp, const char *tmfile);
+void snapshot_save(Jim_Interp *interp, const char *tmfile);
+void snapshot_note_file(const char *path);
+void snapshot_env_key(char hash[CRYPTO_HASH_STRING_LENGTH]);
+void snapshot_summary(void);
+
+#endif
@@ -1,95 +1,576 @@
+#define _DEFAULT_SOURCE   /* needed for access and _SC_PHYS_PAGES */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "tm_arena.h"
 #include "tm_target.h"
 #include "tm_core_cmds.h"
 
 /* The goal target of the current execution */
 char *tm_goal = NULL;
 
-/* All the rules defined by the TMakefile */
+/* All the rules in the graph (newest first) */
 tm_rule_list *tm_rules = NULL;
 
+/* The pattern rules, in the order they were defined */
+tm_pattern *tm_patterns = NULL;
+
+/* The resource pools named so far */
+tm_pool *tm_pools = NULL;
+
+/* The rules in tm_rules, indexed by target name */
+tm_rule_table tm_rule_index = { NULL, 0, 0 };
+
+/* Where the rules, their names, dependencies and recipes are allocated */
+tm_arena tm_graph_arena = { NULL };
+
+/* How many rules have been marked as updated during this run */
+int tm_updated_count = 0;
 
-/* Create a new explicit rule.
- * Makes copies of all the arguments to store in the rule.
+
+/* Return the rule for target, creating a filename rule for it if there
+ * isn't one yet.  Every name in the graph is stored exactly once, in its
+ * rule, so a dependency is simply a pointer to the rule it names.
  */
-tm_rule *new_rule(const char *target, target_list *deps, const char *recipe)
+tm_rule *intern_rule(const char *target)
 {
-	tm_rule *rule = malloc(sizeof(tm_rule));
-	rule->target = malloc(strlen(target) + 1);
-	if (recipe)
-		rule->recipe = malloc(strlen(recipe) + 1);
-	
-	strcpy(rule->target, target);
-	rule->deps = target_list_copy(deps);
-	if (recipe)
-		strcpy(rule->recipe, recipe);
-	else
-		rule->recipe = NULL;
-	rule->type = TM_EXPLICIT;
+	tm_rule *rule = find_rule(target, &tm_rule_index);
+	tm_rule_list *node;
+
+	if (rule) {
+		return rule;
+	}
+
+	rule = arena_alloc(&tm_graph_arena, sizeof(tm_rule));
+	memset(rule, 0, sizeof(tm_rule));
+	rule->target = arena_strdup(&tm_graph_arena, target);
+	rule->type = TM_FILENAME;
 	rule->mark = TM_UNMARKED;
-	rule->always_oodate = 0;
+	rule->index = -1;
+
+	node = arena_alloc(&tm_graph_arena, sizeof(tm_rule_list));
+	node->rule = rule;
+	node->next = tm_rules;
+	tm_rules = node;
+
+	rule_table_insert(&tm_rule_index, rule);
 
 	return rule;
 }
 
-/* Create a new filename rule.
- * Makes a copy of its argument.
+/* Return the rule for target as an explicit rule.
+ * A target that was only known as a dependency so far (and so was taken
+ * to be a file) becomes an explicit rule.
  */
-tm_rule *new_filename(const char *target)
+tm_rule *define_rule(const char *target)
 {
-	tm_rule *rule = new_rule(target, NULL, NULL);
+	tm_rule *rule = intern_rule(target);
 
-	rule->type = TM_FILENAME;
+	rule->type = TM_EXPLICIT;
 
 	return rule;
 }
 
-/* Make a copy of a rule.
+/* Append dep to the array of a rule's dependencies */
+static void append_dep(tm_rule *rule, tm_rule *dep)
+{
+	if (rule->ndeps == rule->depsize) {
+		tm_rule **deps;
+
+		/* The old array stays in the arena; doubling keeps that cheap */
+		rule->depsize = rule->depsize ? rule->depsize * 2 : 4;
+		deps = arena_alloc(&tm_graph_arena, rule->depsize * sizeof(tm_rule *));
+		if (rule->ndeps) {
+			memcpy(deps, rule->deps, rule->ndeps * sizeof(tm_rule *));
+		}
+		rule->deps = deps;
+	}
+
+	rule->deps[rule->ndeps++] = dep;
+}
+
+/* Add dep to the end of a rule's dependencies */
+void add_dep(tm_rule *rule, tm_rule *dep)
+{
+	append_dep(rule, dep);
+	rule->ninputs = rule->ndeps;
+}
+
+/* Add a dependency named in a rule's depfile.  Discovered dependencies
+ * come after the ones given in the TMakefile, and aren't among the
+ * INPUTS of the recipe.  A name that isn't in the graph yet is taken to
+ * be a file that may not be there next time.
  */
-tm_rule *rule_copy(tm_rule *rule)
+void add_discovered_dep(tm_rule *rule, const char *name)
 {
-	tm_rule *copy;
+	tm_rule *dep = find_rule(name, &tm_rule_index);
+	int i;
 
-	if (!rule) {
-		return NULL;
+	if (!dep) {
+		dep = intern_rule(name);
+		dep->discovered = 1;
 	}
 
-	copy = malloc(sizeof(tm_rule));
+	if (dep == rule) {
+		return;
+	}
+	for (i = 0; i < rule->ndeps; i++) {
+		if (rule->deps[i] == dep) {
+			return;
+		}
+	}
 
-	if (rule->target) {
-		copy->target = malloc(strlen(rule->target) + 1);
-		strcpy(copy->target, rule->target);
+	append_dep(rule, dep);
+}
+
+/* Forget a rule's discovered dependencies, before reading its depfile */
+void clear_discovered_deps(tm_rule *rule)
+{
+	rule->ndeps = rule->ninputs;
+}
+
+/* Create a new explicit rule in the graph, or add to an existing one.
+ * deps is a target list as built by target_cons(), so newest first; the
+ * dependencies are added in the order they were consed.
+ */
+tm_rule *new_rule(const char *target, target_list *deps, const char *recipe)
+{
+	tm_rule *rule = define_rule(target);
+	target_list *rev = target_list_reverse(deps);
+	target_list *node;
+
+	for (node = rev; node; node = node->next) {
+		add_dep(rule, intern_rule(node->name));
+	}
+	free_target_list(rev);
+
+	if (recipe)
+		set_recipe(rule, recipe, NULL);
+
+	return rule;
+}
+
+/* Give a rule a recipe.
+ * Makes a copy of the recipe and stores its digest, so the recipe never
+ * has to be hashed again.  A caller giving the same recipe to several
+ * rules can hash it once and pass the digest in; if digest is NULL the
+ * recipe is hashed here.
+ */
+void set_recipe(tm_rule *rule, const char *recipe, const unsigned char *digest)
+{
+	size_t len = strlen(recipe);
+
+	rule->recipe = arena_alloc(&tm_graph_arena, len + 1);
+	memcpy(rule->recipe, recipe, len + 1);
+
+	if (digest) {
+		memcpy(rule->digest, digest, CRYPTO_HASH_SIZE);
 	} else {
-		copy->target = NULL;
+		TM_CRYPTO_HASH_DATA(rule->recipe, len, rule->digest);
 	}
-	if (rule->deps) {
-		copy->deps = target_list_copy(rule->deps);
+	rule->have_digest = 1;
+}
+
+/* Give a rule the same recipe as another rule, without copying it */
+void share_recipe(tm_rule *rule, const tm_rule *from)
+{
+	rule->recipe = from->recipe;
+	memcpy(rule->digest, from->digest, CRYPTO_HASH_SIZE);
+	rule->have_digest = 1;
+}
+
+/* Name the depfile a rule's recipe writes (e.g., with gcc -MD).
+ */
+void set_depfile(tm_rule *rule, const char *depfile)
+{
+	rule->depfile = arena_strdup(&tm_graph_arena, depfile);
+}
+
+/* Return the filename rule for target, creating it if need be.
+ */
+tm_rule *new_filename(const char *target)
+{
+	return intern_rule(target);
+}
+
+/* Record that a rule was updated during this run.
+ */
+void mark_updated(tm_rule *rule)
+{
+	if (!rule->updated) {
+		rule->updated = 1;
+		tm_updated_count++;
+	}
+}
+
+/* Return 1 if target was updated during this run, else return 0.
+ */
+int was_updated(const char *target)
+{
+	tm_rule *rule = find_rule(target, &tm_rule_index);
+
+	return rule && rule->updated;
+}
+
+/* How many pattern rules can be chained to make one dependency */
+#define MAX_PATTERN_CHAIN 4
+
+/* Return the pattern rule with target (containing a %) and exactly the
+ * dependencies deps, if there is one.
+ */
+tm_pattern *find_pattern(const char *target, const char *const *deps, int ndeps)
+{
+	tm_pattern *pattern;
+	int i;
+
+	for (pattern = tm_patterns; pattern; pattern = pattern->next) {
+		if (strcmp(pattern->target, target) != 0 || pattern->ndeps != ndeps) {
+			continue;
+		}
+		for (i = 0; i < ndeps; i++) {
+			if (strcmp(pattern->deps[i], deps[i]) != 0) {
+				break;
+			}
+		}
+		if (i == ndeps) {
+			return pattern;
+		}
+	}
+
+	return NULL;
+}
+
+/* Define a pattern rule for target (containing a %) with a recipe.
+ * As with set_recipe(), the digest of the recipe can be passed in, or if
+ * digest is NULL the recipe is hashed here.
+ * There can be any number of pattern rules for the same target (with
+ * different dependencies), so the nth one's recipe proc is named target#n.
+ */
+tm_pattern *define_pattern(const char *target, const char *recipe, const unsigned char *digest)
+{
+	tm_pattern *pattern = arena_alloc(&tm_graph_arena, sizeof(tm_pattern));
+	tm_pattern **tail = &tm_patterns;
+	int same = 0;
+
+	memset(pattern, 0, sizeof(tm_pattern));
+	pattern->target = arena_strdup(&tm_graph_arena, target);
+	pattern->recipe = arena_strdup(&tm_graph_arena, recipe);
+
+	if (digest) {
+		memcpy(pattern->digest, digest, CRYPTO_HASH_SIZE);
 	} else {
-		copy->deps = NULL;
+		TM_CRYPTO_HASH_DATA(pattern->recipe, strlen(recipe), pattern->digest);
+	}
+
+	while (*tail) {
+		if (strcmp((*tail)->target, target) == 0) {
+			same++;
+		}
+		tail = &(*tail)->next;
 	}
-	if (rule->recipe) {
-		copy->recipe = malloc(strlen(rule->recipe) + 1);
-		strcpy(copy->recipe, rule->recipe);
+	*tail = pattern;
+
+	if (same == 0) {
+		pattern->name = pattern->target;
 	} else {
-		copy->recipe = NULL;
+		pattern->name = arena_alloc(&tm_graph_arena, strlen(target) + 16);
+		sprintf(pattern->name, "%s#%d", target, same + 1);
+	}
+
+	return pattern;
+}
+
+/* Add a dependency (which may contain a %) to a pattern rule */
+void add_pattern_dep(tm_pattern *pattern, const char *dep)
+{
+	char **deps = arena_alloc(&tm_graph_arena, (pattern->ndeps + 1) * sizeof(char *));
+
+	if (pattern->ndeps) {
+		memcpy(deps, pattern->deps, pattern->ndeps * sizeof(char *));
+	}
+	deps[pattern->ndeps++] = arena_strdup(&tm_graph_arena, dep);
+	pattern->deps = deps;
+}
+
+/* Name the depfile (which may contain a %) of the rules made from a
+ * pattern rule.
+ */
+void set_pattern_depfile(tm_pattern *pattern, const char *depfile)
+{
+	pattern->depfile = arena_strdup(&tm_graph_arena, depfile);
+}
+
+/* Return the length of the stem if name matches pattern (which contains
+ * a %), or 0 if it doesn't.  The stem starts where the % is.
+ */
+static size_t match_stem(const char *pattern, const char *name)
+{
+	const char *pct = strchr(pattern, '%');
+	size_t pre = pct - pattern;
+	size_t post = strlen(pct + 1);
+	size_t len = strlen(name);
+
+	if (len <= pre + post || strncmp(name, pattern, pre) != 0
+	||  strcmp(name + len - post, pct + 1) != 0) {
+		return 0;
+	}
+
+	return len - pre - post;
+}
+
+/* Return a copy of str with its % (if it has one) replaced by the stem,
+ * to be freed by the caller.
+ */
+static char *subst_stem(const char *str, const char *stem, size_t stemlen)
+{
+	const char *pct = strchr(str, '%');
+	char *result = malloc(strlen(str) + stemlen + 1);
+
+	if (!pct) {
+		strcpy(result, str);
+		return result;
+	}
+
+	memcpy(result, str, pct - str);
+	memcpy(result + (pct - str), stem, stemlen);
+	strcpy(result + (pct - str) + stemlen, pct + 1);
+
+	return result;
+}
+
+static tm_pattern *pattern_for(const char *name, int depth, const char **stem, size_t *stemlen);
+
+/* Return 1 if name is a file, has a rule of its own, or can be made from
+ * a pattern rule (chained no more than MAX_PATTERN_CHAIN deep).
+ */
+static int can_make(const char *name, int depth)
+{
+	tm_rule *rule = find_rule(name, &tm_rule_index);
+	const char *stem = NULL;
+	size_t stemlen = 0;
+
+	if ((rule && rule->type != TM_FILENAME) || access(name, F_OK) == 0) {
+		return 1;
+	}
+
+	return depth < MAX_PATTERN_CHAIN && pattern_for(name, depth, &stem, &stemlen);
+}
+
+/* Return the first pattern rule that name matches and whose dependencies
+ * can all be made, or NULL if there isn't one.  Sets stem to where the
+ * stem starts in name, and stemlen to its length.
+ */
+static tm_pattern *pattern_for(const char *name, int depth, const char **stem, size_t *stemlen)
+{
+	tm_pattern *pattern;
+
+	for (pattern = tm_patterns; pattern; pattern = pattern->next) {
+		size_t len = match_stem(pattern->target, name);
+		const char *start = name + (strchr(pattern->target, '%') - pattern->target);
+		int i;
+
+		if (len == 0) {
+			continue;
+		}
+
+		for (i = 0; i < pattern->ndeps; i++) {
+			char *dep = subst_stem(pattern->deps[i], start, len);
+			int ok = can_make(dep, depth + 1);
+
+			free(dep);
+			if (!ok) {
+				break;
+			}
+		}
+
+		if (i == pattern->ndeps) {
+			*stem = start;
+			*stemlen = len;
+			return pattern;
+		}
+	}
+
+	return NULL;
+}
+
+/* Give rule (a file, or an explicit rule without a recipe) the recipe
+ * and dependencies of a pattern rule, for the given stem.  The recipe
+ * isn't copied: every rule made from the pattern shares it.
+ */
+static void instantiate(tm_rule *rule, tm_pattern *pattern, const char *stem, size_t stemlen)
+{
+	int i;
+
+	rule->type = TM_EXPLICIT;
+	rule->pattern = pattern;
+	rule->recipe = pattern->recipe;
+	if (!rule->uses) {
+		rule->uses = pattern->uses;
+	}
+	memcpy(rule->digest, pattern->digest, CRYPTO_HASH_SIZE);
+	rule->have_digest = 1;
+	if (pattern->always_oodate) {
+		rule->always_oodate = 1;
+	}
+
+	for (i = 0; i < pattern->ndeps; i++) {
+		char *dep = subst_stem(pattern->deps[i], stem, stemlen);
+
+		add_dep(rule, intern_rule(dep));
+		free(dep);
 	}
-	copy->type = rule->type;
-	copy->mark = rule->mark;
-	copy->always_oodate = rule->always_oodate;
+
+	if (pattern->depfile && !rule->depfile) {
+		char *depfile = subst_stem(pattern->depfile, stem, stemlen);
+
+		set_depfile(rule, depfile);
+		free(depfile);
+	}
+}
+
+/* Make rules from the pattern rules for everything goal needs that has
+ * no recipe of its own: goal itself, its dependencies, theirs, and so
+ * on.  The first pattern (in the order they were defined) whose
+ * dependencies all exist or can be made is used.  Targets that aren't
+ * needed to make goal are never given rules.
+ */
+void resolve_patterns(const char *goal)
+{
+	tm_rule *rule = find_rule(goal, &tm_rule_index);
+	tm_rule **stack = NULL;
+	int depth = 0;
+	int size = 0;
+	const char *stem = NULL;
+	size_t stemlen = 0;
+
+	if (!tm_patterns) {
+		return;
+	}
+
+	if (!rule) {
+		if (!pattern_for(goal, 0, &stem, &stemlen)) {
+			return;
+		}
+		rule = intern_rule(goal);
+	}
+
+	size = 64;
+	stack = malloc(size * sizeof(tm_rule *));
+	stack[depth++] = rule;
+
+	while (depth > 0) {
+		tm_pattern *pattern = NULL;
+		int i;
+
+		rule = stack[--depth];
+		if (rule->resolved) {
+			continue;
+		}
+		rule->resolved = 1;
+
+		if (!rule->recipe && !rule->primary
+		&&  (pattern = pattern_for(rule->target, 0, &stem, &stemlen))) {
+			instantiate(rule, pattern, stem, stemlen);
+		}
+
+		for (i = 0; i < rule->ndeps; i++) {
+			if (rule->deps[i]->resolved) {
+				continue;
+			}
+			if (depth == size) {
+				size *= 2;
+				stack = realloc(stack, size * sizeof(tm_rule *));
+			}
+			stack[depth++] = rule->deps[i];
+		}
+	}
+
+	free(stack);
+}
+
+
+/* Return the pool called name, creating it if there isn't one yet.
+ * A new pool has no limit, except for mem, which starts out the size
+ * of this machine's physical memory.
+ */
+tm_pool *intern_pool(const char *name)
+{
+	tm_pool *pool;
+
+	for (pool = tm_pools; pool; pool = pool->next) {
+		if (strcmp(pool->name, name) == 0) {
+			return pool;
+		}
+	}
+
+	pool = arena_alloc(&tm_graph_arena, sizeof(tm_pool));
+	memset(pool, 0, sizeof(tm_pool));
+	pool->name = arena_strdup(&tm_graph_arena, name);
+	if (strcmp(name, "mem") == 0) {
+		long pages = sysconf(_SC_PHYS_PAGES);
+		long pagesize = sysconf(_SC_PAGESIZE);
+
+		if (pages > 0 && pagesize > 0) {
+			pool->size = (unsigned long long)pages * pagesize;
+		}
+	}
+	pool->next = tm_pools;
+	tm_pools = pool;
+
+	return pool;
+}
+
+/* Add a use of amount of pool to the front of a list of them */
+tm_use *use_cons(tm_pool *pool, unsigned long long amount, tm_use *next)
+{
+	tm_use *use = arena_alloc(&tm_graph_arena, sizeof(tm_use));
+
+	use->pool = pool;
+	use->amount = amount;
+	use->next = next;
+
+	return use;
+}
+
+
+/* Free everything in the graph: tm_rules, tm_rule_index, the rules and
+ * the pools.
+ */
+void free_graph(void)
+{
+	free_rule_table(&tm_rule_index);
+	free_arena(&tm_graph_arena);
+	tm_rules = NULL;
+	tm_patterns = NULL;
+	tm_pools = NULL;
+	tm_updated_count = 0;
+}
+
+
+/* Make a copy of a rule, for a rule list.
+ * The copy shares its name, dependencies and recipe with the rule in
+ * the graph, so it mustn't outlive the graph.
+ */
+tm_rule *rule_copy(tm_rule *rule)
+{
+	tm_rule *copy;
+
+	if (!rule) {
+		return NULL;
+	}
+
+	copy = malloc(sizeof(tm_rule));
+	memcpy(copy, rule, sizeof(tm_rule));
 
 	return copy;
 }
 
-/* Free a rule */
+/* Free a copy of a rule made by rule_copy() */
 void free_rule(tm_rule *rule)
 {
-	if (!rule) return;
-	free(rule->target);
-	free_target_list(rule->deps);
-	free(rule->recipe);
 	free(rule);
 }
 
@@ -130,20 +611,20 @@ void free_target_list(target_list *targets)
  */
 target_list *target_list_copy(target_list *targets)
 {
-	target_list *rev;
-	target_list *copy;
+	target_list *copy = NULL;
+	target_list **tail = &copy;
+
+	for (; targets; targets = targets->next) {
+		*tail = target_cons(targets->name, NULL);
+		tail = &(*tail)->next;
+	}
 
-	if (!targets) return NULL;
-	
-	rev = target_list_reverse(targets);
-	copy = target_list_reverse(rev);
-	free_target_list(rev);
 	return copy;
 }
 
 
 /* Take a rule and another rule list and return
- * a rule list with the rule at the head.
+ * a rule list with (a copy of) the rule at the head.
  * Rule lists are NULL-terminated.
  */
 tm_rule_list *rule_cons(tm_rule *rule, tm_rule_list *next)
@@ -156,7 +637,7 @@ tm_rule_list *rule_cons(tm_rule *rule, tm_rule_list *next)
 	return rules;
 }
 
-/* Frees a rule list
+/* Frees a rule list made with rule_cons().
  */
 void free_rule_list(tm_rule_list *rules)
 {
@@ -170,82 +651,128 @@ void free_rule_list(tm_rule_list *rules)
 }
 
 
-/* Return 1 if the target is in targets, else return 0.
+/* FNV-1a hash of a target name */
+static unsigned long hash_name(const char *name)
+{
+	unsigned long hash = 2166136261UL;
+
+	for (; *name; name++) {
+		hash ^= (unsigned char)*name;
+		hash = (hash * 16777619UL) & 0xffffffffUL;
+	}
+
+	return hash;
+}
+
+/* Return the slot where name lives in table, or the empty slot where
+ * it would go if it isn't there.  The table must not be full.
  */
-int target_exists(const char *target, target_list *targets)
+static tm_rule_slot *rule_table_probe(tm_rule_table *table, const char *name,
+                                      unsigned long hash)
 {
-	for (; targets; targets = targets->next) {
-		if (strcmp(targets->name, target) == 0) {
-			return 1;
+	unsigned long mask = table->size - 1;
+	unsigned long i = hash & mask;
+
+	for (;;) {
+		tm_rule_slot *slot = &table->slots[i];
+
+		if (!slot->rule
+		||  (slot->hash == hash && strcmp(slot->rule->target, name) == 0)) {
+			return slot;
 		}
-	}
 
-	return 0;
+		i = (i + 1) & mask;
+	}
 }
 
+/* Double the size of a table (or give an empty one its first slots) */
+static void rule_table_grow(tm_rule_table *table)
+{
+	tm_rule_slot *old = table->slots;
+	unsigned long oldsize = table->size;
+	unsigned long i;
 
-/* Take a target and a rule list and return the rule associated
- * with that target if it exists, otherwise return NULL.
+	table->size = oldsize ? oldsize * 2 : 64;
+	table->slots = calloc(table->size, sizeof(tm_rule_slot));
+
+	for (i = 0; i < oldsize; i++) {
+		if (old[i].rule) {
+			*rule_table_probe(table, old[i].rule->target, old[i].hash) = old[i];
+		}
+	}
+
+	free(old);
+}
+
+/* Index a rule by its target name.  Replaces any rule already indexed
+ * under the same name.
  */
-tm_rule *find_rule(const char *target, tm_rule_list *rules)
+void rule_table_insert(tm_rule_table *table, tm_rule *rule)
 {
-	tm_rule_list *node = rules;
-	tm_rule *rule = NULL;
+	unsigned long hash = hash_name(rule->target);
+	tm_rule_slot *slot;
 
-	while (node) {
-		if (strcmp(node->rule->target, target) == 0) {
-			rule = node->rule;
-			break;
-		}
+	/* Keep the table at most half full so probe sequences stay short */
+	if (2 * (table->count + 1) > table->size) {
+		rule_table_grow(table);
+	}
 
-		node = node->next;
+	slot = rule_table_probe(table, rule->target, hash);
+	if (!slot->rule) {
+		table->count++;
 	}
+	slot->rule = rule;
+	slot->hash = hash;
+}
 
-	return rule;
+/* Free the slots of a rule table.  The rules themselves are left alone.
+ */
+void free_rule_table(tm_rule_table *table)
+{
+	free(table->slots);
+	table->slots = NULL;
+	table->size = 0;
+	table->count = 0;
 }
 
 
-/* Take a list of targets and a pointer to a rule list.
- * If no rule for a target is found in the rule list, add
- * a new TM_FILENAME rule to the rule list.
+/* Return 1 if the target is in targets, else return 0.
  */
-static void find_files_from_deps(target_list *targets, tm_rule_list **rules)
+int target_exists(const char *target, target_list *targets)
 {
 	for (; targets; targets = targets->next) {
-		tm_rule *rule = find_rule(targets->name, *rules);
-
-		if (!rule) {
-			rule = new_filename(targets->name);
-			*rules = rule_cons(rule, *rules);
-			free_rule(rule);
+		if (strcmp(targets->name, target) == 0) {
+			return 1;
 		}
 	}
+
+	return 0;
 }
 
-/* Scour through all the dependencies in a rule list and allocate new
- * filename rules for things deemed to be files.
- * Updates the rule list with the new rules.
+
+/* Take a target and a rule table and return the rule associated
+ * with that target if it exists, otherwise return NULL.
  */
-void find_files(tm_rule_list **rules)
+tm_rule *find_rule(const char *target, tm_rule_table *table)
 {
-	tm_rule_list *node;
-
-	for (node = *rules; node; node = node->next) {
-		find_files_from_deps(node->rule->deps, rules);
+	if (table->count == 0) {
+		return NULL;
 	}
+
+	return rule_table_probe(table, target, hash_name(target))->rule;
 }
 
 
-/* Take a list of targets and a list of rules and return
+/* Take a list of targets and a rule table and return
  * a list of the rules associated with those targets.
  */
-tm_rule_list *find_rules(target_list *targets, tm_rule_list *rules)
+tm_rule_list *find_rules(target_list *targets, tm_rule_table *table)
 {
 	tm_rule_list *mapped = NULL;
 	target_list *node = targets;
 
 	while (node) {
-		tm_rule *rule = find_rule(node->name, rules);
+		tm_rule *rule = find_rule(node->name, table);
 		if (rule)
 			mapped = rule_cons(rule, mapped);
 		node = node->next;
@@ -284,60 +811,90 @@ target_list *target_list_reverse(target_list *targets)
 }
 
 
-/* Tarjan's algorithm for topological sorting */
-static int topsort_visit(tm_rule *rule, tm_rule_list *rules, tm_rule_list **sorted)
-{
-	if (rule->mark == TM_TEMPORARY) {
-		fprintf(stderr, "ERROR:  Cycle detected in dependency graph\n");
-		return -1;
-	}
-
-	if (rule->mark == TM_UNMARKED) {
-		tm_rule_list *deps = NULL;
-		tm_rule_list *node = NULL;
+/* A rule being visited by topsort(), and its next dependency to visit */
+typedef struct topsort_frame {
+	tm_rule *rule;
+	int next;
+} topsort_frame;
 
-		rule->mark = TM_TEMPORARY;
-		deps = find_rules(rule->deps, rules);
-		
-		for (node = deps; node; node = node->next) {
-			int n = 0;
-
-			if (node->rule)
-				n = topsort_visit(node->rule, rules, sorted);
-
-			if (n < 0) {
-				free_rule_list(deps);
-				return n;
-			}
-		}
-		free_rule_list(deps);
+/* Print the cycle found when the frame at the top of the stack reached
+ * rule, which is being visited further down the stack.
+ */
+static void topsort_cycle(topsort_frame *stack, unsigned long depth, tm_rule *rule)
+{
+	unsigned long i = depth;
 
-		rule->mark = TM_PERMANENT;
-		*sorted = rule_cons(rule, *sorted);
+	while (i > 0 && stack[i-1].rule != rule) {
+		i--;
 	}
 
-	return 0;
+	fprintf(stderr, "ERROR:  Cycle detected in dependency graph:\n        ");
+	for (i = i - 1; i < depth; i++) {
+		fprintf(stderr, "%s -> ", stack[i].rule->target);
+	}
+	fprintf(stderr, "%s\n", rule->target);
 }
 
 /* Perform a topological sort of the dependency graph to reach target.
- * Also checks for cycles in the dependency graph.
+ * Returns an array of the rules in the table (not copies of them) with
+ * every rule after all the rules it depends on, and stores the number
+ * of rules in n.  The array is to be freed by the caller.
+ *
+ * This is a depth-first search (Tarjan's algorithm) that keeps its own
+ * stack rather than recursing, so long chains of dependencies are fine.
+ * Returns NULL if target has no rule, or if there's a cycle in the
+ * graph, in which case the rules making up the cycle are printed.
  */
-tm_rule_list *topsort(const char *target, tm_rule_list *rules)
+tm_rule **topsort(const char *target, tm_rule_table *table, int *n)
 {
-	tm_rule_list *sorted = NULL;
-	tm_rule_list *rev = NULL;
-	tm_rule *rule = find_rule(target, rules);
+	tm_rule *rule = find_rule(target, table);
+	tm_rule **sorted = NULL;
+	topsort_frame *stack = NULL;
+	unsigned long depth = 0;
+
+	*n = 0;
 
 	if (rule == NULL)
 		return NULL;
-	
-	if (topsort_visit(rule, rules, &sorted) < 0) {
-		return NULL;
+
+	/* No path can be longer than the number of rules */
+	sorted = malloc(table->count * sizeof(tm_rule *));
+	stack = malloc(table->count * sizeof(topsort_frame));
+
+	if (rule->mark == TM_UNMARKED) {
+		rule->mark = TM_TEMPORARY;
+		stack[depth].rule = rule;
+		stack[depth++].next = 0;
 	}
 
-	rev = rule_list_reverse(sorted);
-	free_rule_list(sorted);
-	return rev;
+	while (depth > 0) {
+		topsort_frame *frame = &stack[depth-1];
+
+		if (frame->next < frame->rule->ndeps) {
+			tm_rule *deprule = frame->rule->deps[frame->next++];
+
+			if (deprule->mark == TM_TEMPORARY) {
+				topsort_cycle(stack, depth, deprule);
+				free(sorted);
+				sorted = NULL;
+				*n = 0;
+				break;
+			}
+			if (deprule->mark == TM_UNMARKED) {
+				deprule->mark = TM_TEMPORARY;
+				stack[depth].rule = deprule;
+				stack[depth++].next = 0;
+			}
+		} else {
+			frame->rule->mark = TM_PERMANENT;
+			sorted[(*n)++] = frame->rule;
+			depth--;
+		}
+	}
+
+	free(stack);
+
+	return sorted;
 }
 
 
@@ -380,11 +937,11 @@ void print_rule_list(tm_rule_list *rules)
 	
 	printf("{\n");
 	for (node = rules; node; node = node->next) {
-		target_list *deps;
+		int i;
 
 		printf("\t%s: ", node->rule->target);
-		for (deps = node->rule->deps; deps; deps = deps->next) {
-			printf("%s ", deps->name);
+		for (i = 0; i < node->rule->ndeps; i++) {
+			printf("%s ", node->rule->deps[i]->target);
 		}
 		switch (node->rule->type) {
 			case TM_EXPLICIT:
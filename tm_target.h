@@ -2,27 +2,87 @@
 #define TM_TARGET_H
 
 #include "tmake.h"
+#include "tm_crypto.h"
+#include "tm_arena.h"
 
 #define TM_EXPLICIT 0
 #define TM_IMPLICIT 1
 #define TM_FILENAME 2
-#define TM_UPDATED  3
 
 #define TM_UNMARKED  0
 #define TM_TEMPORARY 1
 #define TM_PERMANENT 2
 
 struct target_list;
+struct tm_cache_entry;
 
+/* A pool of something recipes use, like memory or link slots.  Recipes
+ * run at the same time never use more of a pool than its size.
+ */
+typedef struct tm_pool {
+	char *name;
+	unsigned long long size;    /* 0 if there's no limit */
+	unsigned long long used;    /* by the recipes running now */
+	struct tm_pool *next;
+} tm_pool;
+
+/* How much of a pool a rule's recipe uses */
+typedef struct tm_use {
+	struct tm_pool *pool;
+	unsigned long long amount;
+	struct tm_use *next;
+} tm_use;
+
+/* A rule in the graph.  Rules, and everything they point to, live in
+ * tm_graph_arena and are freed all at once by free_graph().
+ */
 typedef struct tm_rule {
-	char *target;
-	struct target_list *deps;
+	char *target;               /* the only copy of this name in the graph */
+	struct tm_rule **deps;      /* in the order they were given */
+	int ndeps;
+	int depsize;
+	int ninputs;    /* the deps given in the TMakefile; the rest are discovered */
 	char *recipe;
+	char *depfile;              /* where the recipe lists what it read */
+	struct tm_rule *primary;    /* the first target of its group (rule&) */
+	struct tm_rule *next_output;    /* the next target its recipe makes */
+	struct tm_pattern *pattern;     /* the pattern rule it was made from */
+	struct tm_use *uses;            /* what its recipe needs to run */
+	struct tm_cache_entry *cache;            /* owned by the tm_cache */
+	double duration;    /* seconds its recipe took, this run or the last */
+	int index;    /* position in the graph being updated, or -1 */
 	unsigned char type;
 	unsigned char mark;
 	unsigned char always_oodate;
+	unsigned char grouped;      /* the first target of a rule& */
+	unsigned char have_digest;
+	unsigned char made;         /* brought up to date during this run */
+	unsigned char updated;      /* changed during this run */
+	unsigned char discovered;   /* only known from a depfile */
+	unsigned char scanned;      /* its discovered deps are known */
+	unsigned char watched;      /* unchanged since a server checked it */
+	unsigned char resolved;     /* pattern rules have been tried on it */
+	unsigned char digest[CRYPTO_HASH_SIZE];  /* of the file or recipe */
 } tm_rule;
 
+/* A pattern rule, like %.o from %.c.  A % in the target stands for any
+ * non-empty stem, and in a dependency (or the depfile) for the same stem.
+ * Rules are only made from a pattern for the targets that turn out to
+ * be needed, by resolve_patterns().
+ */
+typedef struct tm_pattern {
+	char *target;
+	char *name;        /* of its recipe proc: target, or target#n for the nth */
+	char **deps;
+	int ndeps;
+	char *recipe;
+	char *depfile;
+	struct tm_use *uses;
+	unsigned char always_oodate;
+	unsigned char digest[CRYPTO_HASH_SIZE];    /* of the recipe */
+	struct tm_pattern *next;    /* in the order they were defined */
+} tm_pattern;
+
 typedef struct target_list {
 	char *name;
 	struct target_list *next;
@@ -33,20 +93,59 @@ typedef struct tm_rule_list {
 	struct tm_rule_list *next;
 } tm_rule_list;
 
+/* An open-addressed hash table of rules, keyed by target name.
+ * The table doesn't own the rules or their names; it points at them.
+ */
+typedef struct tm_rule_slot {
+	struct tm_rule *rule;
+	unsigned long hash;
+} tm_rule_slot;
+
+typedef struct tm_rule_table {
+	tm_rule_slot *slots;
+	unsigned long size;     /* always zero or a power of two */
+	unsigned long count;
+} tm_rule_table;
+
+tm_rule *intern_rule(const char *target);
+tm_rule *define_rule(const char *target);
+void add_dep(tm_rule *rule, tm_rule *dep);
+void set_recipe(tm_rule *rule, const char *recipe, const unsigned char *digest);
+void share_recipe(tm_rule *rule, const tm_rule *from);
+void set_depfile(tm_rule *rule, const char *depfile);
+void add_discovered_dep(tm_rule *rule, const char *name);
+void clear_discovered_deps(tm_rule *rule);
+void free_graph(void);
+
+tm_pattern *find_pattern(const char *target, const char *const *deps, int ndeps);
+tm_pattern *define_pattern(const char *target, const char *recipe, const unsigned char *digest);
+void add_pattern_dep(tm_pattern *pattern, const char *dep);
+void set_pattern_depfile(tm_pattern *pattern, const char *depfile);
+void resolve_patterns(const char *goal);
+
+tm_pool *intern_pool(const char *name);
+tm_use *use_cons(tm_pool *pool, unsigned long long amount, tm_use *next);
+
+void mark_updated(tm_rule *rule);
+int was_updated(const char *target);
+
+/* The list-based interface to the graph */
 tm_rule *new_rule(const char *target, target_list *deps, const char *recipe);
 tm_rule *new_filename(const char *target);
 
 target_list *target_cons(const char *name, target_list *next);
 tm_rule_list *rule_cons(tm_rule *rule, tm_rule_list *next);
 
+void rule_table_insert(tm_rule_table *table, tm_rule *rule);
+void free_rule_table(tm_rule_table *table);
+
 target_list *target_list_copy(target_list *targets);
 
 int target_exists(const char *target, target_list *targets);
-tm_rule *find_rule(const char *name, tm_rule_list *rules);
-tm_rule_list *find_rules(target_list *targets, tm_rule_list *rules);
-void find_files(tm_rule_list **rules);
+tm_rule *find_rule(const char *name, tm_rule_table *table);
+tm_rule_list *find_rules(target_list *targets, tm_rule_table *table);
 
-tm_rule_list *topsort(const char *target, tm_rule_list *rules);
+tm_rule **topsort(const char *target, tm_rule_table *table, int *n);
 
 tm_rule_list *rule_list_reverse(tm_rule_list *rules);
 target_list *target_list_reverse(target_list *targets);
@@ -60,5 +159,10 @@ void print_rule_list(tm_rule_list *rules);
 
 extern char *tm_goal;
 extern tm_rule_list *tm_rules;
+extern tm_pattern *tm_patterns;
+extern tm_pool *tm_pools;
+extern tm_rule_table tm_rule_index;
+extern tm_arena tm_graph_arena;
+extern int tm_updated_count;
 
 #endif
@@ -0,0 +1,221 @@
+
+#define _DEFAULT_SOURCE   /* needed for gettimeofday and getpid */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "tm_trace.h"
+
+
+/* The trace being recorded, if any.  Events are kept in memory and only
+ * written out when TMk exits (however it exits), so that the recipes
+ * run in child processes never have anything of it to write.
+ */
+static FILE *trace_file = NULL;
+static pid_t trace_owner = 0;
+static double trace_start = 0;
+static char *events = NULL;
+static size_t events_len = 0;
+static size_t events_size = 0;
+static int nlanes = 0;    /* lanes that have had something in them */
+
+
+/* Current wall clock time in seconds */
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* CPU time used by TMk and its waited-for children, in seconds */
+static double cpu_time(void)
+{
+	struct rusage self, children;
+
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+
+	return self.ru_utime.tv_sec + self.ru_utime.tv_usec / 1e6
+	     + self.ru_stime.tv_sec + self.ru_stime.tv_usec / 1e6
+	     + children.ru_utime.tv_sec + children.ru_utime.tv_usec / 1e6
+	     + children.ru_stime.tv_sec + children.ru_stime.tv_usec / 1e6;
+}
+
+/* Append len bytes of str to the events */
+static void append(const char *str, size_t len)
+{
+	if (events_len + len + 1 > events_size) {
+		events_size = (events_len + len + 1) * 2;
+		events = realloc(events, events_size);
+	}
+	memcpy(events + events_len, str, len);
+	events_len += len;
+	events[events_len] = '\0';
+}
+
+/* Return str as a JSON string, quotes and all, to be freed by the caller */
+static char *json_string(const char *str)
+{
+	char *json = malloc(strlen(str) * 6 + 3);
+	char *p = json;
+
+	*p++ = '"';
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\') {
+			*p++ = '\\';
+			*p++ = *str;
+		} else if ((unsigned char)*str < 0x20) {
+			p += sprintf(p, "\\u%04x", (unsigned char)*str);
+		} else {
+			*p++ = *str;
+		}
+	}
+	*p++ = '"';
+	*p = '\0';
+
+	return json;
+}
+
+/* Append a complete event that began at mark and ends now */
+static void append_event(const tm_trace_mark *mark, const char *cat, const char *name,
+                         int lane, const char *args)
+{
+	char buff[128];
+	char *json = json_string(name);
+	double end = now();
+
+	sprintf(buff, "%s{\"name\": ", events_len ? ",\n" : "");
+	append(buff, strlen(buff));
+	append(json, strlen(json));
+	free(json);
+	sprintf(buff, ", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.0f, \"dur\": %.0f, "
+	        "\"pid\": %ld, \"tid\": %d, \"args\": {",
+	        cat, (mark->wall - trace_start) * 1e6, (end - mark->wall) * 1e6,
+	        (long)trace_owner, lane);
+	append(buff, strlen(buff));
+	append(args, strlen(args));
+	append("}}", 2);
+
+	if (lane >= nlanes) {
+		nlanes = lane + 1;
+	}
+}
+
+/* Write out the trace, with a name for each lane */
+static void write_trace(void)
+{
+	int lane;
+
+	if (!trace_file || trace_owner != getpid()) {
+		return;
+	}
+
+	fprintf(trace_file, "{\"traceEvents\": [\n%s", events ? events : "");
+	for (lane = 0; lane < nlanes; lane++) {
+		char name[32];
+
+		if (lane == 0) {
+			strcpy(name, "tmk");
+		} else {
+			sprintf(name, "job %d", lane);
+		}
+		fprintf(trace_file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %ld, "
+		        "\"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+		        events_len || lane ? ",\n" : "", (long)trace_owner, lane, name);
+	}
+	fprintf(trace_file, "\n], \"displayTimeUnit\": \"ms\"}\n");
+
+	fclose(trace_file);
+	trace_file = NULL;
+	free(events);
+	events = NULL;
+}
+
+
+/* Start recording a trace of this run, to be written to path as Chrome
+ * trace event JSON when TMk exits.  Returns 0 on success, or -1 if path
+ * couldn't be opened.
+ */
+int trace_open(const char *path)
+{
+	/* Opened now, in case a recipe changes the current directory */
+	trace_file = fopen(path, "w");
+	if (!trace_file) {
+		return -1;
+	}
+
+	trace_owner = getpid();
+	trace_start = now();
+	atexit(write_trace);
+
+	return 0;
+}
+
+/* Mark the beginning of a span, if there's a trace being recorded */
+void trace_begin(tm_trace_mark *mark)
+{
+	if (trace_file) {
+		mark->wall = now();
+		mark->cpu = cpu_time();
+	}
+}
+
+/* Record a span of TMk's work (in category cat) that began at mark and
+ * ends now, along with the CPU time used meanwhile.  Spans are shown in
+ * lanes: 0 for TMk's own work and 1 up for the recipes running at once.
+ * args is either "" or more JSON members for the span's arguments.
+ */
+void trace_end(const tm_trace_mark *mark, const char *cat, const char *name,
+               int lane, const char *args)
+{
+	char buff[64];
+	char *all = NULL;
+
+	if (!trace_file || trace_owner != getpid()) {
+		return;
+	}
+
+	sprintf(buff, "\"cpu_ms\": %.3f", (cpu_time() - mark->cpu) * 1e3);
+	all = malloc(strlen(buff) + strlen(args) + 3);
+	sprintf(all, "%s%s%s", buff, *args ? ", " : "", args);
+
+	append_event(mark, cat, name, lane, all);
+	free(all);
+}
+
+/* Record the evaluation of the recipe for target, which began at mark
+ * and ends now, in the process pid with exit status status.  cpu is the
+ * CPU time the recipe used, or negative if it ran in TMk itself.
+ */
+void trace_recipe(const tm_trace_mark *mark, const char *target, int lane,
+                  long pid, int status, double cpu)
+{
+	char *json = NULL;
+	char *args = NULL;
+	double wall = now() - mark->wall;
+
+	if (!trace_file || trace_owner != getpid()) {
+		return;
+	}
+
+	if (cpu < 0) {
+		cpu = cpu_time() - mark->cpu;
+	}
+
+	json = json_string(target);
+	args = malloc(strlen(json) + 128);
+	sprintf(args, "\"target\": %s, \"pid\": %ld, \"status\": %d, "
+	        "\"wall_ms\": %.3f, \"cpu_ms\": %.3f",
+	        json, pid, status, wall * 1e3, cpu * 1e3);
+
+	append_event(mark, "recipe", target, lane, args);
+	free(args);
+	free(json);
+}
@@ -0,0 +1,18 @@
+#ifndef TM_TRACE_H
+#define TM_TRACE_H
+
+/* When a span began, by the wall clock and by the CPU time TMk (and the
+ * processes it has waited for) had used, both in seconds */
+typedef struct tm_trace_mark {
+	double wall;
+	double cpu;
+} tm_trace_mark;
+
+int trace_open(const char *path);
+void trace_begin(tm_trace_mark *mark);
+void trace_end(const tm_trace_mark *mark, const char *cat, const char *name,
+               int lane, const char *args);
+void trace_recipe(const tm_trace_mark *mark, const char *target, int lane,
+                  long pid, int status, double cpu);
+
+#endif
@@ -1,6 +1,15 @@
+
+#define _DEFAULT_SOURCE   /* needed for st_mtim, _SC_NPROCESSORS_ONLN, gettimeofday and getloadavg */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include <sqlite3.h>
 
@@ -10,11 +19,15 @@
 #include "tmake.h"
 #include "tm_target.h"
 #include "tm_crypto.h"
+#include "tm_cache.h"
+#include "tm_artifact.h"
+#include "tm_depfile.h"
 #include "tm_update.h"
+#include "tm_jobs.h"
+#include "tm_trace.h"
 
-
-/* A list of targets that were updated during the current run */
-target_list *updated_targets = NULL;
+/* How many of the slowest recipes --profile lists */
+#define PROFILE_SLOWEST 10
 
 
 /* Returns true if a file exists and is readable.
@@ -32,6 +45,16 @@ int file_exists(const char *filename)
 }
 
 
+/* Current wall clock time in seconds */
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
 /* Used takes a Jim interpreter and a Jim error code.
  * If there was an error, display an error message and exit.
  * Otherwise, do nothing.
@@ -47,162 +70,312 @@ void wrap(Jim_Interp *interp, int error)
 }
 
 
+/* Fill in st with the cached stat information for a file.
+ * Returns 0 on success, or -1 if the file couldn't be stat'ed.
+ */
+static int file_stat(const char *filename, tm_file_stat *st)
+{
+	struct stat sb;
+
+	if (stat(filename, &sb) != 0) {
+		return -1;
+	}
+
+	st->size = sb.st_size;
+#if defined(__APPLE__)
+	st->mtime = (sqlite3_int64)sb.st_mtimespec.tv_sec * 1000000000 + sb.st_mtimespec.tv_nsec;
+#else
+	st->mtime = (sqlite3_int64)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+#endif
+	st->inode = sb.st_ino;
+	st->device = sb.st_dev;
+
+	/* A file modified during the current second could be modified again
+	 * without its mtime changing (on filesystems with coarse timestamps),
+	 * so its stat information can't vouch for its contents later on.
+	 */
+	st->racy = (sb.st_mtime >= time(NULL));
+
+	return 0;
+}
+
+/* Return the digest of a rule's file or recipe.
+ * Recipes are hashed when they're defined; a file is hashed the first
+ * time its digest is needed during this run.
+ */
+static const unsigned char *rule_digest(tm_rule *rule)
+{
+	if (!rule->have_digest) {
+		if (rule->type == TM_FILENAME) {
+			TM_CRYPTO_HASH_FILE(rule->target, rule->digest);
+		} else {
+			/* an explicit rule without a recipe */
+			TM_CRYPTO_HASH_DATA("", 0, rule->digest);
+		}
+		rule->have_digest = 1;
+	}
+
+	return rule->digest;
+}
+
+/* Return 1 if a file's stat information matches its cache entry */
+static int stat_unchanged(const tm_cache_entry *entry, const tm_file_stat *st)
+{
+	return entry && entry->have_stat
+	    && entry->st.size == st->size && entry->st.mtime == st->mtime
+	    && entry->st.inode == st->inode && entry->st.device == st->device;
+}
+
+
+/* Return 1 if a file's stat information still matches its cache entry,
+ * so it can be taken to be unchanged without hashing it.
+ */
+int file_unchanged(tm_rule *rule)
+{
+	tm_file_stat st;
+
+	return file_stat(rule->target, &st) == 0 && stat_unchanged(cache_entry(rule), &st);
+}
+
+
+/* The files for scan_files() to check, shared by its threads */
+typedef struct scan_work {
+	tm_rule **rules;
+	int nrules;
+	int next;               /* the next rule to be claimed by a thread */
+	pthread_mutex_t lock;
+} scan_work;
+
+/* Check files from a scan_work until there are none left.
+ * A file whose stat information matches the cache is marked unchanged,
+ * and any other file is hashed, so needs_update() finds the answer
+ * waiting for it.  Each file is only ever touched by one thread.
+ */
+static void *scan_worker(void *arg)
+{
+	scan_work *work = arg;
+
+	for (;;) {
+		tm_rule *rule = NULL;
+		tm_cache_entry *entry = NULL;
+		tm_file_stat st;
+		int i;
+
+		pthread_mutex_lock(&work->lock);
+		i = work->next++;
+		pthread_mutex_unlock(&work->lock);
+
+		if (i >= work->nrules)
+			break;
+
+		rule = work->rules[i];
+		if (file_stat(rule->target, &st) != 0)
+			continue;    /* start_rule() will complain about it */
+
+		entry = cache_entry(rule);
+		if (stat_unchanged(entry, &st)) {
+			entry->unchanged = 1;
+		} else {
+			TM_CRYPTO_HASH_FILE(rule->target, rule->digest);
+			rule->have_digest = 1;
+		}
+	}
+
+	return NULL;
+}
+
+/* Stat, and if need be hash, all the files among the scheduler's rules
+ * using a thread per processor, before any rule is made.  This is the
+ * bulk of the work of deciding what's out of date, and it's mostly
+ * waiting on the disk, so it's worth doing many files at once.
+ */
+static void scan_files(tm_rule **files, int nfiles)
+{
+	scan_work work;
+	pthread_t *threads = NULL;
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	long started = 0;
+	long i;
+
+	if (nthreads > nfiles)
+		nthreads = nfiles;
+
+	work.rules = files;
+	work.nrules = nfiles;
+	work.next = 0;
+	pthread_mutex_init(&work.lock, NULL);
+
+	if (nthreads > 1) {
+		threads = malloc(nthreads * sizeof(pthread_t));
+		for (started = 0; started < nthreads; started++) {
+			if (pthread_create(&threads[started], NULL, scan_worker, &work) != 0)
+				break;
+		}
+	}
+
+	/* Whatever the threads haven't claimed (or everything, if there
+	 * aren't any threads) gets done here */
+	scan_worker(&work);
+
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	pthread_mutex_destroy(&work.lock);
+}
+
 /* Update a target using the associated rule from tm_rules.
- * Takes a SQLite database handle representing the sha1sum cache
- * and the name of the TMakefile being evaluated, along with
+ * Takes the cache for the TMakefile being evaluated, along with
  * the name of the target to update.
+ *
+ * If a recipe made a file with exactly the same contents it had after
+ * the last time the recipe ran, the rule isn't marked as updated, so
+ * the rules that depend on it aren't remade on its account.
  */
-int update(sqlite3 *db, const char *tmfile, const char *target)
+int update(tm_cache *cache, const char *target)
 {
-	unsigned char digest[CRYPTO_HASH_SIZE];
 	char newhash[CRYPTO_HASH_STRING_LENGTH];
+	char outhash[CRYPTO_HASH_STRING_LENGTH];
+	const char *output = NULL;
+	tm_file_stat st;
+	tm_file_stat *pst = NULL;
 	tm_rule *rule = NULL;
-	const char *fmt = "INSERT OR REPLACE INTO TMCache (TMakefile, Target, Hash) VALUES (?, ?, ?)";
-	sqlite3_stmt *stm = NULL;
-	const char *stmtail;
-	int sqlrc;
+	int changed = 1;
 
-	rule = find_rule(target, tm_rules);
+	rule = find_rule(target, &tm_rule_index);
 
 	if (!rule) {
 		return (JIM_ERR);
 	}
 
-	updated_targets = target_cons(rule->target, updated_targets);
+	/* The other targets of a group were made by its first target's recipe */
+	if (rule->type == TM_EXPLICIT && (rule->recipe || rule->primary) && file_exists(target)) {
+		tm_cache_entry *entry = cache_entry(rule);
+		unsigned char digest[CRYPTO_HASH_SIZE];
 
-	if (rule->type == TM_EXPLICIT) {
-		TM_CRYPTO_HASH_DATA(rule->recipe, digest);
-	} else if (rule->type == TM_FILENAME) {
 		TM_CRYPTO_HASH_FILE(target, digest);
-	} else {
-		fprintf(stderr, "WARNING: Unknown rule type %d\n"
-		                "         Don't know how to update cache for %s\n", rule->type, target);
-		return (JIM_ERR);
+		TM_CRYPTO_HASH_TO_STRING(digest, outhash);
+		output = outhash;
+
+		if (entry && entry->have_output && strcmp(entry->output, outhash) == 0) {
+			changed = 0;
+		}
 	}
 
-	TM_CRYPTO_HASH_TO_STRING(digest, newhash);
+	if (changed) {
+		mark_updated(rule);
+	}
 
-	sqlrc = sqlite3_prepare(db, fmt, -1, &stm, &stmtail);
-	if (sqlrc != SQLITE_OK) {
-		fprintf(stderr, "WARNING: Unable to update cache for target %s\n", target);
+	if (rule->type == TM_FILENAME) {
+		/* If the file changed after needs_update() hashed it, the change
+		 * happened within the current second, so the stat is racy and
+		 * won't be trusted next time. */
+		if (file_stat(target, &st) == 0) {
+			pst = &st;
+		}
+	} else if (rule->type != TM_EXPLICIT) {
+		fprintf(stderr, "WARNING: Unknown rule type %d\n"
+		                "         Don't know how to update cache for %s\n", rule->type, target);
 		return (JIM_ERR);
 	}
 
-	sqlite3_bind_text(stm, 1, tmfile, -1, SQLITE_TRANSIENT);
-	sqlite3_bind_text(stm, 2, target, -1, SQLITE_TRANSIENT);
-	sqlite3_bind_text(stm, 3, newhash, -1, SQLITE_TRANSIENT);
-	sqlrc = sqlite3_step(stm);
-	if (sqlrc != SQLITE_DONE) {
+	TM_CRYPTO_HASH_TO_STRING(rule_digest(rule), newhash);
+
+	if (cache_store(cache, rule, newhash, pst, output) != 0) {
 		fprintf(stderr, "WARNING: Error updating cache for target %s\n", target);
-		sqlite3_finalize(stm);
 		return (JIM_ERR);
 	}
-	sqlite3_finalize(stm);
-	/*
-	Adding this return to squelch compilation warning.
-	Cory should review this code
-	*/
-	return (JIM_OK);
-}
-
 
-/* Return 1 if target was updated, else return 0.
- */
-int was_updated(const char *target)
-{
-	return target_exists(target, updated_targets);
+	return (JIM_OK);
 }
 
 
 /* Return 1 if a given target is out of date, else return 0.
- * Takes a SQLite database handle and the name of the TMakefile
- * being evaluated along with the name of the target.
+ * Takes the cache for the TMakefile being evaluated along with the
+ * name of the target.
+ *
+ * A file whose size, mtime, inode and device all match what was cached
+ * is taken to be unchanged without reading it.  Otherwise its contents
+ * are hashed and compared with the cached hash.
  */
-int needs_update(sqlite3 *db, const char *tmfile, const char *target)
+int needs_update(tm_cache *cache, const char *target)
 {
-	unsigned char digest[CRYPTO_HASH_SIZE];
-	const char *oldhash = NULL;
 	char newhash[CRYPTO_HASH_STRING_LENGTH];
-	target_list *deps = NULL;
+	tm_file_stat st;
+	tm_cache_entry *entry = NULL;
 	tm_rule *rule = NULL;
-	const char *fmt = "SELECT Hash FROM TMCache WHERE TMakefile = ? AND Target = ?";
-	const char *stmtail = NULL;
-	sqlite3_stmt *stm = NULL;
-	int sqlrc;
+	int i;
 
-	rule = find_rule(target, tm_rules);
+	rule = find_rule(target, &tm_rule_index);
 
 	if (!rule) {
-		goto yes;
+		return 1;
+	}
+
+	if (rule->made) {
+		/* it was brought up to date earlier in this run */
+		return 0;
 	}
 
 	if (rule->always_oodate) {
-		goto yes;
+		return 1;
 	}
 
-	for (deps = rule->deps; deps; deps = deps->next) {
-		if (was_updated(deps->name)) {
-			goto yes;
+	for (i = 0; i < rule->ndeps; i++) {
+		if (rule->deps[i]->updated) {
+			return 1;
 		}
 	}
 
-	sqlrc = sqlite3_prepare(db, fmt, -1, &stm, &stmtail);
-	if (sqlrc != SQLITE_OK) {
-		fprintf(stderr, "WARNING: Unable to prepare database statement.\n"
-		                "         Assuming %s needs update.\n", target);
-		return 1;
-	}
-	
-	sqlite3_bind_text(stm, 1, tmfile, -1, SQLITE_TRANSIENT);
-	sqlite3_bind_text(stm, 2, target, -1, SQLITE_TRANSIENT);
-	sqlrc = sqlite3_step(stm);
-	if (sqlrc != SQLITE_ROW) {
+	entry = cache_entry(rule);
+	if (!entry) {
 		/* There was no row in the cache for this target, so update it */
-		goto yes;
-	}
-
-	oldhash = (const char *)sqlite3_column_text(stm, 0);
-	if (!oldhash) {
-		fprintf(stderr, "WARNING: Error getting cache for target %s\n", target);
-		goto yes;
+		return 1;
 	}
 
-	if (rule->type == TM_EXPLICIT) {
-		TM_CRYPTO_HASH_DATA(rule->recipe, digest);
-	} else if (rule->type == TM_FILENAME) {
-		TM_CRYPTO_HASH_FILE(target, digest);
-	} else {
+	if (rule->type == TM_FILENAME) {
+		if (entry->unchanged) {
+			/* scan_files() already found its stat matches */
+			return 0;
+		}
+		if (file_stat(target, &st) != 0) {
+			return 1;
+		}
+		if (stat_unchanged(entry, &st)) {
+			return 0;
+		}
+	} else if (rule->type != TM_EXPLICIT) {
 		fprintf(stderr, "WARNING: Unexpected rule type %d\n"
 		                "         Assuming %s needs update.\n", rule->type, target);
-		goto yes;
+		return 1;
 	}
-	TM_CRYPTO_HASH_TO_STRING(digest, newhash);
+	TM_CRYPTO_HASH_TO_STRING(rule_digest(rule), newhash);
 
-	if (strcmp(oldhash, newhash) == 0) {
-		goto no;
-	} else {
-		goto yes;
+	if (strcmp(entry->hash, newhash) != 0) {
+		return 1;
 	}
 
-	no:
-		sqlite3_finalize(stm);
-		return 0;
-	yes:
-		sqlite3_finalize(stm);
-		return 1;
+	if (rule->type == TM_FILENAME) {
+		/* Same contents, new stat: remember it so we don't hash again */
+		cache_store_stat(cache, rule, &st);
+	}
+	return 0;
 }
 
 /* Take a list of targets to check and return a sublist containing only
- * the targets that are out of date.
- * Takes a SQLite database handle and the name of the TMakefile being
- * evaluated along with the list of targets.
+ * the targets that are out of date, either because they were updated
+ * earlier in this run or because their cache entry no longer matches.
+ * Takes the cache for the TMakefile being evaluated along with the
+ * list of targets.
  */
-target_list *need_update(sqlite3 *db, const char *tmfile, target_list *targets)
+target_list *need_update(tm_cache *cache, target_list *targets)
 {
 	target_list *oodate = NULL;
 
 	for (; targets; targets = targets->next) {
-		if (needs_update(db, tmfile, targets->name)) {
+		if (was_updated(targets->name)
+		||  needs_update(cache, targets->name)) {
 			oodate = target_cons(targets->name, oodate);
 		}
 	}
@@ -211,79 +384,893 @@ target_list *need_update(sqlite3 *db, const char *tmfile, target_list *targets)
 }
 
 
-/* Update all the rules in sorted_rules that need updating.
- * Takes a SQLite database handle, a Jim interpreter containing
- * the recipe definitions, the name of the TMakefile that was
- * evaluated in the interpreter, the rules to be updated if needed
- * (in the order they are to be updated), whether or not to force
- * updates regardless of out-of-date status, and whether or not
- * we're running in silent mode.
+/* Scheduler bookkeeping for one rule of the sorted graph */
+typedef struct sched_node {
+	tm_rule *rule;
+	int pending;        /* dependencies that haven't been finished yet */
+	int ndependents;
+	int *dependents;    /* indices of the rules that depend on this one */
+} sched_node;
+
+/* A binary heap of the indices of rules that are ready to be made.
+ * Rules with the longest path ahead of them (if path isn't NULL) are made
+ * first, and otherwise rules earlier in the sorted order, so with a
+ * single job the rules are made in exactly the order topsort() produced.
  */
-void update_rules(sqlite3 *db, Jim_Interp *interp,
-                  const char *tmfile,
-                  tm_rule_list *sorted_rules,
-                  int force,
-                  int silence)
+typedef struct ready_heap {
+	int *items;
+	int len;
+	const double *path;
+} ready_heap;
+
+/* Return 1 if node a should be made before node b */
+static int ready_before(const ready_heap *heap, int a, int b)
 {
-	if (!sorted_rules) {
-		/* nothing to do */
+	if (heap->path && heap->path[a] != heap->path[b])
+		return heap->path[a] > heap->path[b];
+
+	return a < b;
+}
+
+static void ready_push(ready_heap *heap, int node)
+{
+	int i = heap->len++;
+
+	while (i > 0 && ready_before(heap, node, heap->items[(i - 1) / 2])) {
+		heap->items[i] = heap->items[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap->items[i] = node;
+}
+
+static int ready_pop(ready_heap *heap)
+{
+	int top = heap->items[0];
+	int last = heap->items[--heap->len];
+	int i = 0;
+
+	for (;;) {
+		int child = 2*i + 1;
+
+		if (child >= heap->len)
+			break;
+		if (child + 1 < heap->len && ready_before(heap, heap->items[child + 1], heap->items[child]))
+			child++;
+		if (!ready_before(heap, heap->items[child], last))
+			break;
+
+		heap->items[i] = heap->items[child];
+		i = child;
+	}
+	heap->items[i] = last;
+
+	return top;
+}
+
+/* Return 1 if the pools rule uses have room for its recipe to run now.
+ * A recipe that needs more of a pool than there is can still run once
+ * nothing else is using it.
+ */
+static int resources_free(const tm_rule *rule)
+{
+	const tm_use *use;
+
+	for (use = rule->uses; use; use = use->next) {
+		const tm_pool *pool = use->pool;
+
+		if (pool->size && pool->used && pool->used + use->amount > pool->size)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Count what rule's recipe uses as used (taking = 1) or free again (0) */
+static void claim_resources(const tm_rule *rule, int taking)
+{
+	const tm_use *use;
+
+	for (use = rule->uses; use; use = use->next) {
+		if (taking)
+			use->pool->used += use->amount;
+		else
+			use->pool->used -= use->amount;
+	}
+}
+
+/* Take the first rule off the heap that has the resources it needs free,
+ * leaving the others where they were.  held needs room for every rule
+ * in the heap.  Returns -1 if none of them can run yet.
+ */
+static int ready_pop_free(ready_heap *heap, const sched_node *nodes, int *held)
+{
+	int nheld = 0;
+	int i = -1;
+
+	while (heap->len > 0) {
+		i = ready_pop(heap);
+		if (resources_free(nodes[i].rule))
+			break;
+		held[nheld++] = i;
+		i = -1;
+	}
+	while (nheld > 0)
+		ready_push(heap, held[--nheld]);
+
+	return i;
+}
+
+/* Return 1 if the load average is at least load (and load is set) */
+static int overloaded(double load)
+{
+	double avg;
+
+	return load > 0 && getloadavg(&avg, 1) == 1 && avg >= load;
+}
+
+/* Build the scheduler's view of the sorted rules.
+ * Each rule's index is set to its position in sorted, and the nodes are
+ * returned with the dependency counts and reverse edges filled in.
+ */
+static sched_node *build_sched_nodes(tm_rule **sorted, int n)
+{
+	sched_node *nodes = calloc(n, sizeof(sched_node));
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		sorted[i]->index = i;
+		nodes[i].rule = sorted[i];
+	}
+
+	for (i = 0; i < n; i++) {
+		tm_rule *rule = nodes[i].rule;
+		int d;
+
+		for (d = 0; d < rule->ndeps; d++) {
+			/* topsort() included every dependency */
+			j = rule->deps[d]->index;
+			nodes[i].pending++;
+			nodes[j].dependents = realloc(nodes[j].dependents,
+			                      (nodes[j].ndependents + 1) * sizeof(int));
+			nodes[j].dependents[nodes[j].ndependents++] = i;
+		}
+	}
+
+	return nodes;
+}
+
+/* Return how long a rule's recipe is expected to take: as long as it
+ * took last time, or guess if it hasn't been timed yet.
+ */
+static double rule_cost(tm_rule *rule, double guess)
+{
+	if (rule->type != TM_EXPLICIT || !rule->recipe)
+		return 0;
+
+	return rule->duration > 0 ? rule->duration : guess;
+}
+
+/* Fill in path with how long it would take to make each of the n rules
+ * in nodes followed by the slowest chain of the rules that depend on it,
+ * going by how long their recipes took last time.  A recipe that hasn't
+ * been timed is guessed to take as long as the average one that has.
+ */
+static void critical_paths(sched_node *nodes, int n, double *path)
+{
+	double total = 0;
+	double guess = 1;
+	int ntimed = 0;
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		tm_rule *rule = nodes[i].rule;
+
+		if (rule->type == TM_EXPLICIT && rule->recipe && rule->duration > 0) {
+			total += rule->duration;
+			ntimed++;
+		}
+	}
+	if (ntimed > 0)
+		guess = total / ntimed;
+
+	/* Every rule comes before the rules that depend on it */
+	for (i = n - 1; i >= 0; i--) {
+		double longest = 0;
+
+		for (j = 0; j < nodes[i].ndependents; j++) {
+			if (path[nodes[i].dependents[j]] > longest)
+				longest = path[nodes[i].dependents[j]];
+		}
+		path[i] = rule_cost(nodes[i].rule, guess) + longest;
+	}
+}
+
+/* Return a string of a rule's dependencies separated by spaces.
+ * For INPUTS they're listed last one first, and for OODATE (only the
+ * ones that are out of date) in the order given, as they always were.
+ */
+static char *deps_to_string(tm_cache *cache, tm_rule *rule, int oodate)
+{
+	char *str = NULL;
+	char *p = NULL;
+	int len = 1;    /* for NUL terminator */
+	int step = oodate ? 1 : -1;
+	int i;
+
+	/* Only the deps given in the TMakefile: not the discovered ones */
+	for (i = 0; i < rule->ninputs; i++) {
+		len += strlen(rule->deps[i]->target) + 1;
+	}
+
+	str = malloc(len);
+	p = str;
+	for (i = oodate ? 0 : rule->ninputs - 1; i >= 0 && i < rule->ninputs; i += step) {
+		tm_rule *dep = rule->deps[i];
+
+		if (!oodate || dep->updated || needs_update(cache, dep->target)) {
+			p += sprintf(p, p == str ? "%s" : " %s", dep->target);
+		}
+	}
+	*p = '\0';
+
+	return str;
+}
+
+/* Build the Tcl command that evaluates the recipe for a rule */
+static char *recipe_command(tm_cache *cache, tm_rule *rule)
+{
+	const char *fmt = "recipe::%s {%s} {%s} {%s}";
+	const char *target = rule->target;
+	const char *proc = rule->pattern ? rule->pattern->name : target;
+	char *inputs = deps_to_string(cache, rule, 0);
+	char *oodate = deps_to_string(cache, rule, 1);
+	int len = strlen(fmt) + strlen(proc) + strlen(target) + strlen(inputs) + strlen(oodate) + 1;
+	char *cmd = malloc(len);
+
+	sprintf(cmd, fmt, proc, target, inputs, oodate);
+
+	free(oodate);
+	free(inputs);
+
+	return cmd;
+}
+
+/* Make the artifact cache key of a rule from its target, the digest of
+ * its recipe, and the contents of its inputs, discovered ones included.
+ * Returns 0 if the rule can't be shared: an input made by a recipe
+ * without leaving a file behind, one without a recipe, or a discovered
+ * one that's gone has nothing to put in the key.
+ */
+static int rule_artifact_key(tm_cache *cache, tm_rule *rule, char key[ARTIFACT_KEY_LENGTH])
+{
+	char hash[CRYPTO_HASH_STRING_LENGTH];
+	char *data = NULL;
+	char *p = NULL;
+	size_t len = strlen(rule->target) + CRYPTO_HASH_STRING_LENGTH + 1;
+	int i;
+
+	for (i = 0; i < rule->ndeps; i++) {
+		len += strlen(rule->deps[i]->target) + CRYPTO_HASH_STRING_LENGTH + 1;
+	}
+
+	data = malloc(len);
+	p = data;
+	p += sprintf(p, "%s", rule->target) + 1;
+	TM_CRYPTO_HASH_TO_STRING(rule_digest(rule), hash);
+	p += sprintf(p, "%s", hash) + 1;
+
+	for (i = 0; i < rule->ndeps; i++) {
+		tm_rule *dep = rule->deps[i];
+		tm_cache_entry *entry = cache_entry(dep);
+
+		if (dep->discovered && !file_exists(dep->target)) {
+			free(data);
+			return 0;
+		}
+
+		if (dep->type == TM_FILENAME) {
+			if (entry && !dep->have_digest) {
+				/* checked (and hashed, if it changed) earlier in this run */
+				strcpy(hash, entry->hash);
+			} else {
+				TM_CRYPTO_HASH_TO_STRING(rule_digest(dep), hash);
+			}
+		} else if (entry && entry->have_output) {
+			strcpy(hash, entry->output);
+		} else {
+			free(data);
+			return 0;
+		}
+
+		p += sprintf(p, "%s", dep->target) + 1;
+		p += sprintf(p, "%s", hash) + 1;
+	}
+
+	artifact_key(cache->artifacts, data, p - data, key);
+	free(data);
+
+	return 1;
+}
+
+/* Replace the discovered deps of a rule with the ones listed in the
+ * depfile its recipe just wrote.  Files discovered for the first time are
+ * remembered as they are now, so they don't count as changed next time.
+ */
+static void read_rule_depfile(tm_cache *cache, tm_rule *rule)
+{
+	target_list *deps = NULL;
+	target_list *node = NULL;
+	int i;
+
+	if (!rule->depfile) {
 		return;
 	}
-	
-	for (; sorted_rules; sorted_rules = sorted_rules->next) {
-		tm_rule *rule = sorted_rules->rule;
-		if (rule->type == TM_EXPLICIT) {
-			/* If the rule has a recipe and needs an update */
-			if (rule->recipe
-			&&  (force || needs_update(db, tmfile, rule->target))) {
-				/* Execute the recipe for the current rule */
-				const char *fmt = "recipe::%s {%s} {%s} {%s}";
-				int len = 0;
-				char *cmd = NULL;
-				const char *target = rule->target;
-				char *inputs = target_list_to_string(rule->deps);
-				target_list *oodate_deps = need_update(db, tmfile, rule->deps);
-				char *oodate = target_list_to_string(oodate_deps);
-				tm_rule_list *oodate_rules = find_rules(oodate_deps, tm_rules);
-
-				if (was_updated(target)) {
-					goto done;
-				}
 
-				update_rules(db, interp, tmfile, oodate_rules, force, silence);
-
-				if (!silence)
-					printf("Making target %s:\n", rule->target);
-
-				len = strlen(fmt) + strlen(target)*2 + strlen(inputs) + strlen(oodate) + 1;
-				cmd = malloc(len);
-				sprintf(cmd, fmt, target, target, inputs, oodate);
-				wrap(interp, Jim_Eval(interp, cmd));
-
-				update(db, tmfile, rule->target);
-				if (!silence)
-					printf("\n");
-
-				done:
-				free(cmd);
-				free(oodate);
-				free(inputs);
-				free_rule_list(oodate_rules);
-				free_target_list(oodate_deps);
-
-				rule->type = TM_UPDATED;
-			} 
-		} else if (rule->type == TM_FILENAME) {
-			/* Check that the file actually exists */
-			if (!file_exists(rule->target)) {
-				fprintf(stderr, "ERROR: Unable to find rule for target %s\n", rule->target);
-				exit(EXIT_FAILURE);
+	if (read_depfile(rule->depfile, &deps) != 0) {
+		fprintf(stderr, "WARNING: Unable to read depfile %s for target %s\n",
+		        rule->depfile, rule->target);
+		return;
+	}
+
+	clear_discovered_deps(rule);
+	for (node = deps; node; node = node->next) {
+		add_discovered_dep(rule, node->name);
+	}
+	free_target_list(deps);
+	rule->scanned = 1;
+
+	for (i = rule->ninputs; i < rule->ndeps; i++) {
+		tm_rule *dep = rule->deps[i];
+		char hash[CRYPTO_HASH_STRING_LENGTH];
+		tm_file_stat st;
+
+		if (dep->type == TM_FILENAME && !cache_entry(dep)
+		&&  file_stat(dep->target, &st) == 0) {
+			TM_CRYPTO_HASH_TO_STRING(rule_digest(dep), hash);
+			cache_store(cache, dep, hash, &st, NULL);
+		}
+	}
+}
+
+/* Restore the target of a rule from the artifact cache, if it's there.
+ * Returns 1 if it was restored.
+ */
+static int restore_rule(tm_cache *cache, tm_rule *rule)
+{
+	char key[ARTIFACT_KEY_LENGTH];
+
+	/* Without its discovered deps, the key would miss some of its inputs,
+	 * and only the first target of a group would be restored */
+	if (!cache->artifacts || (rule->depfile && !rule->scanned) || rule->next_output
+	||  !rule_artifact_key(cache, rule, key)) {
+		return 0;
+	}
+
+	return artifact_restore(cache->artifacts, key, rule->target);
+}
+
+/* Share the target a recipe just made through the artifact cache.
+ */
+static void store_rule(tm_cache *cache, tm_rule *rule)
+{
+	char key[ARTIFACT_KEY_LENGTH];
+
+	if (!cache->artifacts || !file_exists(rule->target)
+	||  (rule->depfile && !rule->scanned) || rule->next_output
+	||  !rule_artifact_key(cache, rule, key)) {
+		return;
+	}
+
+	artifact_store(cache->artifacts, key, rule->target);
+}
+
+/* A target restored from the artifact cache is a hard link to the cached
+ * copy, so it has to be given a copy of its own before a recipe can write
+ * to it.  That's done even when the artifact cache isn't in use now, since
+ * it may have been when the target was restored.
+ */
+static void unshare_target(tm_rule *rule)
+{
+	tm_rule *output = NULL;
+
+	for (output = rule; output; output = output->next_output) {
+		artifact_unshare(output->target);
+	}
+}
+
+/* Record what a recipe that just succeeded did: the deps it discovered,
+ * the artifact it made, and the new state of its target, along with the
+ * other targets of its group if it has one.
+ */
+static void recipe_done(tm_cache *cache, tm_rule *rule)
+{
+	tm_rule *output = NULL;
+
+	read_rule_depfile(cache, rule);
+	store_rule(cache, rule);
+	update(cache, rule->target);
+	rule->made = 1;
+
+	for (output = rule->next_output; output; output = output->next_output) {
+		update(cache, output->target);
+		output->made = 1;
+	}
+}
+
+/* Begin making a rule whose dependencies have all been made.
+ * Rules that don't need a child process are finished right away and 0 is
+ * returned.  Otherwise the recipe is started in a child process, which is
+ * recorded in job, and 1 is returned.
+ */
+static int start_rule(tm_cache *cache, Jim_Interp *interp, tm_rule *rule,
+                      int force, int silence, int jobs, int sync, tm_job *job)
+{
+	tm_trace_mark mark;
+	double started;
+	char *cmd = NULL;
+	int ret;
+
+	if (rule->type == TM_FILENAME) {
+		/* Check that the file actually exists.  A discovered one that's
+		 * gone just means whatever read it has to be made again. */
+		if (!file_exists(rule->target)) {
+			if (rule->discovered) {
+				mark_updated(rule);
+				rule->made = 1;
+				return 0;
+			}
+			fprintf(stderr, "ERROR: Unable to find rule for target %s\n", rule->target);
+			exit(EXIT_FAILURE);
+		}
+		if (force || needs_update(cache, rule->target)) {
+			update(cache, rule->target);
+			rule->made = 1;
+		}
+		return 0;
+	}
+
+	/* Only explicit rules with a recipe that need an update have work to do */
+	if (rule->type != TM_EXPLICIT || !rule->recipe
+	||  !(force || needs_update(cache, rule->target))) {
+		return 0;
+	}
+
+	trace_begin(&mark);
+	if (!force && !rule->always_oodate && restore_rule(cache, rule)) {
+		trace_end(&mark, "artifact", rule->target, 0, "");
+		if (!silence)
+			printf("Restored target %s from the artifact cache\n", rule->target);
+		update(cache, rule->target);
+		rule->made = 1;
+		return 0;
+	}
+
+	unshare_target(rule);
+	cmd = recipe_command(cache, rule);
+
+	if (jobs > 1) {
+		job->started = now();
+		trace_begin(&job->mark);
+		job->pid = spawn_recipe(interp, rule->target, cmd, silence, sync, job);
+		free(cmd);
+
+		if (job->pid < 0) {
+			fprintf(stderr, "ERROR: Unable to start a process for target %s\n", rule->target);
+			exit(EXIT_FAILURE);
+		}
+		return 1;
+	}
+
+	/* With only one job, evaluate the recipe right here.  The recipe might
+	 * run another TMk in this directory, so commit what we have first. */
+	if (!silence)
+		printf("Making target %s:\n", rule->target);
+	cache_flush(cache);
+	started = now();
+	trace_begin(&mark);
+	ret = Jim_Eval(interp, cmd);
+	trace_recipe(&mark, rule->target, 1, (long)getpid(), ret == JIM_ERR ? EXIT_FAILURE : 0, -1);
+	wrap(interp, ret);
+	free(cmd);
+	rule->duration = now() - started;
+
+	recipe_done(cache, rule);
+	if (!silence)
+		printf("\n");
+
+	return 0;
+}
+
+/* Mark a node as finished and queue any dependents that are now ready */
+static void finish_rule(sched_node *nodes, int i, ready_heap *ready)
+{
+	int j;
+
+	for (j = 0; j < nodes[i].ndependents; j++) {
+		int dependent = nodes[i].dependents[j];
+
+		if (--nodes[dependent].pending == 0)
+			ready_push(ready, dependent);
+	}
+}
+
+
+/* Return the lowest trace lane (from 1 up) not taken by one of the
+ * nrunning jobs in running.
+ */
+static int free_lane(const tm_job *running, int nrunning)
+{
+	int lane = 1;
+	int i;
+
+	for (i = 0; i < nrunning; i++) {
+		if (running[i].lane == lane) {
+			lane++;
+			i = -1;    /* start over */
+		}
+	}
+
+	return lane;
+}
+
+
+/* Update all the rules in sorted that need updating.
+ * Takes the cache for the TMakefile that was evaluated, a Jim
+ * interpreter containing the recipe definitions, the n rules to be
+ * updated if needed (as sorted by topsort()), whether or not to force
+ * updates regardless of out-of-date status, whether or not
+ * we're running in silent mode, the maximum number of recipes
+ * to run at once, the load average at which to stop starting more (or 0),
+ * and whether to hold the output of each recipe run in a child process
+ * until it's finished.
+ *
+ * A rule is made once all of its dependencies have been made.  When
+ * more than one job is allowed, each recipe is evaluated in a child
+ * process so that every rule that is ready can be made at the same time,
+ * and the ones with the longest chain of recipes ahead of them (going by
+ * how long the recipes took last time) are started first.  Recipes are
+ * also limited by the GNU make jobserver TMk is part of, or else sets up
+ * for them (see jobserver_start()), and by the pools their rules use:
+ * a rule that's ready waits while its pools are too full, and the rules
+ * behind it go ahead.
+ * If a recipe fails, no new recipes are started, the ones already
+ * running are allowed to finish, and then TMk exits.
+ *
+ * Returns the number of rules that were made (or files found changed).
+ */
+int update_rules(tm_cache *cache, Jim_Interp *interp,
+                 tm_rule **sorted,
+                 int n,
+                 int force,
+                 int silence,
+                 int jobs,
+                 double load,
+                 int sync)
+{
+	sched_node *nodes = NULL;
+	ready_heap ready;
+	tm_job *running = NULL;
+	tm_rule **files = NULL;
+	tm_trace_mark mark;
+	char args[32];
+	double *path = NULL;
+	int *held = NULL;
+	int nfiles = 0;
+	int nrunning = 0;
+	int tokens = 0;
+	int failed = 0;
+	int made = 0;
+	int i;
+
+	if (n == 0) {
+		/* nothing to do */
+		return 0;
+	}
+
+	if (jobs < 1)
+		jobs = 1;
+
+	nodes = build_sched_nodes(sorted, n);
+
+	/* Check all the files up front, in parallel */
+	files = malloc(n * sizeof(tm_rule *));
+	for (i = 0; i < n; i++) {
+		tm_rule *rule = nodes[i].rule;
+
+		if (rule->type == TM_FILENAME && !rule->have_digest) {
+			tm_cache_entry *entry = cache_entry(rule);
+
+			/* A server watching the file has seen no change since its
+			 * stat last matched the cache */
+			if (rule->watched && entry && entry->have_stat)
+				entry->unchanged = 1;
+			else
+				files[nfiles++] = rule;
+		}
+	}
+	trace_begin(&mark);
+	scan_files(files, nfiles);
+	sprintf(args, "\"files\": %d", nfiles);
+	trace_end(&mark, "phase", "scan files", 0, args);
+	free(files);
+
+	/* With more than one job, start the rules on the critical path first,
+	 * so a long chain of recipes isn't left until the end */
+	if (jobs > 1) {
+		path = malloc(n * sizeof(double));
+		critical_paths(nodes, n, path);
+	}
+
+	running = calloc(jobs < n ? jobs : n, sizeof(tm_job));
+	ready.items = malloc(n * sizeof(int));
+	ready.len = 0;
+	held = malloc(n * sizeof(int));
+	ready.path = path;
+
+	for (i = 0; i < n; i++) {
+		if (nodes[i].pending == 0)
+			ready_push(&ready, i);
+	}
+
+	jobserver_start(interp, jobs);
+
+	for (;;) {
+		tm_rule *rule = NULL;
+		pid_t pid;
+		int done;
+		int status = 0;
+		double cpu = 0;
+		double duration;
+		int want_token = 0;
+
+		/* Start everything that's ready and has room in its pools, up to
+		 * the job and load limits.  Every recipe but the first needs a
+		 * token from the jobserver. */
+		while (!failed && ready.len > 0 && nrunning < jobs) {
+			if (nrunning > 0 && overloaded(load))
+				break;
+			if (nrunning > tokens) {
+				if (!jobserver_acquire()) {
+					want_token = 1;
+					break;
+				}
+				tokens++;
 			}
-			if (force || needs_update(db, tmfile, rule->target)) {
-				update(db, tmfile, rule->target);
-				rule->type = TM_UPDATED;
+
+			i = ready_pop_free(&ready, nodes, held);
+			if (i < 0)
+				break;
+
+			if (start_rule(cache, interp, nodes[i].rule,
+			               force, silence, jobs, sync, &running[nrunning])) {
+				claim_resources(nodes[i].rule, 1);
+				running[nrunning].node = i;
+				running[nrunning].lane = free_lane(running, nrunning);
+				nrunning++;
+			} else {
+				finish_rule(nodes, i, &ready);
 			}
 		}
+
+		/* Don't keep tokens that aren't being used */
+		while (tokens > 0 && tokens >= nrunning) {
+			jobserver_release();
+			tokens--;
+		}
+
+		if (nrunning == 0)
+			break;
+
+		/* Wait for one of the recipes to finish, without holding the
+		 * cache locked in the meantime, and collecting their output.
+		 * If rules are waiting on a token, wait for one of those too. */
+		cache_flush(cache);
+		pid = wait_recipe(&status, &cpu, 0);
+		if (pid == 0) {
+			wait_jobs(running, nrunning, want_token);
+			continue;
+		}
+		if (pid < 0) {
+			fprintf(stderr, "ERROR: Lost track of running recipes\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < nrunning; i++) {
+			if (running[i].pid == pid)
+				break;
+		}
+		if (i == nrunning)
+			continue;    /* not one of ours */
+
+		finish_output(&running[i]);
+		done = running[i].node;
+		rule = nodes[done].rule;
+		trace_recipe(&running[i].mark, rule->target, running[i].lane, (long)pid, status, cpu);
+		duration = now() - running[i].started;
+		running[i] = running[--nrunning];
+		claim_resources(rule, 0);
+
+		if (status != 0) {
+			fprintf(stderr, "ERROR: Failed to make target %s\n", rule->target);
+			failed = 1;
+			continue;
+		}
+
+		rule->duration = duration;
+		recipe_done(cache, rule);
+		finish_rule(nodes, done, &ready);
+	}
+
+	jobserver_stop(interp);
+
+	for (i = 0; i < n; i++) {
+		if (nodes[i].rule->made)
+			made++;
+		free(nodes[i].dependents);
+	}
+	free(nodes);
+	free(path);
+	free(running);
+	free(ready.items);
+	free(held);
+
+	if (failed) {
+		exit(EXIT_FAILURE);
+	}
+
+	return made;
+}
+
+/* Sort rules slowest recipe first */
+static int compare_duration(const void *a, const void *b)
+{
+	const tm_rule *ra = *(tm_rule * const *)a;
+	const tm_rule *rb = *(tm_rule * const *)b;
+
+	return (ra->duration < rb->duration) - (ra->duration > rb->duration);
+}
+
+/* Display the slowest recipes among the n sorted rules, and the chain of
+ * recipes that took the longest to make one after another, going by how
+ * long each recipe took when it was last evaluated.
+ */
+static void profile_report(tm_rule **sorted, int n)
+{
+	sched_node *nodes = build_sched_nodes(sorted, n);
+	double *path = malloc(n * sizeof(double));
+	tm_rule **timed = malloc(n * sizeof(tm_rule *));
+	int ntimed = 0;
+	int i, j;
+
+	critical_paths(nodes, n, path);
+
+	for (i = 0; i < n; i++) {
+		if (nodes[i].rule->type == TM_EXPLICIT && nodes[i].rule->recipe
+		&&  nodes[i].rule->duration > 0) {
+			timed[ntimed++] = nodes[i].rule;
+		}
+	}
+	qsort(timed, ntimed, sizeof(tm_rule *), compare_duration);
+
+	printf("Slowest recipes:\n");
+	for (i = 0; i < ntimed && i < PROFILE_SLOWEST; i++) {
+		printf("  %9.3fs  %s\n", timed[i]->duration, timed[i]->target);
+	}
+
+	/* The critical path starts from the rule with the longest path and
+	 * follows the slowest of its dependents at each step */
+	for (i = 0, j = 1; j < n; j++) {
+		if (path[j] > path[i])
+			i = j;
+	}
+	printf("Critical path (%.3fs):\n", n > 0 ? path[i] : 0.0);
+	while (n > 0) {
+		tm_rule *rule = nodes[i].rule;
+		int next = -1;
+
+		if (rule->type == TM_EXPLICIT && rule->recipe) {
+			if (rule->duration > 0)
+				printf("  %9.3fs  %s\n", rule->duration, rule->target);
+			else
+				printf("  %10s  %s\n", "untimed", rule->target);
+		}
+
+		for (j = 0; j < nodes[i].ndependents; j++) {
+			int dependent = nodes[i].dependents[j];
+
+			if (next < 0 || path[dependent] > path[next])
+				next = dependent;
+		}
+		if (next < 0)
+			break;
+		i = next;
+	}
+
+	for (i = 0; i < n; i++) {
+		free(nodes[i].dependents);
 	}
+	free(nodes);
+	free(path);
+	free(timed);
 }
 
+/* Bring goal up to date, as described by the TMakefile tmfile that's
+ * been evaluated in interp.  No more recipes are started while the load
+ * average is at least load (unless it's 0), and with sync, the output of
+ * each recipe is held until it's finished (see update_rules()).  Prints statistics about
+ * the caches if verbose is set, and the slowest recipes if profile is set.
+ * Returns EXIT_SUCCESS, or EXIT_FAILURE if there's no rule for goal (a
+ * failed recipe exits right away).
+ */
+int make_goal(Jim_Interp *interp, const char *tmfile, const char *goal,
+              int force, int silence, int jobs, double load, int sync,
+              int verbose, int profile)
+{
+	tm_cache cache;
+	tm_artifacts artifacts;
+	tm_trace_mark mark;
+	tm_rule **sorted_rules = NULL;
+	tm_rule *rule = NULL;
+	int nsorted = 0;
+	int made = 0;
+
+	/* Before the cache is loaded, so the rules made have their rows */
+	trace_begin(&mark);
+	resolve_patterns(goal);
+	trace_end(&mark, "phase", "resolve patterns", 0, "");
+
+	rule = find_rule(goal, &tm_rule_index);
+	if (!rule || rule->type == TM_FILENAME) {
+		fprintf(stderr, "ERROR: No rule for goal %s\n", goal);
+		return EXIT_FAILURE;
+	}
+
+	/* The cache adds the dependencies discovered on earlier runs to the
+	 * graph, so it's loaded before the graph is sorted */
+	trace_begin(&mark);
+	if (cache_open(&cache, tmfile) < 0) {
+		return EXIT_FAILURE;
+	}
+	cache_load(&cache);
+	trace_end(&mark, "cache", "load cache", 0, "");
+
+	trace_begin(&mark);
+	sorted_rules = topsort(goal, &tm_rule_index, &nsorted);
+	trace_end(&mark, "phase", "topsort", 0, "");
+
+	if (!sorted_rules) {
+		fprintf(stderr, "ERROR: Could not find rule to make %s\n", goal);
+		exit(EXIT_FAILURE);
+	}
+
+	artifacts_open(&artifacts, interp);
+	if (artifacts.dir) {
+		cache.artifacts = &artifacts;
+	}
+
+	made = update_rules(&cache, interp, sorted_rules, nsorted, force, silence, jobs, load, sync);
+
+	if (made == 0 && !silence) {
+		printf("Target %s is up to date\n", goal);
+	}
+
+	trace_begin(&mark);
+	if (cache_close(&cache) < 0) {
+		fprintf(stderr, "WARNING: Exiting while " TM_CACHE " database is busy\n");
+	}
+	artifacts_close(&artifacts);
+	trace_end(&mark, "cache", "close caches", 0, "");
+	if (verbose) {
+		cache_summary(&cache);
+		if (cache.artifacts) {
+			artifacts_summary(&artifacts);
+		}
+	}
+	if (profile) {
+		profile_report(sorted_rules, nsorted);
+	}
+
+	free(sorted_rules);
+
+	return EXIT_SUCCESS;
+}
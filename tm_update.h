@@ -1,30 +1,33 @@
 #ifndef TM_UPDATE_H
 #define TM_UPDATE_H
 
-#include <sqlite3.h>
-
 #define JIM_EMBEDDED
 #include <jim.h>
 
 #include "tm_target.h"
-
-extern target_list *updated_targets;
-
+#include "tm_cache.h"
 
 int file_exists(const char *filename);
+int file_unchanged(tm_rule *rule);
 
 void wrap(Jim_Interp *interp, int error);
 
-int update(sqlite3 *db, const char *tmfile, const char *target);
-int was_updated(const char *target);
-int needs_update(sqlite3 *db, const char *tmfile, const char *target);
-target_list *need_update(sqlite3 *db, const char *tmfile, target_list *targets);
-
-void update_rules(sqlite3 *db,
-                  Jim_Interp *interp,
-                  const char *tmfile,
-                  tm_rule_list *sorted_rules,
-                  int force,
-                  int silence);
+int update(tm_cache *cache, const char *target);
+int needs_update(tm_cache *cache, const char *target);
+target_list *need_update(tm_cache *cache, target_list *targets);
+
+int update_rules(tm_cache *cache,
+                 Jim_Interp *interp,
+                 tm_rule **sorted,
+                 int n,
+                 int force,
+                 int silence,
+                 int jobs,
+                 double load,
+                 int sync);
+
+int make_goal(Jim_Interp *interp, const char *tmfile, const char *goal,
+              int force, int silence, int jobs, double load, int sync,
+              int verbose, int profile);
 
 #endif
@@ -2,14 +2,18 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <sqlite3.h>
-
 #define JIM_EMBEDDED
 #include <jim.h>
 
 #include "tmake.h"
 #include "tm_target.h"
+#include "tm_cache.h"
 #include "tm_update.h"
+#include "tm_server.h"
+#include "tm_trace.h"
+#include "tm_jobs.h"
+#include "tm_exec.h"
+#include "tm_snapshot.h"
 #include "tm_core_cmds.h"
 #include "tm_ext_cmds.h"
 
@@ -43,12 +47,30 @@ static void usage(const char *progname)
 	printf(" -P <path>         Add <path> to the list of directories to search\n"
 	       "                   for TMake packages.\n");
 	printf(" -D <param>        Define <param> for the execution of TMakefile\n");
+	printf(" -j <jobs>         Make up to <jobs> targets at the same time, sharing\n"
+	       "                   them with any make or TMk run by the recipes.\n");
+	printf(" -l <load>         Don't start more targets while the load average\n"
+	       "                   is at least <load> (with -j).\n");
 	printf(" -V <var>          Display the value of variable <var> without\n"
 	       "                   executing any commands.\n");
 	printf(" -e                Initialize the values of parameters from corresponding\n"
 	       "                   environment variables.\n");
 	printf(" -u                Force update of target even if it is not out of date.\n");
 	printf(" -s                Only output errors, if anything at all.\n");
+	printf(" -v                Display statistics about the caches when done.\n");
+	printf(" --server          Keep the evaluated TMakefile around and make targets\n"
+	       "                   for other invocations of %s in this directory.\n", progname);
+	printf(" --profile         Display the slowest recipes and the critical path\n"
+	       "                   when done.\n");
+	printf(" --output-sync     Display the output of each recipe all together once\n"
+	       "                   it's finished, rather than as it's made (with -j).\n");
+	printf(" --no-snapshot     Evaluate the TMakefile even if a snapshot of it\n"
+	       "                   could be loaded instead.\n");
+	printf(" --cache-stats     Display what's in " TM_CACHE " here, and how big it is.\n");
+	printf(" --cache-vacuum    Remove what's in " TM_CACHE " for TMakefiles that are\n"
+	       "                   gone, and shrink it.\n");
+	printf(" --trace=<file>    Write a timeline of the build to <file>, to be\n"
+	       "                   viewed with a Chrome trace viewer.\n");
 	printf(" PARAM=VALUE       Set the parameter PARAM to VALUE.\n");
 	exit(1);
 }
@@ -127,6 +149,16 @@ int main(int argc, char **argv)
 	int force_update = 0;
 	int no_execute = 0;
 	int env_lookup = 0;
+	int jobs = 1;
+	int jobs_given = 0;
+	int jobserver = -1;
+	double load = 0;
+	int verbose = 0;
+	int server = 0;
+	int output_sync = 0;
+	int snapshot = 1;
+	const char *trace = NULL;
+	int profile = 0;
 	target_list *also_include = NULL;
 	target_list *also_package = NULL;
 	target_list *parameters = NULL;
@@ -134,19 +166,30 @@ int main(int argc, char **argv)
 	target_list *display_vars = NULL;
 
 	int retval = EXIT_SUCCESS;
-	tm_rule_list *sorted_rules = NULL;
 
 	Jim_Interp *interp = NULL;
-	sqlite3 *db = NULL;
-	int sqlrc = 0;
-	char *sqlerr = NULL;
+	tm_trace_mark mark;
 
 	target_list *node = NULL;
 
 	int i;
 
 	for (i = 1; i < argc; i++) {
-		if (argv[i][0] == '-') {
+		if (strcmp(argv[i], "--server") == 0) {
+			server = 1;
+		} else if (strcmp(argv[i], "--profile") == 0) {
+			profile = 1;
+		} else if (strcmp(argv[i], "--output-sync") == 0) {
+			output_sync = 1;
+		} else if (strcmp(argv[i], "--no-snapshot") == 0) {
+			snapshot = 0;
+		} else if (strcmp(argv[i], "--cache-stats") == 0) {
+			return cache_stats() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+		} else if (strcmp(argv[i], "--cache-vacuum") == 0) {
+			return cache_vacuum() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+		} else if (strncmp(argv[i], "--trace=", 8) == 0 && argv[i][8]) {
+			trace = argv[i] + 8;
+		} else if (argv[i][0] == '-') {
 			switch (argv[i][1]) {
 				case 'f':
 					if (strcmp(filename, DEFAULT_FILE) == 0) {
@@ -158,6 +201,9 @@ int main(int argc, char **argv)
 				case 's':
 					silent = 1;
 					break;
+				case 'v':
+					verbose = 1;
+					break;
 				case 'n':
 					no_execute = 1;
 					break;
@@ -176,6 +222,19 @@ int main(int argc, char **argv)
 				case 'D':
 					defines = target_cons(get(&i, argc, argv), defines);
 					break;
+				case 'j':
+					jobs = atoi(get(&i, argc, argv));
+					if (jobs < 1) {
+						usage(argv[0]);
+					}
+					jobs_given = 1;
+					break;
+				case 'l':
+					load = atof(get(&i, argc, argv));
+					if (load <= 0) {
+						usage(argv[0]);
+					}
+					break;
 				case 'V':
 					display_vars = target_cons(get(&i, argc, argv), display_vars);
 					break;
@@ -192,6 +251,30 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* Under a GNU make jobserver, make as many targets at once as it allows,
+	 * unless -j says otherwise */
+	jobserver = jobserver_join();
+	if (jobserver > 0 && !jobs_given) {
+		jobs = jobserver;
+	}
+
+	/* If a server has the TMakefile evaluated already, let it do the build,
+	 * unless this build would evaluate it differently */
+	if (!server && snapshot && jobserver < 0 && !load && !trace && !profile && !output_sync && !no_execute
+	&&  !env_lookup && !also_include && !also_package && !parameters && !defines
+	&&  !display_vars) {
+		int status = request_build(filename, goal, force_update, silent, jobs, verbose);
+
+		if (status >= 0) {
+			return status;
+		}
+	}
+
+	if (trace && trace_open(trace) != 0) {
+		fprintf(stderr, "ERROR: Unable to open %s for writing\n", trace);
+		return (EXIT_FAILURE);
+	}
+
 	/* Create a Tcl interpreter */
 	interp = Jim_CreateInterp();
 	if (interp == NULL) {
@@ -209,6 +292,7 @@ int main(int argc, char **argv)
 	wrap(interp, Jim_Eval(interp, "set TM_OPSYS " TM_OPSYS));
 	wrap(interp, Jim_Eval(interp, "set TM_MACHINE_ARCH " TM_MACHINE_ARCH));
 	wrap(interp, Jim_tm_ext_cmdsInit(interp));
+	tm_RegisterExecCommand(interp);
 
 	register_search_paths(interp, also_include, also_package);
 	free_target_list(also_include);
@@ -254,6 +338,8 @@ int main(int argc, char **argv)
 		wrap(interp, Jim_Eval(interp, "set TM_SILENT_MODE 1"));
 	}
 
+	Jim_SetGlobalVariableStr(interp, "TM_JOBS", Jim_NewIntObj(interp, jobs));
+
 	goal = goal ? goal : tm_goal;
 
 	if (goal) {
@@ -265,9 +351,22 @@ int main(int argc, char **argv)
 		wrap(interp, Jim_Eval(interp, cmd));
 	}
 
-	/* TMakefile evaluation */
+	/* TMakefile evaluation, unless it can be loaded from a snapshot of the
+	 * last time it was evaluated the same way */
 	if (file_exists(filename)) {
-		wrap(interp, Jim_EvalFile(interp, filename));
+		trace_begin(&mark);
+		if (snapshot && snapshot_load(interp, filename)) {
+			trace_end(&mark, "phase", "load snapshot", 0, "");
+		} else {
+			if (snapshot) {
+				snapshot_watch(interp, filename);
+			}
+			wrap(interp, Jim_EvalFile(interp, filename));
+			if (snapshot) {
+				snapshot_save(interp, filename);
+			}
+			trace_end(&mark, "phase", "evaluate TMakefile", 0, "");
+		}
 	} else {
 		fprintf(stderr, "ERROR: Could not open %s for reading\n", filename);
 		retval = EXIT_FAILURE;
@@ -291,64 +390,25 @@ int main(int argc, char **argv)
 
 		free_target_list(rev);
 		if (tm_goal) free(tm_goal);
-		free_rule_list(tm_rules);
+		free_graph();
 		Jim_FreeInterp(interp);
 		exit(EXIT_SUCCESS);
 	}
 
 	goal = goal ? goal : tm_goal;
 
-	if (!find_rule(goal, tm_rules)) {
-		fprintf(stderr, "ERROR: No rule for goal %s\n", goal);
-		exit(EXIT_FAILURE);
-	}
-
-	find_files(&tm_rules);
-
-	sorted_rules = topsort(goal, tm_rules);
-
-	if (!sorted_rules) {
-		fprintf(stderr, "ERROR: Could not find rule to make %s\n", goal);
-		exit(EXIT_FAILURE);
-	}
-
-	sqlrc = sqlite3_open(TM_CACHE, &db);
-	if (sqlrc != SQLITE_OK) {
-		fprintf(stderr, "ERROR: Unable to open " TM_CACHE " database\n");
-		exit(EXIT_FAILURE);
-	}
-
-	sqlrc = sqlite3_exec(db,
-		"CREATE TABLE IF NOT EXISTS TMCache ("
-			"TMakefile    TEXT,"
-			"Target       TEXT,"
-			"Hash         TEXT,"
-		"CONSTRAINT OneFileTarget UNIQUE (TMakefile, Target) ON CONFLICT REPLACE"
-		")",
-		NULL, NULL, &sqlerr
-	);
-
-	if (sqlrc != SQLITE_OK) {
-		fprintf(stderr, "ERROR: Unable to create database schema: %s", sqlerr);
-		sqlite3_free(sqlerr);
-		exit(EXIT_FAILURE);
-	}
-
-	update_rules(db, interp, filename, sorted_rules, force_update, silent);
-
-	if (!updated_targets && !silent) {
-		printf("Target %s is up to date\n", goal);
+	if (server) {
+		retval = serve(interp, filename, argv);
+	} else if (make_goal(interp, filename, goal, force_update, silent, jobs, load,
+	                     output_sync, verbose, profile) != EXIT_SUCCESS) {
+		retval = EXIT_FAILURE;
+	} else if (verbose) {
+		snapshot_summary();
 	}
 
-	free_rule_list(sorted_rules);
-	free_rule_list(tm_rules);
+	free_graph();
 	if (tm_goal) free(tm_goal);
 
-	sqlrc = sqlite3_close(db);
-	if (sqlrc != SQLITE_OK) {
-		fprintf(stderr, "WARNING: Exiting while " TM_CACHE " database is busy\n");
-	}
-
 	/* Free the Tcl interpreter */
 	Jim_FreeInterp(interp);
 
@@ -6,6 +6,7 @@
 #endif
 
 #define TM_CACHE ".tmcache"
+#define TM_SOCKET ".tmk.sock"
 #define DEFAULT_FILE "TMakefile"
 
 #ifndef TM_OPSYS